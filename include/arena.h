@@ -1,19 +1,41 @@
 #ifndef ARENA_H
 #define ARENA_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-typedef struct {
-    uint8_t *data;
+// Blocks at least this large are mapped directly from the OS (and backed by
+// transparent huge pages where available) instead of coming from malloc
+#define ARENA_MMAP_THRESHOLD (1024 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
     size_t capacity;
     size_t size;
+    bool mapped;
+    uint8_t data[];
+} ArenaBlock;
+
+// Chain of blocks, each at least twice as large as the one before it.
+// Allocations never move, so pointers stay valid until a clear or restore.
+typedef struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
 } Arena;
 
+typedef struct {
+    ArenaBlock *block;
+    size_t size;
+} ArenaMark;
+
 Arena *arena_init(size_t capacity);
 void arena_free(Arena *arena);
 void *arena_alloc_aligned(Arena *arena, size_t size, size_t alignment);
 void *arena_alloc(Arena *arena, size_t size);
 void arena_clear(Arena *arena);
+void arena_reset(Arena *arena);
+ArenaMark arena_save(Arena *arena);
+void arena_restore(Arena *arena, ArenaMark mark);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,43 @@
+#ifndef AUTODIFF_H
+#define AUTODIFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "environment.h"
+#include "parser.h"
+
+// Most inputs autodiff_forward differentiates with respect to in one pass
+#define AUTODIFF_MAX_TANGENTS 8
+
+typedef struct {
+    int32_t a; // Tape indices of the operands, or -1 when constant. Leaves
+    int32_t b; // have no operands, and 'b' holds their symbol instead.
+    double da; // Partial derivatives with respect to the operands
+    double db;
+    double adjoint;
+} TapeEntry;
+
+// Workspace of automatic differentiation. It grows to the largest evaluation
+// seen and is reused afterwards, so repeated calls don't allocate.
+typedef struct {
+    Arena *arena; // Never cleared, outgrown arrays are left behind
+    TapeEntry *entries;
+    int count;
+    int capacity;
+
+    int *current;     // Per symbol: tape index of its value, or a state below
+    double *tangents; // Per symbol, AUTODIFF_MAX_TANGENTS each
+    int symbol_capacity;
+
+    bool failed;
+} Tape;
+
+Tape tape_init();
+void tape_free(Tape *tape);
+double autodiff_reverse(Tape *tape, Node *node, SymbolTable *symbol_table, double *gradient);
+double autodiff_forward(Tape *tape, Node *node, SymbolTable *symbol_table, const int *symbols, int count,
+                        double *gradient);
+
+#endif
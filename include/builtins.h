@@ -0,0 +1,65 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUILTIN_MAX_ARGUMENTS 8
+
+// Receives 'arity' values
+typedef double (*BuiltinFn)(const double *arguments);
+
+// Receives 'arity' columns of 'count' values. 'out' may be the same memory as
+// an argument column, so every value must be read before it is overwritten.
+typedef void (*BuiltinBatchFn)(const double *const *arguments, double *out, size_t count);
+
+typedef enum {
+    BUILTIN_PURE = 1 << 0, // Result depends only on the arguments, so calls can be folded and shared
+} BuiltinFlags;
+
+typedef enum {
+    BUILTIN_SIN,
+    BUILTIN_COS,
+    BUILTIN_TAN,
+    BUILTIN_ARCSIN,
+    BUILTIN_ARCCOS,
+    BUILTIN_ARCTAN,
+    BUILTIN_SINH,
+    BUILTIN_COSH,
+    BUILTIN_TANH,
+    BUILTIN_ARCSINH,
+    BUILTIN_ARCCOSH,
+    BUILTIN_ARCTANH,
+    BUILTIN_ABS,
+    BUILTIN_SQRT,
+    BUILTIN_LN,
+    BUILTIN_LOG,
+    BUILTIN_EXP,
+    BUILTIN_DIGAMMA,
+    BUILTIN_E,
+    BUILTIN_PI,
+    BUILTIN_COUNT, // Registered functions are numbered from here
+} BuiltinId;
+
+typedef struct {
+    const char *name;
+    int length;
+    uint32_t id;
+    int arity;            // Number of arguments, or -1 for constants
+    unsigned flags;
+    BuiltinFn function;
+    BuiltinBatchFn batch; // Optional
+    double value;         // Value of a constant
+} Builtin;
+
+extern const Builtin builtins[BUILTIN_COUNT];
+
+// The registry is global and not synchronized: register functions before
+// parsing, and only clear it once no tree or program refers to them.
+bool builtin_register(const char *name, int arity, BuiltinFn function, BuiltinBatchFn batch, unsigned flags);
+void builtin_clear();
+const Builtin *builtin_lookup(const char *name, int length);
+const Builtin *builtin_get(uint32_t id);
+
+#endif
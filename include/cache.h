@@ -0,0 +1,51 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compiler.h"
+#include "parser.h"
+
+#define CACHE_DEFAULT_CAPACITY 4096
+
+typedef struct {
+    size_t hits;
+    size_t misses;    // Including expressions that failed to parse
+    size_t evictions;
+} CacheStats;
+
+typedef struct {
+    char *text; // Owned copy of the key
+    size_t length;
+    uint32_t hash;
+    int next;   // Next entry in the same bucket, or -1
+    int newer;  // Neighbours in recency order, or -1
+    int older;
+    Program program;
+} CacheEntry;
+
+// Bounded map from expression text to compiled programs. When full, the least
+// recently used entry is evicted and its program storage is reused.
+typedef struct {
+    CacheEntry *entries;
+    int count;
+    int capacity;
+
+    int *buckets; // Head entry of each chain, or -1
+    int bucket_capacity; // Power of two
+
+    int newest;
+    int oldest;
+
+    Parser parser; // Only holds the tree of the expression being compiled
+    Program spare; // Compiled into on a miss, then swapped with the entry
+    unsigned flags; // Passed to optimizer_fold
+    CacheStats stats;
+} Cache;
+
+Cache cache_init(int capacity, unsigned flags);
+void cache_free(Cache *cache);
+const Program *cache_get(Cache *cache, const char *text, size_t length);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parser.h"
+
+typedef enum {
+    OP_CONST,  // r[dst] = constants[a]
+    OP_LOAD,   // r[dst] = slots[a]
+    OP_STORE,  // slots[dst] = r[a]
+    OP_MOVE,   // r[dst] = r[a]
+    OP_NEG,    // r[dst] = -r[a]
+    OP_FACT,   // r[dst] = r[a]!
+    OP_ADD,    // r[dst] = r[a] + r[b]
+    OP_SUB,    // r[dst] = r[a] - r[b]
+    OP_MUL,    // r[dst] = r[a] * r[b]
+    OP_DIV,    // r[dst] = r[a] / r[b]
+    OP_POW,    // r[dst] = r[a] ^ r[b]
+    OP_CALL,   // r[dst] = functions[b](r[a], r[a + 1], ...)
+    OP_RETURN, // return r[a]
+} OpCode;
+
+typedef struct {
+    uint8_t op;
+    uint32_t dst;
+    uint32_t a;
+    uint32_t b;
+} Instruction;
+
+typedef struct {
+    const char *name;
+    int length;
+    bool input;    // Read before any store, so its value must come from outside
+    bool assigned; // Written by the program
+    int symbol;    // Bound symbol table index, or -1 when unresolved
+} ProgramSlot;
+
+typedef struct {
+    Instruction *code;
+    int count;
+    int capacity;
+
+    double *constants;
+    int constant_count;
+    int constant_capacity;
+
+    ProgramSlot *slots;
+    int slot_count;
+    int slot_capacity;
+
+    const Builtin **functions;
+    int function_count;
+    int function_capacity;
+
+    char *names;
+    int register_count;
+} Program;
+
+Program program_init();
+void program_free(Program *program);
+int program_slot(const Program *program, const char *name, int length);
+void program_print(const Program *program);
+bool compiler_compile(Program *program, Node *root);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef DERIVE_H
+#define DERIVE_H
+
+#include <stdbool.h>
+
+#include "arena.h"
+#include "parser.h"
+
+Node *derive(Arena *arena, Node *root, const char *name);
+bool derive_gradient(Arena *arena, Node *root, const char *const *names, int count, Node **gradient);
+
+#endif
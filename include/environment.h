@@ -1,28 +1,72 @@
 #ifndef ENVIRONMENT_H
 #define ENVIRONMENT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "arena.h"
 #include "parser.h"
+#include "pool.h"
 
-#define MAX_SYMBOLS 128
+#define ENV_E 2.7182818284590452354
+#define ENV_PI 3.14159265358979323846
 
 typedef struct {
     const char *name;
     int length;
+    uint32_t hash;
     double value;
 } Symbol;
 
+typedef enum {
+    EVAL_OK = 0,
+    EVAL_DIVISION_BY_ZERO = 1 << 0,
+} EvalError;
+
+typedef struct {
+    const char *name;
+    int length;
+    const double *data; // One value per row
+} Column;
+
+// Called after the value of symbol index 'symbol' is set
+typedef void (*SymbolSetFn)(void *context, int symbol);
+
+// Symbols are stored densely in insertion order, so indices are stable until a
+// clear, while pointers returned by symbol_table_get are invalidated when a new
+// symbol is set
 typedef struct {
-    Symbol symbols[MAX_SYMBOLS];
+    Symbol *symbols;
     int count;
-    Arena *arena;
+    int capacity;
+
+    int *index;         // Open-addressing hash of symbol indices, -1 when empty
+    int index_capacity; // Power of two
+
+    Arena *arena;       // Interned names
+
+    SymbolSetFn on_set; // Optional, see graph.h
+    void *on_set_context;
 } SymbolTable;
 
 SymbolTable symbol_table_init();
 void symbol_table_free(SymbolTable *symbol_table);
 Symbol *symbol_table_get(SymbolTable *table, const char *name, int length);
 void symbol_table_set(SymbolTable *table, const char *name, int length, double value);
+void symbol_table_store(SymbolTable *table, int symbol, double value);
+// Removes every symbol, including the 'e' and 'pi' of symbol_table_init. This
+// breaks the index stability above: trees bound with env_bind, slots resolved
+// against the table and any attached graph must not be used with it again.
+// Meant for scratch tables, such as the locals of stream workers.
+void symbol_table_clear(SymbolTable *table);
 void symbol_table_print(SymbolTable *symbol_table);
+double custom_pow(double a, double b);
+int env_bind(Node *node, SymbolTable *symbol_table);
 double env_evaluate(Node *node, SymbolTable *symbol_table);
+double env_evaluate_local(Node *node, const SymbolTable *symbol_table, SymbolTable *locals);
+long env_evaluate_batch(Node *node, SymbolTable *symbol_table, const Column *columns, int column_count,
+                        size_t rows, double *out, uint8_t *errors);
+long env_evaluate_parallel(Node *node, SymbolTable *symbol_table, const Column *columns, int column_count,
+                           size_t rows, double *out, uint8_t *errors, Pool *pool);
 
 #endif
\ No newline at end of file
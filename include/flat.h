@@ -0,0 +1,63 @@
+#ifndef FLAT_H
+#define FLAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "environment.h"
+#include "parser.h"
+
+typedef enum {
+    FLAT_NUMBER,     // constants[a]
+    FLAT_IDENTIFIER, // names[a]
+    FLAT_ASSIGN,     // names[a] = nodes[b]
+    FLAT_PLUS,       // +nodes[a]
+    FLAT_NEGATE,     // -nodes[a]
+    FLAT_FACTORIAL,  // nodes[a]!
+    FLAT_ADD,        // nodes[a] + nodes[b]
+    FLAT_SUBTRACT,   // nodes[a] - nodes[b]
+    FLAT_MULTIPLY,   // nodes[a] * nodes[b]
+    FLAT_DIVIDE,     // nodes[a] / nodes[b]
+    FLAT_POWER,      // nodes[a] ^ nodes[b]
+    FLAT_CALL,       // builtin b called with the nodes listed from arguments[a]
+} FlatOp;
+
+typedef struct {
+    uint8_t op;
+    uint32_t a;
+    uint32_t b;
+} FlatNode;
+
+typedef struct {
+    uint32_t offset; // Into the string bytes
+    uint32_t length;
+} FlatName;
+
+// AST stored as indices instead of pointers, so it can be copied or written
+// out as is. Nodes are in post-order: children come before their parents and
+// the root is last, so evaluation is a single forward pass.
+typedef struct {
+    FlatNode *nodes;
+    uint32_t count;
+
+    double *constants;
+    uint32_t constant_count;
+
+    FlatName *names;
+    uint32_t name_count;
+
+    uint32_t *arguments; // Node indices of call arguments, one run per call
+    uint32_t argument_count;
+
+    char *strings;
+    uint32_t string_size;
+} FlatTree;
+
+bool flat_from_node(FlatTree *tree, Node *root);
+Node *flat_to_node(const FlatTree *tree, Arena *arena);
+void flat_free(FlatTree *tree);
+void flat_print(const FlatTree *tree);
+double flat_apply(const FlatTree *tree, uint32_t index, const double *values);
+double flat_evaluate(const FlatTree *tree, SymbolTable *symbol_table);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef FLAT_FILE_H
+#define FLAT_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flat.h"
+#include "stream.h"
+
+#define FLAT_FILE_MAGIC "MATHFLAT"
+#define FLAT_FILE_VERSION 1
+#define FLAT_FILE_BYTE_ORDER 0x01020304u
+
+typedef enum {
+    FLAT_SECTION_TREES,     // FlatFileTree, plus one past the last tree
+    FLAT_SECTION_NODES,     // FlatNode, with zeroed padding
+    FLAT_SECTION_CONSTANTS, // double
+    FLAT_SECTION_NAMES,     // FlatName
+    FLAT_SECTION_ARGUMENTS, // uint32_t
+    FLAT_SECTION_FUNCTIONS, // FlatFileFunction
+    FLAT_SECTION_STRINGS,   // char
+    FLAT_SECTION_COUNT,
+} FlatSection;
+
+typedef struct {
+    uint64_t offset; // From the start of the file, a multiple of 8
+    uint64_t count;  // Elements, not bytes
+} FlatFileSection;
+
+// All integers are in the byte order of the machine that wrote the file,
+// which 'byte_order' records so another one can reject it
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // FLAT_FILE_BYTE_ORDER as written
+    uint64_t size;       // Whole file, to detect truncation
+    FlatFileSection sections[FLAT_SECTION_COUNT];
+} FlatFileHeader;
+
+// Each tree has its own runs of the shared sections, which end where the runs
+// of the next tree start. Indices inside a tree are relative to its runs, so a
+// loaded tree is a FlatTree pointing into the file.
+typedef struct {
+    uint32_t node_offset;
+    uint32_t constant_offset;
+    uint32_t name_offset;
+    uint32_t argument_offset;
+    uint32_t string_offset;
+} FlatFileTree;
+
+// Builtin ids of registered functions depend on the order of registration, so
+// the callees are stored by name and matched up again when loading
+typedef struct {
+    uint32_t id;     // As used by the FLAT_CALL nodes of the file
+    int32_t arity;
+    FlatName name;   // Into the strings section
+} FlatFileFunction;
+
+typedef struct {
+    StreamFile source;
+    FlatNode *nodes; // Into the source, or a patched copy when callee ids moved
+    bool patched;
+
+    const FlatFileHeader *header;
+    const FlatFileTree *trees;
+    uint32_t tree_count;
+} FlatFile;
+
+bool flat_file_write(const char *path, const FlatTree *trees, uint32_t tree_count);
+bool flat_file_open(FlatFile *file, const char *path);
+void flat_file_close(FlatFile *file);
+bool flat_file_tree(const FlatFile *file, uint32_t index, FlatTree *tree);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stddef.h>
+
+#include "environment.h"
+#include "parser.h"
+
+typedef struct {
+    size_t recomputed; // Nodes evaluated again because something they read changed
+    size_t skipped;    // Nodes whose cached value was still valid
+} GraphStats;
+
+// Formulas kept up to date as the symbols they read change. Owns copies of the
+// formulas, and hooks into the symbol table until it is freed.
+typedef struct Graph Graph;
+
+Graph *graph_init(SymbolTable *symbol_table);
+void graph_free(Graph *graph);
+int graph_add(Graph *graph, Node *root);
+double graph_value(const Graph *graph, int formula);
+GraphStats graph_stats(const Graph *graph);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "compiler.h"
+#include "parser.h"
+
+// Same contract as vm_run
+typedef double (*JitFunction)(double *slots);
+
+// A compiled program with its native code. Without native code (a build
+// without MATHPARSER_JIT, another architecture, or a program too large for
+// the stack frame), jit_run runs the program on the VM instead.
+typedef struct {
+    Program program;
+    JitFunction native; // NULL when running on the VM
+    void *code;         // Executable mapping holding 'native'
+    size_t code_size;
+} Jit;
+
+Jit jit_init();
+void jit_free(Jit *jit);
+bool jit_compile(Jit *jit, Node *root);
+double jit_run(const Jit *jit, double *slots);
+
+#endif
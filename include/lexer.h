@@ -1,6 +1,9 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef enum {
     // Basic types
     TOK_NUMBER,
@@ -10,24 +13,38 @@ typedef enum {
     TOK_PLUS, TOK_MINUS, TOK_STAR,
     TOK_SLASH, TOK_CARET, TOK_EQUAL,
     TOK_BANG, TOK_LPAREN, TOK_RPAREN,
+    TOK_COMMA,
 
     // Other
+    TOK_NEWLINE, // Only produced when lexing lines
     TOK_ERROR,
     TOK_EOF,
 } TokenType;
 
+// Ordered to pack into 16 bytes, since bulk lexing stores one per token
 typedef struct {
     TokenType type;
-    const char *start;
     int length;
+    const char *start;
 } Token;
 
 typedef struct {
     const char *current;
+    const char *end;
+    bool lines; // Report line breaks as TOK_NEWLINE instead of skipping them
 } Lexer;
 
+typedef struct {
+    Token *tokens; // Ends with TOK_EOF
+    size_t count;
+    size_t capacity;
+} TokenList;
+
 void lexer_reset(Lexer *lexer, const char *text);
+void lexer_reset_span(Lexer *lexer, const char *text, size_t length);
 Token lexer_next(Lexer *lexer);
 int lexer_print(Lexer *lexer);
+bool lexer_tokenize(TokenList *list, const char *text, size_t length);
+void token_list_free(TokenList *list);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,17 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+// Converts a number token as lexed by lexer_next (decimal with optional
+// fraction and exponent, or hexadecimal with optional fraction and binary
+// exponent) to the nearest double. The span does not need to be terminated.
+double number_parse(const char *start, int length);
+
+#define NUMBER_FORMAT_SIZE 32
+
+// Writes the shortest decimal that converts back to exactly 'value', followed
+// by a terminator, and returns its length. Magnitudes in [1e-7, 1e21) are
+// written in fixed notation, others as "1.5e+300". NaN and infinities are
+// written as "nan", "inf" and "-inf".
+int number_format(double value, char *buffer);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "parser.h"
+
+// Allow rewrites that change IEEE results for some inputs (signed zeros, NaN, infinities)
+#define OPTIMIZE_FAST_MATH (1u << 0)
+
+typedef struct {
+    long unique; // Distinct nodes, each shared node counted once
+    long total;  // Nodes of the equivalent tree, shared nodes counted per use
+} NodeCount;
+
+int optimizer_fold(Node *node, unsigned flags);
+// Shared nodes are computed once per evaluation by compiled programs
+// (compiler_compile, vm_run, jit_run) and flat trees (flat_evaluate).
+// env_evaluate walks the DAG as a tree and still computes them once per use.
+int optimizer_share(Node **roots, int root_count);
+NodeCount optimizer_count(Node *root);
+
+#endif
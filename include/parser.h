@@ -2,6 +2,7 @@
 #define PARSER_H
 
 #include "arena.h"
+#include "builtins.h"
 #include "lexer.h"
 
 typedef enum {
@@ -17,6 +18,7 @@ struct Node; // Forward declaration
 typedef struct {
     const char *name;
     int length;
+    int slot; // Index into the bound symbol table, or -1 when unresolved
 } IdentifierData;
 
 typedef struct {
@@ -32,7 +34,9 @@ typedef struct {
 
 typedef struct {
     struct Node *function;
-    struct Node *argument;
+    struct Node **arguments;
+    int argument_count;     // Always the arity of the builtin
+    const Builtin *builtin; // Resolved by the parser
 } CallData;
 
 typedef struct Node {
@@ -49,6 +53,7 @@ typedef struct Node {
 
 typedef struct {
     Lexer lexer;
+    const Token *tokens; // Next pre-lexed token, or NULL to lex on demand
     Arena *arena;
     Token current;
     Token previous;
@@ -77,5 +82,7 @@ void node_print(Node *node);
 Parser parser_init();
 void parser_free(Parser *parser);
 Node *parser_parse(Parser *parser, const char *expr);
+Node *parser_parse_span(Parser *parser, const char *text, size_t length);
+Node *parser_parse_tokens(Parser *parser, const TokenList *list, size_t *position);
 
 #endif
\ No newline at end of file
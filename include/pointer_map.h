@@ -0,0 +1,19 @@
+#ifndef POINTER_MAP_H
+#define POINTER_MAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    const void **keys; // NULL when empty
+    int64_t *values;
+    int count;
+    int capacity; // Power of two
+} PointerMap;
+
+PointerMap pointer_map_init();
+void pointer_map_free(PointerMap *map);
+bool pointer_map_get(const PointerMap *map, const void *key, int64_t *value);
+bool pointer_map_set(PointerMap *map, const void *key, int64_t value);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+#define POOL_SCRATCH_CAPACITY (1024 * 256)
+
+// Runs one task on 'worker' (0 is the calling thread). The scratch arena belongs
+// to that worker alone and is reset after every task, keeping its largest block.
+typedef void (*PoolTaskFn)(void *context, size_t task, int worker, Arena *scratch);
+
+typedef struct Pool Pool;
+
+Pool *pool_init(int thread_count);
+void pool_free(Pool *pool);
+int pool_size(const Pool *pool);
+void pool_run(Pool *pool, size_t task_count, PoolTaskFn fn, void *context);
+
+#endif
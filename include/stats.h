@@ -0,0 +1,69 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "builtins.h"
+#include "parser.h"
+
+#define STATS_NODE_TYPES (NODE_CALL + 1)
+
+// Counters since start-up or the last stats_reset. Cycles come from the time
+// stamp counter on x86-64, and from clock() ticks elsewhere. Constant folding,
+// which evaluates without a symbol table, is left out of the tree evaluation
+// counters.
+typedef struct {
+    uint64_t arena_bytes;       // Bytes handed out by arena_alloc
+    uint64_t arena_reserved;    // Bytes of blocks the arenas currently hold
+    uint64_t arena_high_water;  // Most bytes held at once
+    uint64_t arena_failures;    // Allocations that returned NULL
+    uint64_t tokens;            // Tokens lexed
+    uint64_t nodes;             // Nodes built by the parser
+    // Tree evaluation
+    uint64_t visits[STATS_NODE_TYPES]; // Nodes evaluated, by NodeType
+    uint64_t lookups;           // Symbol table lookups by name
+    uint64_t probes;            // Index slots checked by those lookups
+    uint64_t max_probes;        // Longest single lookup
+    uint64_t calls[BUILTIN_COUNT + 1]; // Builtin calls by id, registered functions last
+    uint64_t nans;              // env_evaluate results that are NaN
+    uint64_t errors;            // Undefined variables and divisions by zero
+    // Timers
+    uint64_t parses;            // parser_parse and its span and token variants
+    uint64_t parse_cycles;
+    uint64_t evaluations;       // env_evaluate
+    uint64_t evaluate_cycles;
+} Stats;
+
+// True when built with MATHPARSER_STATS. Otherwise the hooks compile to
+// nothing and every snapshot is zero.
+bool stats_enabled();
+
+// The counters are global and updated atomically, so pool and stream workers
+// can share them. A snapshot taken while other threads run may mix counts from
+// slightly different moments.
+Stats stats_snapshot();
+void stats_reset();
+void stats_print(FILE *stream, const Stats *stats);
+uint64_t stats_clock();
+void stats_max(uint64_t *counter, uint64_t value);
+
+#ifdef MATHPARSER_STATS
+extern Stats stats_counters;
+
+// STATS_ADD and STATS_SUB return the new value
+#define STATS_ADD(field, amount) __atomic_add_fetch(&stats_counters.field, (uint64_t)(amount), __ATOMIC_RELAXED)
+#define STATS_SUB(field, amount) __atomic_sub_fetch(&stats_counters.field, (uint64_t)(amount), __ATOMIC_RELAXED)
+#define STATS_MAX(field, value) stats_max(&stats_counters.field, (uint64_t)(value))
+#define STATS_START(start) uint64_t start = stats_clock()
+#define STATS_STOP(start, count, cycles) (STATS_ADD(count, 1), STATS_ADD(cycles, stats_clock() - (start)))
+#else
+#define STATS_ADD(field, amount) ((void)0)
+#define STATS_SUB(field, amount) ((void)0)
+#define STATS_MAX(field, value) ((void)0)
+#define STATS_START(start) ((void)0)
+#define STATS_STOP(start, count, cycles) ((void)0)
+#endif
+
+#endif
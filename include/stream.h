@@ -0,0 +1,32 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "environment.h"
+#include "parser.h"
+#include "pool.h"
+
+typedef struct {
+    size_t lines;  // Including blank lines
+    size_t errors; // Lines that failed to parse
+} StreamStats;
+
+// Whole file in memory, mapped where the platform allows it
+typedef struct {
+    char *text;
+    size_t length;
+    bool mapped;
+} StreamFile;
+
+bool stream_evaluate(Parser *parser, SymbolTable *symbol_table, FILE *input, FILE *output, StreamStats *stats);
+
+bool stream_open(StreamFile *file, const char *path);
+void stream_close(StreamFile *file);
+size_t stream_line_count(const char *text, size_t length);
+bool stream_evaluate_parallel(const char *text, size_t length, const SymbolTable *symbol_table, double *results,
+                              FILE *output, StreamStats *stats, Pool *pool);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compiler.h"
+#include "environment.h"
+
+#define VM_BLOCK_SIZE 256
+
+typedef struct {
+    const double *column; // Indexed by row, or NULL to broadcast 'scalar'
+    double scalar;
+} VmInput;
+
+int vm_bind(Program *program, SymbolTable *symbol_table);
+double vm_run(const Program *program, double *slots);
+double vm_evaluate(const Program *program, SymbolTable *symbol_table);
+size_t vm_batch_scratch_size(const Program *program);
+size_t vm_run_batch(const Program *program, const VmInput *inputs, size_t first_row, size_t row_count,
+                    double *out, uint8_t *errors, void *scratch);
+
+#endif
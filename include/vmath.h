@@ -0,0 +1,40 @@
+#ifndef VMATH_H
+#define VMATH_H
+
+#include <stddef.h>
+
+// Accuracy of the array kernels, which batch evaluation uses for function
+// calls, '^' and '!'. Single evaluations always call libm.
+typedef enum {
+    VMATH_STRICT, // libm, value by value
+    VMATH_FAST,   // Vectorized approximations, within 4 ulp of libm, but a few hundred for '^' and '!'
+} VmathMode;
+
+// The mode is global and not synchronized: set it before evaluating. It
+// defaults to VMATH_FAST in builds with MATHPARSER_FAST_MATH.
+void vmath_set_mode(VmathMode mode);
+VmathMode vmath_mode();
+
+// Each kernel computes 'count' values, and 'out' may be the same memory as
+// the input.
+void vmath_sin(const double *x, double *out, size_t count);
+void vmath_cos(const double *x, double *out, size_t count);
+void vmath_tan(const double *x, double *out, size_t count);
+void vmath_asin(const double *x, double *out, size_t count);
+void vmath_acos(const double *x, double *out, size_t count);
+void vmath_atan(const double *x, double *out, size_t count);
+void vmath_sinh(const double *x, double *out, size_t count);
+void vmath_cosh(const double *x, double *out, size_t count);
+void vmath_tanh(const double *x, double *out, size_t count);
+void vmath_asinh(const double *x, double *out, size_t count);
+void vmath_acosh(const double *x, double *out, size_t count);
+void vmath_atanh(const double *x, double *out, size_t count);
+void vmath_fabs(const double *x, double *out, size_t count);
+void vmath_sqrt(const double *x, double *out, size_t count);
+void vmath_log(const double *x, double *out, size_t count);
+void vmath_log10(const double *x, double *out, size_t count);
+void vmath_exp(const double *x, double *out, size_t count);
+void vmath_pow(const double *a, const double *b, double *out, size_t count); // custom_pow
+void vmath_factorial(const double *x, double *out, size_t count);            // tgamma(x + 1)
+
+#endif
@@ -1,9 +1,18 @@
+#define _DEFAULT_SOURCE
+
 #include <stdint.h>
 #include <stdlib.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define ARENA_MMAP
+#endif
+
 #include "arena.h"
+#include "stats.h"
 
 #define DEFAULT_ALIGNMENT (2 * sizeof(void *))
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 #define is_power_two(x) ((x != 0) && ((x & (x - 1)) == 0))
 
 static uintptr_t align_forward(uintptr_t ptr, size_t alignment) {
@@ -18,37 +27,117 @@ static uintptr_t align_forward(uintptr_t ptr, size_t alignment) {
     return p;
 }
 
+static ArenaBlock *block_init(size_t capacity) {
+    size_t total = sizeof(ArenaBlock) + capacity;
+    ArenaBlock *block = NULL;
+    bool mapped = false;
+
+#ifdef ARENA_MMAP
+    if (capacity >= ARENA_MMAP_THRESHOLD) {
+        void *memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            block = memory;
+            mapped = true;
+#ifdef MADV_HUGEPAGE
+            if (total >= HUGE_PAGE_SIZE) madvise(memory, total, MADV_HUGEPAGE);
+#endif
+        }
+    }
+#endif
+
+    if (block == NULL) block = malloc(total);
+    if (block == NULL) return NULL;
+
+    block->next = NULL;
+    block->capacity = capacity;
+    block->size = 0;
+    block->mapped = mapped;
+
+    STATS_MAX(arena_high_water, STATS_ADD(arena_reserved, total));
+    return block;
+}
+
+static void block_free(ArenaBlock *block) {
+    STATS_SUB(arena_reserved, sizeof(ArenaBlock) + block->capacity);
+
+#ifdef ARENA_MMAP
+    if (block->mapped) {
+        munmap(block, sizeof(ArenaBlock) + block->capacity);
+        return;
+    }
+#endif
+
+    free(block);
+}
+
+static void free_after(ArenaBlock *block) {
+    ArenaBlock *next = block->next;
+    block->next = NULL;
+
+    while (next) {
+        ArenaBlock *following = next->next;
+        block_free(next);
+        next = following;
+    }
+}
+
+static void *block_alloc(ArenaBlock *block, size_t size, size_t alignment) {
+    uintptr_t current = (uintptr_t)block->data + (uintptr_t)block->size;
+    uintptr_t offset = align_forward(current, alignment);
+    if (offset == 0) return NULL;
+
+    offset -= (uintptr_t)block->data;
+    if (offset + size > block->capacity) return NULL;
+
+    void *ptr = block->data + offset;
+    block->size = offset + size;
+
+    return ptr;
+}
+
 Arena *arena_init(size_t capacity) {
     Arena *arena = malloc(sizeof(Arena));
     if (arena == NULL) return NULL;
 
-    arena->data = malloc(capacity);
-    if (arena->data == NULL) {
+    arena->first = block_init(capacity);
+    if (arena->first == NULL) {
         free(arena);
         return NULL;
     }
 
-    arena->capacity = capacity;
-    arena->size = 0;
+    arena->current = arena->first;
     return arena;
 }
 
 void arena_free(Arena *arena) {
-    free(arena->data);
+    free_after(arena->first);
+    block_free(arena->first);
     free(arena);
 }
 
 void *arena_alloc_aligned(Arena *arena, size_t size, size_t alignment) {
-    uintptr_t current = (uintptr_t)arena->data + (uintptr_t)arena->size;
-    uintptr_t offset = align_forward(current, alignment);
+    STATS_ADD(arena_bytes, size);
 
-    offset -= (uintptr_t)arena->data;
-    if (offset + size > arena->capacity) return NULL;
+    void *ptr = block_alloc(arena->current, size, alignment);
+    if (ptr != NULL) return ptr;
+    if (!is_power_two(alignment)) {
+        STATS_ADD(arena_failures, 1);
+        return NULL;
+    }
 
-    void *ptr = arena->data + offset;
-    arena->size = offset + size;
+    size_t capacity = arena->current->capacity ? arena->current->capacity * 2 : DEFAULT_ALIGNMENT;
+    while (capacity < size + alignment) capacity *= 2;
 
-    return ptr;
+    ArenaBlock *block = block_init(capacity);
+    if (block == NULL) {
+        STATS_ADD(arena_failures, 1);
+        return NULL;
+    }
+
+    arena->current->next = block;
+    arena->current = block;
+
+    return block_alloc(block, size, alignment);
 }
 
 void *arena_alloc(Arena *arena, size_t size) {
@@ -56,6 +145,32 @@ void *arena_alloc(Arena *arena, size_t size) {
     return arena_alloc_aligned(arena, size, DEFAULT_ALIGNMENT);
 }
 
+// Releases every block but the first, which stays allocated for reuse
 void arena_clear(Arena *arena) {
-    arena->size = 0;
+    free_after(arena->first);
+    arena->first->size = 0;
+    arena->current = arena->first;
+}
+
+// Releases every block but the last, which is the largest and becomes the
+// first, so the next round of allocations of the same size fits in one block
+void arena_reset(Arena *arena) {
+    while (arena->first != arena->current) {
+        ArenaBlock *next = arena->first->next;
+        block_free(arena->first);
+        arena->first = next;
+    }
+
+    arena->first->size = 0;
+}
+
+ArenaMark arena_save(Arena *arena) {
+    return (ArenaMark){arena->current, arena->current->size};
+}
+
+// Frees everything allocated since the mark was saved
+void arena_restore(Arena *arena, ArenaMark mark) {
+    free_after(mark.block);
+    mark.block->size = mark.size;
+    arena->current = mark.block;
 }
\ No newline at end of file
@@ -0,0 +1,479 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "autodiff.h"
+
+#define TAPE_ARENA_CAPACITY (64 * 1024)
+#define TAPE_INITIAL_CAPACITY 256
+#define TAPE_SYMBOL_CAPACITY 64
+
+#define TAPE_CONSTANT -1  // Index of values that depend on no symbol
+#define SYMBOL_UNREAD -2  // Neither read nor assigned yet in this evaluation
+#define SYMBOL_ASSIGNED 0 // Forward mode: the tangents of the symbol are stored
+
+Tape tape_init() {
+    Tape tape = {0};
+    tape.arena = arena_init(TAPE_ARENA_CAPACITY);
+
+    if (tape.arena == NULL) {
+        fprintf(stderr, "Error: Unable to initialize tape arena\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return tape;
+}
+
+void tape_free(Tape *tape) {
+    arena_free(tape->arena);
+    *tape = (Tape){0};
+}
+
+static bool reserve_entries(Tape *tape) {
+    if (tape->count < tape->capacity) return true;
+
+    int capacity = tape->capacity ? tape->capacity * 2 : TAPE_INITIAL_CAPACITY;
+    TapeEntry *entries = arena_alloc(tape->arena, sizeof(TapeEntry) * capacity);
+    if (entries == NULL) {
+        fprintf(stderr, "Error: Unable to allocate tape\n");
+        tape->failed = true;
+        return false;
+    }
+
+    if (tape->count > 0) memcpy(entries, tape->entries, sizeof(TapeEntry) * tape->count);
+    tape->entries = entries;
+    tape->capacity = capacity;
+    return true;
+}
+
+// Makes room for 'count' symbols, marking the new ones unread
+static bool reserve_symbols(Tape *tape, int count) {
+    if (count <= tape->symbol_capacity) return true;
+
+    int capacity = tape->symbol_capacity ? tape->symbol_capacity : TAPE_SYMBOL_CAPACITY;
+    while (capacity < count) capacity *= 2;
+
+    int *current = arena_alloc(tape->arena, sizeof(int) * capacity);
+    double *tangents = arena_alloc(tape->arena, sizeof(double) * capacity * AUTODIFF_MAX_TANGENTS);
+    if (current == NULL || tangents == NULL) {
+        fprintf(stderr, "Error: Unable to allocate tape\n");
+        tape->failed = true;
+        return false;
+    }
+
+    int old = tape->symbol_capacity;
+    if (old > 0) {
+        memcpy(current, tape->current, sizeof(int) * old);
+        memcpy(tangents, tape->tangents, sizeof(double) * old * AUTODIFF_MAX_TANGENTS);
+    }
+
+    for (int i = old; i < capacity; i++) current[i] = SYMBOL_UNREAD;
+
+    tape->current = current;
+    tape->tangents = tangents;
+    tape->symbol_capacity = capacity;
+    return true;
+}
+
+static bool tape_reset(Tape *tape, const SymbolTable *symbol_table) {
+    tape->count = 0;
+    tape->failed = false;
+    if (!reserve_symbols(tape, symbol_table->count)) return false;
+
+    for (int i = 0; i < tape->symbol_capacity; i++) tape->current[i] = SYMBOL_UNREAD;
+    return true;
+}
+
+static int32_t push(Tape *tape, int32_t a, int32_t b, double da, double db) {
+    if (!reserve_entries(tape)) return TAPE_CONSTANT;
+
+    tape->entries[tape->count] = (TapeEntry){a, b, da, db, 0.0};
+    return tape->count++;
+}
+
+// Records an operation on two values, leaving out constant operands. Only
+// leaves have no operand, so 'a' is always set.
+static int32_t operation(Tape *tape, int32_t a, int32_t b, double da, double db) {
+    if (a == TAPE_CONSTANT) {
+        if (b == TAPE_CONSTANT) return TAPE_CONSTANT;
+        return push(tape, b, TAPE_CONSTANT, db, 0.0);
+    }
+
+    return push(tape, a, b, da, db);
+}
+
+static int lookup(SymbolTable *symbol_table, const IdentifierData *identifier) {
+    if (identifier->slot >= 0) return identifier->slot;
+
+    Symbol *symbol = symbol_table_get(symbol_table, identifier->name, identifier->length);
+    return symbol ? (int)(symbol - symbol_table->symbols) : -1;
+}
+
+// Stores an assigned value like env_evaluate does, returning the symbol index
+static int assign(SymbolTable *symbol_table, const IdentifierData *target, double value) {
+    if (target->slot >= 0) {
+        symbol_table_store(symbol_table, target->slot, value);
+        return target->slot;
+    }
+
+    symbol_table_set(symbol_table, target->name, target->length, value);
+    return lookup(symbol_table, target);
+}
+
+static double no_derivative(const Builtin *builtin) {
+    fprintf(stderr, "Error: No derivative for function '%.*s'\n", builtin->length, builtin->name);
+    return NAN;
+}
+
+static double trigamma(double x) {
+    if (x <= 0.0 && floor(x) == x) return NAN;
+
+    if (x < 0.0) {
+        double s = sin(ENV_PI * x);
+        return ENV_PI * ENV_PI / (s * s) - trigamma(1.0 - x);
+    }
+
+    double result = 0.0;
+    for (; x < 10.0; x += 1.0) result += 1.0 / (x * x);
+
+    double f = 1.0 / (x * x);
+    double series = f / x * (1.0 / 6 - f * (1.0 / 30 - f * (1.0 / 42 - f * (1.0 / 30))));
+    return result + 1.0 / x + f / 2 + series;
+}
+
+// Derivative of a builtin of one argument at 'u', where it evaluates to 'value'
+static double derivative(const Builtin *builtin, double u, double value) {
+    switch (builtin->id) {
+        case BUILTIN_SIN:     return cos(u);
+        case BUILTIN_COS:     return -sin(u);
+        case BUILTIN_TAN:     return 1.0 + value * value;
+        case BUILTIN_ARCSIN:  return 1.0 / sqrt(1.0 - u * u);
+        case BUILTIN_ARCCOS:  return -1.0 / sqrt(1.0 - u * u);
+        case BUILTIN_ARCTAN:  return 1.0 / (1.0 + u * u);
+        case BUILTIN_SINH:    return cosh(u);
+        case BUILTIN_COSH:    return sinh(u);
+        case BUILTIN_TANH:    return 1.0 - value * value;
+        case BUILTIN_ARCSINH: return 1.0 / sqrt(u * u + 1.0);
+        case BUILTIN_ARCCOSH: return 1.0 / sqrt(u * u - 1.0);
+        case BUILTIN_ARCTANH: return 1.0 / (1.0 - u * u);
+        case BUILTIN_ABS:     return u / value; // NaN at 0
+        case BUILTIN_SQRT:    return 0.5 / value;
+        case BUILTIN_LN:      return 1.0 / u;
+        case BUILTIN_LOG:     return 1.0 / (u * log(10.0));
+        case BUILTIN_EXP:     return value;
+        case BUILTIN_DIGAMMA: return trigamma(u);
+        default:              return no_derivative(builtin);
+    }
+}
+
+// Evaluates the operation of a unary, binary or one-argument call node on
+// operand values 'a' and 'b', and sets its partial derivatives with respect
+// to them. Partials are only computed for operands that vary, so constant
+// exponents never take a logarithm.
+static double apply(const Node *node, double a, double b, bool a_varies, bool b_varies, double *da, double *db) {
+    *da = 0.0;
+    *db = 0.0;
+
+    switch (node->type) {
+        case NODE_UNARY:
+            switch (node->as.unary.op.type) {
+                case TOK_PLUS:
+                    *da = 1.0;
+                    return a;
+                case TOK_MINUS:
+                    *da = -1.0;
+                    return -a;
+                case TOK_BANG: {
+                    double value = tgamma(a + 1);
+                    double shifted = a + 1;
+                    if (a_varies) *da = value * builtins[BUILTIN_DIGAMMA].function(&shifted);
+                    return value;
+                }
+                default:
+                    return 0.0;
+            }
+
+        case NODE_BINARY:
+            switch (node->as.binary.op.type) {
+                case TOK_PLUS:
+                    *da = 1.0;
+                    *db = 1.0;
+                    return a + b;
+                case TOK_MINUS:
+                    *da = 1.0;
+                    *db = -1.0;
+                    return a - b;
+                case TOK_STAR:
+                    *da = b;
+                    *db = a;
+                    return a * b;
+                case TOK_SLASH: {
+                    if (b == 0.0) {
+                        fprintf(stderr, "Error: Division by zero\n");
+                        *da = *db = NAN;
+                        return NAN;
+                    }
+
+                    double value = a / b;
+                    *da = 1.0 / b;
+                    *db = -value / b;
+                    return value;
+                }
+                case TOK_CARET: {
+                    double value = custom_pow(a, b);
+                    // b * a^(b - 1) keeps the sign custom_pow gives negative bases
+                    if (a_varies) *da = (b == 0.0) ? 0.0 : b * custom_pow(a, b - 1.0);
+                    if (b_varies) *db = value * log(a);
+                    return value;
+                }
+                default:
+                    return 0.0;
+            }
+
+        case NODE_CALL: {
+            const Builtin *builtin = node->as.call.builtin;
+            double value = builtin->function(&a);
+            if (a_varies) *da = derivative(builtin, a, value);
+            return value;
+        }
+
+        default:
+            return 0.0;
+    }
+}
+
+// Evaluates like env_evaluate while recording every operation that depends on
+// a symbol. Returns its tape index, or TAPE_CONSTANT.
+static int32_t record(Tape *tape, Node *node, SymbolTable *symbol_table, double *value) {
+    double da, db;
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            *value = node->as.number;
+            return TAPE_CONSTANT;
+
+        case NODE_IDENTIFIER: {
+            const IdentifierData *identifier = &node->as.identifier;
+            int symbol = lookup(symbol_table, identifier);
+
+            if (symbol < 0) {
+                fprintf(stderr, "Error: Undefined variable '%.*s'\n", identifier->length, identifier->name);
+                *value = NAN;
+                return TAPE_CONSTANT;
+            }
+
+            *value = symbol_table->symbols[symbol].value;
+            if (tape->current[symbol] == SYMBOL_UNREAD) tape->current[symbol] = push(tape, TAPE_CONSTANT, symbol, 0.0, 0.0);
+            return tape->current[symbol];
+        }
+
+        case NODE_UNARY: {
+            double a;
+            int32_t index = record(tape, node->as.unary.right, symbol_table, &a);
+            *value = apply(node, a, 0.0, index != TAPE_CONSTANT, false, &da, &db);
+            return operation(tape, index, TAPE_CONSTANT, da, 0.0);
+        }
+
+        case NODE_BINARY: {
+            if (node->as.binary.op.type == TOK_EQUAL) {
+                int32_t index = record(tape, node->as.binary.right, symbol_table, value);
+                int symbol = assign(symbol_table, &node->as.binary.left->as.identifier, *value);
+                if (symbol >= 0 && reserve_symbols(tape, symbol + 1)) tape->current[symbol] = index;
+                return index;
+            }
+
+            double a, b;
+            int32_t left = record(tape, node->as.binary.left, symbol_table, &a);
+            int32_t right = record(tape, node->as.binary.right, symbol_table, &b);
+            *value = apply(node, a, b, left != TAPE_CONSTANT, right != TAPE_CONSTANT, &da, &db);
+            return operation(tape, left, right, da, db);
+        }
+
+        case NODE_CALL: {
+            const CallData *call = &node->as.call;
+            double arguments[BUILTIN_MAX_ARGUMENTS];
+            int32_t indices[BUILTIN_MAX_ARGUMENTS];
+
+            for (int i = 0; i < call->argument_count; i++)
+                indices[i] = record(tape, call->arguments[i], symbol_table, &arguments[i]);
+
+            if (call->argument_count == 1) {
+                *value = apply(node, arguments[0], 0.0, indices[0] != TAPE_CONSTANT, false, &da, &db);
+                return operation(tape, indices[0], TAPE_CONSTANT, da, 0.0);
+            }
+
+            // Unknown partials: the result depends on every varying argument through NaN
+            *value = call->builtin->function(arguments);
+            int32_t index = TAPE_CONSTANT;
+            for (int i = 0; i < call->argument_count; i++) index = operation(tape, index, indices[i], NAN, NAN);
+
+            if (index != TAPE_CONSTANT) no_derivative(call->builtin);
+            return index;
+        }
+    }
+
+    return TAPE_CONSTANT;
+}
+
+// Evaluates the tree like env_evaluate, and writes the gradient of the result
+// with respect to every symbol to 'gradient', indexed like the symbol table
+// before the call. Operations depending on a symbol are recorded on the tape,
+// then one sweep from the result back to the symbols accumulates the partials,
+// so the cost is a small multiple of one evaluation however many inputs there
+// are. Assignments apply as usual, and a symbol read after being assigned in
+// the same tree carries the derivative of the assigned value.
+double autodiff_reverse(Tape *tape, Node *node, SymbolTable *symbol_table, double *gradient) {
+    int symbol_count = symbol_table->count;
+    for (int i = 0; i < symbol_count; i++) gradient[i] = 0.0;
+
+    if (!tape_reset(tape, symbol_table)) return NAN;
+
+    double value;
+    int32_t root = record(tape, node, symbol_table, &value);
+    if (tape->failed) return NAN;
+    if (root == TAPE_CONSTANT) return value;
+
+    tape->entries[root].adjoint = 1.0;
+
+    for (int32_t i = root; i >= 0; i--) {
+        const TapeEntry *entry = &tape->entries[i];
+        if (entry->adjoint == 0.0) continue;
+
+        if (entry->a == TAPE_CONSTANT) {
+            gradient[entry->b] += entry->adjoint;
+            continue;
+        }
+
+        tape->entries[entry->a].adjoint += entry->da * entry->adjoint;
+        if (entry->b != TAPE_CONSTANT) tape->entries[entry->b].adjoint += entry->db * entry->adjoint;
+    }
+
+    return value;
+}
+
+static bool varies(const double *tangent, int count) {
+    for (int i = 0; i < count; i++) {
+        if (tangent[i] != 0.0) return true;
+    }
+
+    return false;
+}
+
+// tangent = da * ta + db * tb, where zero tangents stay zero even if a partial is NaN
+static void combine(double *tangent, int count, double da, const double *ta, double db, const double *tb) {
+    for (int i = 0; i < count; i++) {
+        tangent[i] = 0.0;
+        if (ta[i] != 0.0) tangent[i] += da * ta[i];
+        if (tb != NULL && tb[i] != 0.0) tangent[i] += db * tb[i];
+    }
+}
+
+// Evaluates with dual numbers: each value carries its derivatives with respect
+// to the 'count' symbols in 'tangent'
+static double forward(Tape *tape, Node *node, SymbolTable *symbol_table, const int *symbols, int count,
+                      double *tangent) {
+    double da, db;
+    double ta[AUTODIFF_MAX_TANGENTS], tb[AUTODIFF_MAX_TANGENTS];
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            for (int i = 0; i < count; i++) tangent[i] = 0.0;
+            return node->as.number;
+
+        case NODE_IDENTIFIER: {
+            const IdentifierData *identifier = &node->as.identifier;
+            int symbol = lookup(symbol_table, identifier);
+
+            if (symbol < 0) {
+                fprintf(stderr, "Error: Undefined variable '%.*s'\n", identifier->length, identifier->name);
+                for (int i = 0; i < count; i++) tangent[i] = 0.0;
+                return NAN;
+            }
+
+            if (tape->current[symbol] == SYMBOL_ASSIGNED) {
+                memcpy(tangent, &tape->tangents[symbol * AUTODIFF_MAX_TANGENTS], sizeof(double) * count);
+            } else {
+                for (int i = 0; i < count; i++) tangent[i] = (symbols[i] == symbol) ? 1.0 : 0.0;
+            }
+
+            return symbol_table->symbols[symbol].value;
+        }
+
+        case NODE_UNARY: {
+            double a = forward(tape, node->as.unary.right, symbol_table, symbols, count, ta);
+            double value = apply(node, a, 0.0, varies(ta, count), false, &da, &db);
+            combine(tangent, count, da, ta, 0.0, NULL);
+            return value;
+        }
+
+        case NODE_BINARY: {
+            if (node->as.binary.op.type == TOK_EQUAL) {
+                double value = forward(tape, node->as.binary.right, symbol_table, symbols, count, tangent);
+                int symbol = assign(symbol_table, &node->as.binary.left->as.identifier, value);
+
+                if (symbol >= 0 && reserve_symbols(tape, symbol + 1)) {
+                    tape->current[symbol] = SYMBOL_ASSIGNED;
+                    memcpy(&tape->tangents[symbol * AUTODIFF_MAX_TANGENTS], tangent, sizeof(double) * count);
+                }
+                return value;
+            }
+
+            double a = forward(tape, node->as.binary.left, symbol_table, symbols, count, ta);
+            double b = forward(tape, node->as.binary.right, symbol_table, symbols, count, tb);
+            double value = apply(node, a, b, varies(ta, count), varies(tb, count), &da, &db);
+            combine(tangent, count, da, ta, db, tb);
+            return value;
+        }
+
+        case NODE_CALL: {
+            const CallData *call = &node->as.call;
+
+            if (call->argument_count == 1) {
+                double a = forward(tape, call->arguments[0], symbol_table, symbols, count, ta);
+                double value = apply(node, a, 0.0, varies(ta, count), false, &da, &db);
+                combine(tangent, count, da, ta, 0.0, NULL);
+                return value;
+            }
+
+            double arguments[BUILTIN_MAX_ARGUMENTS];
+            bool any = false;
+            for (int i = 0; i < count; i++) tangent[i] = 0.0;
+
+            for (int i = 0; i < call->argument_count; i++) {
+                arguments[i] = forward(tape, call->arguments[i], symbol_table, symbols, count, ta);
+                for (int j = 0; j < count; j++) {
+                    if (ta[j] != 0.0) tangent[j] = NAN;
+                }
+                any = any || varies(ta, count);
+            }
+
+            if (any) no_derivative(call->builtin);
+            return call->builtin->function(arguments);
+        }
+    }
+
+    return 0.0;
+}
+
+// Evaluates the tree like env_evaluate, and writes the derivatives of the
+// result with respect to each of 'symbols' (symbol table indices) to
+// 'gradient'. A single pass carries every derivative along with the value,
+// which beats the tape of autodiff_reverse when there are only a few inputs.
+double autodiff_forward(Tape *tape, Node *node, SymbolTable *symbol_table, const int *symbols, int count,
+                        double *gradient) {
+    if (count < 0 || count > AUTODIFF_MAX_TANGENTS) {
+        fprintf(stderr, "Error: Forward mode takes at most %d symbols\n", AUTODIFF_MAX_TANGENTS);
+        return NAN;
+    }
+
+    if (!tape_reset(tape, symbol_table)) return NAN;
+
+    double tangent[AUTODIFF_MAX_TANGENTS];
+    double value = forward(tape, node, symbol_table, symbols, count, tangent);
+    if (tape->failed) return NAN;
+
+    memcpy(gradient, tangent, sizeof(double) * count);
+    return value;
+}
@@ -0,0 +1,216 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "environment.h"
+#include "vmath.h"
+
+// Wraps a libm function of one argument, with a batch variant running its vmath kernel
+#define UNARY(fn)                                                                     \
+    static double call_##fn(const double *arguments) { return fn(arguments[0]); }     \
+    static void batch_##fn(const double *const *arguments, double *out, size_t count) { \
+        vmath_##fn(arguments[0], out, count);                                         \
+    }
+
+UNARY(sin) UNARY(cos) UNARY(tan) UNARY(asin) UNARY(acos) UNARY(atan)
+UNARY(sinh) UNARY(cosh) UNARY(tanh) UNARY(asinh) UNARY(acosh) UNARY(atanh)
+UNARY(fabs) UNARY(sqrt) UNARY(log) UNARY(log10) UNARY(exp)
+
+// Logarithmic derivative of the gamma function, so (x!)' = x! * digamma(x + 1).
+// Shifted up with the recurrence until the asymptotic series is accurate, with
+// the reflection formula for negative arguments. Poles give NaN.
+static double digamma(double x) {
+    if (x <= 0.0 && floor(x) == x) return NAN;
+
+    double result = 0.0;
+    if (x < 0.0) {
+        result = -ENV_PI / tan(ENV_PI * x);
+        x = 1.0 - x;
+    }
+
+    for (; x < 10.0; x += 1.0) result -= 1.0 / x;
+
+    double f = 1.0 / (x * x);
+    double series = f * (1.0 / 12 - f * (1.0 / 120 - f * (1.0 / 252 - f * (1.0 / 240 - f * (1.0 / 132)))));
+    return result + log(x) - 0.5 / x - series;
+}
+
+static double call_digamma(const double *arguments) {
+    return digamma(arguments[0]);
+}
+
+static void batch_digamma(const double *const *arguments, double *out, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = digamma(arguments[0][i]);
+}
+
+#define FUNCTION(id, name, fn) [id] = {name, sizeof(name) - 1, id, 1, BUILTIN_PURE, call_##fn, batch_##fn, 0.0}
+#define CONSTANT(id, name, value) [id] = {name, sizeof(name) - 1, id, -1, BUILTIN_PURE, NULL, NULL, value}
+
+const Builtin builtins[BUILTIN_COUNT] = {
+    FUNCTION(BUILTIN_SIN,     "sin",     sin),
+    FUNCTION(BUILTIN_COS,     "cos",     cos),
+    FUNCTION(BUILTIN_TAN,     "tan",     tan),
+    FUNCTION(BUILTIN_ARCSIN,  "arcsin",  asin),
+    FUNCTION(BUILTIN_ARCCOS,  "arccos",  acos),
+    FUNCTION(BUILTIN_ARCTAN,  "arctan",  atan),
+    FUNCTION(BUILTIN_SINH,    "sinh",    sinh),
+    FUNCTION(BUILTIN_COSH,    "cosh",    cosh),
+    FUNCTION(BUILTIN_TANH,    "tanh",    tanh),
+    FUNCTION(BUILTIN_ARCSINH, "arcsinh", asinh),
+    FUNCTION(BUILTIN_ARCCOSH, "arccosh", acosh),
+    FUNCTION(BUILTIN_ARCTANH, "arctanh", atanh),
+    FUNCTION(BUILTIN_ABS,     "abs",     fabs),
+    FUNCTION(BUILTIN_SQRT,    "sqrt",    sqrt),
+    FUNCTION(BUILTIN_LN,      "ln",      log),
+    FUNCTION(BUILTIN_LOG,     "log",     log10),
+    FUNCTION(BUILTIN_EXP,     "exp",     exp),
+    FUNCTION(BUILTIN_DIGAMMA, "digamma", digamma),
+    CONSTANT(BUILTIN_E,       "e",       ENV_E),
+    CONSTANT(BUILTIN_PI,      "pi",      ENV_PI),
+};
+
+// Registered functions are allocated one by one, so pointers to them stay valid
+static Builtin **registered;
+static int registered_count;
+static int registered_capacity;
+
+// Perfect hash over the builtin names: the length and one character position
+// pick the only possible candidate, which a single memcmp then confirms.
+// Adding a builtin means adding its case here.
+static int candidate(const char *name, int length) {
+    switch (length) {
+        case 1:
+            return BUILTIN_E;
+
+        case 2:
+            switch (name[0]) {
+                case 'l': return BUILTIN_LN;
+                case 'p': return BUILTIN_PI;
+            }
+            break;
+
+        case 3:
+            switch (name[0]) {
+                case 's': return BUILTIN_SIN;
+                case 'c': return BUILTIN_COS;
+                case 't': return BUILTIN_TAN;
+                case 'a': return BUILTIN_ABS;
+                case 'l': return BUILTIN_LOG;
+                case 'e': return BUILTIN_EXP;
+            }
+            break;
+
+        case 4:
+            switch (name[1]) {
+                case 'i': return BUILTIN_SINH;
+                case 'o': return BUILTIN_COSH;
+                case 'a': return BUILTIN_TANH;
+                case 'q': return BUILTIN_SQRT;
+            }
+            break;
+
+        case 6:
+            switch (name[3]) {
+                case 's': return BUILTIN_ARCSIN;
+                case 'c': return BUILTIN_ARCCOS;
+                case 't': return BUILTIN_ARCTAN;
+            }
+            break;
+
+        case 7:
+            switch (name[3]) {
+                case 's': return BUILTIN_ARCSINH;
+                case 'c': return BUILTIN_ARCCOSH;
+                case 't': return BUILTIN_ARCTANH;
+                case 'a': return BUILTIN_DIGAMMA;
+            }
+            break;
+    }
+
+    return -1;
+}
+
+static bool is_identifier(const char *name, int length) {
+    if (length == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) return false;
+
+    for (int i = 1; i < length; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_') return false;
+    }
+
+    return true;
+}
+
+bool builtin_register(const char *name, int arity, BuiltinFn function, BuiltinBatchFn batch, unsigned flags) {
+    int length = (int)strlen(name);
+
+    if (!is_identifier(name, length)) {
+        fprintf(stderr, "Error: Invalid function name '%s'\n", name);
+        return false;
+    }
+
+    if (builtin_lookup(name, length) != NULL) {
+        fprintf(stderr, "Error: Function '%s' is already defined\n", name);
+        return false;
+    }
+
+    if (arity < 0 || arity > BUILTIN_MAX_ARGUMENTS || function == NULL) {
+        fprintf(stderr, "Error: Invalid definition of function '%s'\n", name);
+        return false;
+    }
+
+    if (registered_count == registered_capacity) {
+        int capacity = registered_capacity ? registered_capacity * 2 : 16;
+        Builtin **entries = realloc(registered, sizeof(Builtin *) * capacity);
+        if (entries == NULL) {
+            fprintf(stderr, "Error: Unable to register function '%s'\n", name);
+            return false;
+        }
+
+        registered = entries;
+        registered_capacity = capacity;
+    }
+
+    // The name is stored right after the entry
+    Builtin *entry = malloc(sizeof(Builtin) + length + 1);
+    if (entry == NULL) {
+        fprintf(stderr, "Error: Unable to register function '%s'\n", name);
+        return false;
+    }
+
+    char *copy = (char *)(entry + 1);
+    memcpy(copy, name, length + 1);
+
+    *entry = (Builtin){copy, length, BUILTIN_COUNT + (uint32_t)registered_count, arity, flags, function, batch, 0.0};
+    registered[registered_count++] = entry;
+    return true;
+}
+
+void builtin_clear() {
+    for (int i = 0; i < registered_count; i++) free(registered[i]);
+    free(registered);
+
+    registered = NULL;
+    registered_count = 0;
+    registered_capacity = 0;
+}
+
+const Builtin *builtin_lookup(const char *name, int length) {
+    int id = candidate(name, length);
+    if (id >= 0 && memcmp(builtins[id].name, name, length) == 0) return &builtins[id];
+
+    for (int i = 0; i < registered_count; i++) {
+        if (registered[i]->length == length && memcmp(registered[i]->name, name, length) == 0) return registered[i];
+    }
+
+    return NULL;
+}
+
+const Builtin *builtin_get(uint32_t id) {
+    if (id < BUILTIN_COUNT) return &builtins[id];
+    if (id - BUILTIN_COUNT < (uint32_t)registered_count) return registered[id - BUILTIN_COUNT];
+
+    return NULL;
+}
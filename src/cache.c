@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "optimizer.h"
+
+static uint32_t hash_text(const char *text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)text[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+Cache cache_init(int capacity, unsigned flags) {
+    Cache cache = {0};
+    cache.capacity = (capacity > 0) ? capacity : CACHE_DEFAULT_CAPACITY;
+    cache.entries = malloc(sizeof(CacheEntry) * cache.capacity);
+
+    // At most one entry per bucket on average
+    cache.bucket_capacity = 1;
+    while (cache.bucket_capacity < cache.capacity) cache.bucket_capacity *= 2;
+    cache.buckets = malloc(sizeof(int) * cache.bucket_capacity);
+
+    if (cache.entries == NULL || cache.buckets == NULL) {
+        fprintf(stderr, "Error: Unable to initialize cache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < cache.bucket_capacity; i++) cache.buckets[i] = -1;
+
+    cache.newest = -1;
+    cache.oldest = -1;
+    cache.parser = parser_init();
+    cache.spare = program_init();
+    cache.flags = flags;
+    return cache;
+}
+
+void cache_free(Cache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        free(cache->entries[i].text);
+        program_free(&cache->entries[i].program);
+    }
+
+    free(cache->entries);
+    free(cache->buckets);
+    program_free(&cache->spare);
+    parser_free(&cache->parser);
+}
+
+static void unlink_recent(Cache *cache, int index) {
+    CacheEntry *entry = &cache->entries[index];
+
+    if (entry->newer >= 0) cache->entries[entry->newer].older = entry->older;
+    else cache->newest = entry->older;
+
+    if (entry->older >= 0) cache->entries[entry->older].newer = entry->newer;
+    else cache->oldest = entry->newer;
+}
+
+static void push_recent(Cache *cache, int index) {
+    CacheEntry *entry = &cache->entries[index];
+    entry->newer = -1;
+    entry->older = cache->newest;
+
+    if (cache->newest >= 0) cache->entries[cache->newest].newer = index;
+    else cache->oldest = index;
+
+    cache->newest = index;
+}
+
+static void unlink_bucket(Cache *cache, int index) {
+    int *link = &cache->buckets[cache->entries[index].hash & (uint32_t)(cache->bucket_capacity - 1)];
+    while (*link != index) link = &cache->entries[*link].next;
+    *link = cache->entries[index].next;
+}
+
+// Parses, simplifies and compiles the expression
+static bool compile(Cache *cache, Program *program, const char *text, size_t length) {
+    Node *root = parser_parse_span(&cache->parser, text, length);
+    bool ok = root != NULL;
+
+    if (ok) {
+        optimizer_fold(root, cache->flags);
+        optimizer_share(&root, 1);
+        ok = compiler_compile(program, root);
+    }
+
+    arena_clear(cache->parser.arena);
+    return ok;
+}
+
+// Returns the program compiled from the expression, compiling it on a miss,
+// or NULL when it fails to parse. The program stays valid until a later call
+// evicts it.
+const Program *cache_get(Cache *cache, const char *text, size_t length) {
+    uint32_t hash = hash_text(text, length);
+    int *bucket = &cache->buckets[hash & (uint32_t)(cache->bucket_capacity - 1)];
+
+    for (int index = *bucket; index >= 0; index = cache->entries[index].next) {
+        CacheEntry *entry = &cache->entries[index];
+        if (entry->hash != hash || entry->length != length || memcmp(entry->text, text, length) != 0) continue;
+
+        cache->stats.hits++;
+        if (cache->newest != index) {
+            unlink_recent(cache, index);
+            push_recent(cache, index);
+        }
+
+        return &entry->program;
+    }
+
+    cache->stats.misses++;
+    if (!compile(cache, &cache->spare, text, length)) return NULL;
+
+    int index = (cache->count < cache->capacity) ? cache->count : cache->oldest;
+    CacheEntry *entry = &cache->entries[index];
+
+    // A failed copy leaves the entry to evict intact
+    char *copy = realloc((index < cache->count) ? entry->text : NULL, length + 1);
+    if (copy == NULL) {
+        fprintf(stderr, "Error: Unable to allocate cache entry\n");
+        return NULL;
+    }
+
+    if (index == cache->count) {
+        entry->program = program_init();
+        cache->count++;
+    } else {
+        unlink_recent(cache, index);
+        unlink_bucket(cache, index);
+        cache->stats.evictions++;
+    }
+
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+
+    Program program = entry->program;
+    entry->program = cache->spare;
+    cache->spare = program;
+
+    entry->text = copy;
+    entry->length = length;
+    entry->hash = hash;
+    entry->next = *bucket;
+    *bucket = index;
+    push_recent(cache, index);
+
+    return &entry->program;
+}
@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "pointer_map.h"
+
+// Registers holding shared nodes are tagged while compiling and renumbered
+// below the stack registers once their count is known
+#define PINNED_REGISTER 0x80000000u
+
+typedef struct {
+    Program *program;
+    PointerMap uses;   // Node -> number of parents
+    PointerMap pinned; // Shared node -> register holding its value
+    uint32_t pinned_count;
+} Compiler;
+
+static const char *opcode_names[] = {
+    [OP_CONST]  = "const",
+    [OP_LOAD]   = "load",
+    [OP_STORE]  = "store",
+    [OP_MOVE]   = "move",
+    [OP_NEG]    = "neg",
+    [OP_FACT]   = "fact",
+    [OP_ADD]    = "add",
+    [OP_SUB]    = "sub",
+    [OP_MUL]    = "mul",
+    [OP_DIV]    = "div",
+    [OP_POW]    = "pow",
+    [OP_CALL]   = "call",
+    [OP_RETURN] = "ret",
+};
+
+// Returns the (possibly moved) array with room for 'needed' elements, or NULL
+static void *grow(void *data, int *capacity, int needed, size_t size) {
+    if (needed <= *capacity) return data;
+
+    int new_capacity = *capacity ? *capacity * 2 : 16;
+    while (new_capacity < needed) new_capacity *= 2;
+
+    void *new_data = realloc(data, (size_t)new_capacity * size);
+    if (new_data == NULL) {
+        fprintf(stderr, "Error: Unable to allocate program\n");
+        return NULL;
+    }
+
+    *capacity = new_capacity;
+    return new_data;
+}
+
+static bool emit(Compiler *compiler, OpCode op, uint32_t dst, uint32_t a, uint32_t b) {
+    Program *program = compiler->program;
+    Instruction *code = grow(program->code, &program->capacity, program->count + 1, sizeof(Instruction));
+    if (code == NULL) return false;
+
+    program->code = code;
+    program->code[program->count++] = (Instruction){op, dst, a, b};
+    return true;
+}
+
+static void use_register(Compiler *compiler, uint32_t reg) {
+    if ((int)reg >= compiler->program->register_count)
+        compiler->program->register_count = (int)reg + 1;
+}
+
+static int add_constant(Compiler *compiler, double value) {
+    Program *program = compiler->program;
+    double *constants = grow(program->constants, &program->constant_capacity, program->constant_count + 1, sizeof(double));
+    if (constants == NULL) return -1;
+
+    program->constants = constants;
+    program->constants[program->constant_count] = value;
+    return program->constant_count++;
+}
+
+static int add_function(Compiler *compiler, const Builtin *function) {
+    Program *program = compiler->program;
+    for (int i = 0; i < program->function_count; i++) {
+        if (program->functions[i] == function) return i;
+    }
+
+    const Builtin **functions = grow(program->functions, &program->function_capacity, program->function_count + 1, sizeof(Builtin *));
+    if (functions == NULL) return -1;
+
+    program->functions = functions;
+    program->functions[program->function_count] = function;
+    return program->function_count++;
+}
+
+static int add_slot(Compiler *compiler, const char *name, int length) {
+    Program *program = compiler->program;
+
+    int slot = program_slot(program, name, length);
+    if (slot >= 0) return slot;
+
+    ProgramSlot *slots = grow(program->slots, &program->slot_capacity, program->slot_count + 1, sizeof(ProgramSlot));
+    if (slots == NULL) return -1;
+
+    program->slots = slots;
+    program->slots[program->slot_count] = (ProgramSlot){name, length, false, false, -1};
+    return program->slot_count++;
+}
+
+// Counts the parents of every node, so nodes shared in a DAG are computed once
+static bool count_uses(Compiler *compiler, Node *node) {
+    int64_t uses = 0;
+    pointer_map_get(&compiler->uses, node, &uses);
+    if (!pointer_map_set(&compiler->uses, node, uses + 1)) return false;
+    if (uses > 0) return true;
+
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_IDENTIFIER:
+            return true;
+        case NODE_UNARY:
+            return count_uses(compiler, node->as.unary.right);
+        case NODE_BINARY:
+            if (node->as.binary.op.type != TOK_EQUAL && !count_uses(compiler, node->as.binary.left)) return false;
+            return count_uses(compiler, node->as.binary.right);
+        case NODE_CALL:
+            for (int i = 0; i < node->as.call.argument_count; i++) {
+                if (!count_uses(compiler, node->as.call.arguments[i])) return false;
+            }
+            return true;
+    }
+
+    return true;
+}
+
+static bool compile_tree(Compiler *compiler, Node *node, uint32_t target, uint32_t *result);
+
+// Emits the code for a subtree and returns the register holding its value.
+// Temporaries are allocated as a stack: the subtree may use 'target' and above.
+// A node with several parents is computed once into a register of its own.
+static bool compile_node(Compiler *compiler, Node *node, uint32_t target, uint32_t *result) {
+    int64_t value;
+    if (pointer_map_get(&compiler->pinned, node, &value)) {
+        *result = (uint32_t)value;
+        return true;
+    }
+
+    if (!compile_tree(compiler, node, target, result)) return false;
+
+    int64_t uses = 0;
+    pointer_map_get(&compiler->uses, node, &uses);
+    if (uses < 2) return true;
+
+    uint32_t pinned = PINNED_REGISTER | compiler->pinned_count++;
+    Program *program = compiler->program;
+    Instruction *last = &program->code[program->count - 1];
+
+    // Retarget the instruction that produced the value, or copy it
+    if (*result == target && last->dst == target && last->op != OP_STORE) last->dst = pinned;
+    else if (!emit(compiler, OP_MOVE, pinned, *result, 0)) return false;
+
+    *result = pinned;
+    return pointer_map_set(&compiler->pinned, node, pinned);
+}
+
+static bool compile_tree(Compiler *compiler, Node *node, uint32_t target, uint32_t *result) {
+    use_register(compiler, target);
+
+    switch (node->type) {
+        case NODE_NUMBER: {
+            int constant = add_constant(compiler, node->as.number);
+            if (constant < 0) return false;
+
+            *result = target;
+            return emit(compiler, OP_CONST, target, (uint32_t)constant, 0);
+        }
+
+        case NODE_IDENTIFIER: {
+            int slot = add_slot(compiler, node->as.identifier.name, node->as.identifier.length);
+            if (slot < 0) return false;
+
+            if (!compiler->program->slots[slot].assigned) compiler->program->slots[slot].input = true;
+
+            *result = target;
+            return emit(compiler, OP_LOAD, target, (uint32_t)slot, 0);
+        }
+
+        case NODE_UNARY: {
+            uint32_t right;
+            if (!compile_node(compiler, node->as.unary.right, target, &right)) return false;
+
+            switch (node->as.unary.op.type) {
+                case TOK_PLUS:
+                    *result = right;
+                    return true;
+                case TOK_MINUS:
+                    *result = target;
+                    return emit(compiler, OP_NEG, target, right, 0);
+                case TOK_BANG:
+                    *result = target;
+                    return emit(compiler, OP_FACT, target, right, 0);
+                default:
+                    fprintf(stderr, "Error: Unknown unary operator '%.*s'\n",
+                            node->as.unary.op.length, node->as.unary.op.start);
+                    return false;
+            }
+        }
+
+        case NODE_BINARY: {
+            if (node->as.binary.op.type == TOK_EQUAL) {
+                uint32_t value;
+                if (!compile_node(compiler, node->as.binary.right, target, &value)) return false;
+
+                // Allocate the target after its value, so slots follow evaluation order
+                Node *left = node->as.binary.left;
+                int slot = add_slot(compiler, left->as.identifier.name, left->as.identifier.length);
+                if (slot < 0) return false;
+
+                compiler->program->slots[slot].assigned = true;
+                *result = value;
+                return emit(compiler, OP_STORE, (uint32_t)slot, value, 0);
+            }
+
+            uint32_t left, right;
+            if (!compile_node(compiler, node->as.binary.left, target, &left)) return false;
+            if (!compile_node(compiler, node->as.binary.right, target + 1, &right)) return false;
+
+            OpCode op;
+            switch (node->as.binary.op.type) {
+                case TOK_PLUS:  op = OP_ADD; break;
+                case TOK_MINUS: op = OP_SUB; break;
+                case TOK_STAR:  op = OP_MUL; break;
+                case TOK_SLASH: op = OP_DIV; break;
+                case TOK_CARET: op = OP_POW; break;
+                default:
+                    fprintf(stderr, "Error: Unknown binary operator '%.*s'\n",
+                            node->as.binary.op.length, node->as.binary.op.start);
+                    return false;
+            }
+
+            *result = target;
+            return emit(compiler, op, target, left, right);
+        }
+
+        case NODE_CALL: {
+            CallData *call = &node->as.call;
+            int function = add_function(compiler, call->builtin);
+            if (function < 0) return false;
+
+            // Arguments are passed in consecutive registers, except a single
+            // one, which can be read from wherever it is
+            uint32_t first = target;
+            if (call->argument_count == 1) {
+                if (!compile_node(compiler, call->arguments[0], target, &first)) return false;
+            }
+
+            for (int i = 0; call->argument_count > 1 && i < call->argument_count; i++) {
+                uint32_t argument;
+                if (!compile_node(compiler, call->arguments[i], target + i, &argument)) return false;
+
+                use_register(compiler, target + i);
+                if (argument != target + i && !emit(compiler, OP_MOVE, target + i, argument, 0)) return false;
+            }
+
+            *result = target;
+            return emit(compiler, OP_CALL, target, first, (uint32_t)function);
+        }
+    }
+
+    return false;
+}
+
+// Copies slot names out of the source text so the program outlives the parser arena
+static bool intern_names(Program *program) {
+    size_t size = 0;
+    for (int i = 0; i < program->slot_count; i++) size += (size_t)program->slots[i].length + 1;
+
+    free(program->names);
+    program->names = malloc(size ? size : 1);
+    if (program->names == NULL) {
+        fprintf(stderr, "Error: Unable to allocate program\n");
+        return false;
+    }
+
+    char *cursor = program->names;
+    for (int i = 0; i < program->slot_count; i++) {
+        memcpy(cursor, program->slots[i].name, program->slots[i].length);
+        cursor[program->slots[i].length] = '\0';
+        program->slots[i].name = cursor;
+        cursor += program->slots[i].length + 1;
+    }
+
+    return true;
+}
+
+Program program_init() {
+    Program program = {0};
+    return program;
+}
+
+void program_free(Program *program) {
+    free(program->code);
+    free(program->constants);
+    free(program->slots);
+    free(program->functions);
+    free(program->names);
+    *program = program_init();
+}
+
+int program_slot(const Program *program, const char *name, int length) {
+    for (int i = 0; i < program->slot_count; i++) {
+        if (program->slots[i].length == length && strncmp(program->slots[i].name, name, length) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+void program_print(const Program *program) {
+    for (int i = 0; i < program->count; i++) {
+        const Instruction *ins = &program->code[i];
+        printf("%4d  %-6s ", i, opcode_names[ins->op]);
+
+        switch (ins->op) {
+            case OP_CONST:
+                printf("r%u, %g\n", ins->dst, program->constants[ins->a]);
+                break;
+            case OP_LOAD:
+                printf("r%u, %s\n", ins->dst, program->slots[ins->a].name);
+                break;
+            case OP_STORE:
+                printf("%s, r%u\n", program->slots[ins->dst].name, ins->a);
+                break;
+            case OP_MOVE:
+            case OP_NEG:
+            case OP_FACT:
+                printf("r%u, r%u\n", ins->dst, ins->a);
+                break;
+            case OP_CALL: {
+                const Builtin *function = program->functions[ins->b];
+                printf("r%u, %s(", ins->dst, function->name);
+                for (int j = 0; j < function->arity; j++) printf(j ? ", r%u" : "r%u", ins->a + j);
+                printf(")\n");
+                break;
+            }
+            case OP_RETURN:
+                printf("r%u\n", ins->a);
+                break;
+            default:
+                printf("r%u, r%u, r%u\n", ins->dst, ins->a, ins->b);
+                break;
+        }
+    }
+}
+
+static uint32_t renumber(const Compiler *compiler, uint32_t reg) {
+    if (reg & PINNED_REGISTER) return reg & ~PINNED_REGISTER;
+    return reg + compiler->pinned_count;
+}
+
+// Places the pinned registers first and the stack registers after them
+static void renumber_registers(Compiler *compiler) {
+    Program *program = compiler->program;
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction *ins = &program->code[i];
+        if (ins->op != OP_STORE && ins->op != OP_RETURN) ins->dst = renumber(compiler, ins->dst);
+        if (ins->op >= OP_STORE) ins->a = renumber(compiler, ins->a);
+        if (ins->op >= OP_ADD && ins->op <= OP_POW) ins->b = renumber(compiler, ins->b);
+    }
+
+    program->register_count += (int)compiler->pinned_count;
+}
+
+bool compiler_compile(Program *program, Node *root) {
+    program->count = 0;
+    program->constant_count = 0;
+    program->slot_count = 0;
+    program->function_count = 0;
+    program->register_count = 0;
+
+    Compiler compiler = {program, pointer_map_init(), pointer_map_init(), 0};
+
+    uint32_t result;
+    bool ok = count_uses(&compiler, root) &&
+              compile_node(&compiler, root, 0, &result) &&
+              emit(&compiler, OP_RETURN, 0, result, 0);
+
+    if (ok) renumber_registers(&compiler);
+
+    pointer_map_free(&compiler.uses);
+    pointer_map_free(&compiler.pinned);
+
+    if (!ok) {
+        program->count = 0;
+        program->slot_count = 0;
+        return false;
+    }
+
+    return intern_names(program);
+}
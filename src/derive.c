@@ -0,0 +1,527 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "derive.h"
+#include "environment.h"
+#include "optimizer.h"
+#include "pointer_map.h"
+
+typedef struct {
+    const IdentifierData *target;
+    Node *value;      // Copy of the assigned value
+    Node *derivative;
+} Assignment;
+
+typedef struct {
+    Arena *arena;
+    const char *name; // Variable of the current derivative
+    int length;
+
+    PointerMap values;      // Original node -> copy, kept for every variable of a gradient
+    PointerMap derivatives; // Original node -> derivative for the current variable
+
+    Assignment *assignments; // Seen so far, in evaluation order
+    int assignment_count;
+    int assignment_capacity;
+
+    bool failed;
+} Deriver;
+
+static Node *make_node(Deriver *deriver, NodeType type) {
+    Node *node = arena_alloc(deriver->arena, sizeof(Node));
+    if (node == NULL) {
+        if (!deriver->failed) fprintf(stderr, "Error: Unable to allocate node\n");
+        deriver->failed = true;
+        return NULL;
+    }
+
+    node->type = type;
+    return node;
+}
+
+static Token operator(TokenType type) {
+    switch (type) {
+        case TOK_PLUS:  return (Token){type, 1, "+"};
+        case TOK_MINUS: return (Token){type, 1, "-"};
+        case TOK_STAR:  return (Token){type, 1, "*"};
+        case TOK_SLASH: return (Token){type, 1, "/"};
+        case TOK_CARET: return (Token){type, 1, "^"};
+        case TOK_BANG:  return (Token){type, 1, "!"};
+        default:        return (Token){type, 0, ""};
+    }
+}
+
+static bool is_number(Node *node, double value) {
+    return node != NULL && node->type == NODE_NUMBER && node->as.number == value;
+}
+
+static bool is_zero(Node *node) {
+    return is_number(node, 0.0);
+}
+
+static bool is_operator(Node *node, NodeType type, TokenType op) {
+    if (node->type != type) return false;
+    return (type == NODE_UNARY ? node->as.unary.op.type : node->as.binary.op.type) == op;
+}
+
+static Node *number(Deriver *deriver, double value) {
+    Node *node = make_node(deriver, NODE_NUMBER);
+    if (node != NULL) node->as.number = value;
+    return node;
+}
+
+static Node *unary(Deriver *deriver, TokenType op, Node *right) {
+    if (right == NULL) return NULL;
+
+    Node *node = make_node(deriver, NODE_UNARY);
+    if (node != NULL) node->as.unary = (UnaryData){operator(op), right};
+    return node;
+}
+
+static Node *binary(Deriver *deriver, TokenType op, Node *left, Node *right) {
+    if (left == NULL || right == NULL) return NULL;
+
+    Node *node = make_node(deriver, NODE_BINARY);
+    if (node != NULL) node->as.binary = (BinaryData){operator(op), left, right};
+    return node;
+}
+
+static Node *call(Deriver *deriver, const Builtin *builtin, Node **arguments) {
+    for (int i = 0; i < builtin->arity; i++) {
+        if (arguments[i] == NULL) return NULL;
+    }
+
+    Node *function = make_node(deriver, NODE_IDENTIFIER);
+    Node *node = make_node(deriver, NODE_CALL);
+    Node **copies = arena_alloc(deriver->arena, sizeof(Node *) * (builtin->arity ? builtin->arity : 1));
+    if (function == NULL || node == NULL) return NULL;
+
+    if (copies == NULL) {
+        fprintf(stderr, "Error: Unable to allocate node\n");
+        deriver->failed = true;
+        return NULL;
+    }
+
+    function->as.identifier = (IdentifierData){builtin->name, builtin->length, -1};
+    memcpy(copies, arguments, sizeof(Node *) * builtin->arity);
+    node->as.call = (CallData){function, copies, builtin->arity, builtin};
+    return node;
+}
+
+// Replaces a node whose operands are all numbers by its value, like
+// optimizer_fold does, so copies of the original stay exact
+static Node *constant(Node *node) {
+    if (node == NULL) return NULL;
+
+    switch (node->type) {
+        case NODE_UNARY:
+            if (node->as.unary.right->type != NODE_NUMBER) return node;
+            break;
+
+        case NODE_BINARY:
+            if (node->as.binary.left->type != NODE_NUMBER || node->as.binary.right->type != NODE_NUMBER) return node;
+            if (node->as.binary.op.type == TOK_SLASH && node->as.binary.right->as.number == 0.0) return node;
+            break;
+
+        case NODE_CALL:
+            if (!(node->as.call.builtin->flags & BUILTIN_PURE)) return node;
+            for (int i = 0; i < node->as.call.argument_count; i++) {
+                if (node->as.call.arguments[i]->type != NODE_NUMBER) return node;
+            }
+            break;
+
+        default:
+            return node;
+    }
+
+    double value = env_evaluate(node, NULL);
+    node->type = NODE_NUMBER;
+    node->as.number = value;
+    return node;
+}
+
+// The constructors below build the derivative parts. They simplify as
+// symbolic algebra does, treating a number 0 as an exact zero, so terms such
+// as 0 * x vanish even though x could be infinite.
+
+static Node *neg(Deriver *deriver, Node *right);
+static Node *mul(Deriver *deriver, Node *left, Node *right);
+
+static Node *neg(Deriver *deriver, Node *right) {
+    if (right == NULL) return NULL;
+    if (right->type == NODE_NUMBER) return number(deriver, -right->as.number);
+    if (is_operator(right, NODE_UNARY, TOK_MINUS)) return right->as.unary.right;
+
+    // -(c * x) -> (-c) * x
+    if (is_operator(right, NODE_BINARY, TOK_STAR) && right->as.binary.left->type == NODE_NUMBER)
+        return mul(deriver, number(deriver, -right->as.binary.left->as.number), right->as.binary.right);
+
+    return unary(deriver, TOK_MINUS, right);
+}
+
+static Node *sub(Deriver *deriver, Node *left, Node *right);
+
+static Node *add(Deriver *deriver, Node *left, Node *right) {
+    if (left == NULL || right == NULL) return NULL;
+    if (is_zero(left)) return right;
+    if (is_zero(right)) return left;
+    if (left->type == NODE_NUMBER && right->type == NODE_NUMBER) return number(deriver, left->as.number + right->as.number);
+    if (is_operator(right, NODE_UNARY, TOK_MINUS)) return sub(deriver, left, right->as.unary.right);
+    if (is_operator(left, NODE_UNARY, TOK_MINUS)) return sub(deriver, right, left->as.unary.right);
+
+    return binary(deriver, TOK_PLUS, left, right);
+}
+
+static Node *sub(Deriver *deriver, Node *left, Node *right) {
+    if (left == NULL || right == NULL) return NULL;
+    if (is_zero(right)) return left;
+    if (is_zero(left)) return neg(deriver, right);
+    if (left->type == NODE_NUMBER && right->type == NODE_NUMBER) return number(deriver, left->as.number - right->as.number);
+    if (is_operator(right, NODE_UNARY, TOK_MINUS)) return add(deriver, left, right->as.unary.right);
+
+    return binary(deriver, TOK_MINUS, left, right);
+}
+
+static Node *divide(Deriver *deriver, Node *left, Node *right);
+
+static Node *mul(Deriver *deriver, Node *left, Node *right) {
+    if (left == NULL || right == NULL) return NULL;
+    if (is_zero(left) || is_zero(right)) return number(deriver, 0.0);
+
+    // Keep numbers on the left, where they combine
+    if (right->type == NODE_NUMBER && left->type != NODE_NUMBER) {
+        Node *swap = left;
+        left = right;
+        right = swap;
+    }
+
+    if (is_number(left, 1.0)) return right;
+    if (is_number(left, -1.0)) return neg(deriver, right);
+
+    if (left->type == NODE_NUMBER) {
+        if (right->type == NODE_NUMBER) return number(deriver, left->as.number * right->as.number);
+
+        // a * (b * x) -> (a * b) * x
+        if (is_operator(right, NODE_BINARY, TOK_STAR) && right->as.binary.left->type == NODE_NUMBER)
+            return mul(deriver, number(deriver, left->as.number * right->as.binary.left->as.number), right->as.binary.right);
+    }
+
+    // Negations move outwards, where additions absorb them
+    if (is_operator(left, NODE_UNARY, TOK_MINUS)) return neg(deriver, mul(deriver, left->as.unary.right, right));
+    if (is_operator(right, NODE_UNARY, TOK_MINUS)) return neg(deriver, mul(deriver, left, right->as.unary.right));
+
+    // (1 / x) * y -> y / x
+    if (is_operator(left, NODE_BINARY, TOK_SLASH) && is_number(left->as.binary.left, 1.0))
+        return divide(deriver, right, left->as.binary.right);
+    if (is_operator(right, NODE_BINARY, TOK_SLASH) && is_number(right->as.binary.left, 1.0))
+        return divide(deriver, left, right->as.binary.right);
+
+    return binary(deriver, TOK_STAR, left, right);
+}
+
+static Node *divide(Deriver *deriver, Node *left, Node *right) {
+    if (left == NULL || right == NULL) return NULL;
+    if (is_zero(left)) return left;
+    if (is_number(right, 1.0)) return left;
+
+    if (left->type == NODE_NUMBER && right->type == NODE_NUMBER && right->as.number != 0.0)
+        return number(deriver, left->as.number / right->as.number);
+
+    if (is_operator(left, NODE_UNARY, TOK_MINUS)) return neg(deriver, divide(deriver, left->as.unary.right, right));
+
+    return binary(deriver, TOK_SLASH, left, right);
+}
+
+static Node *power(Deriver *deriver, Node *left, Node *right) {
+    if (left == NULL || right == NULL) return NULL;
+    if (is_zero(right)) return number(deriver, 1.0);
+    if (is_number(right, 1.0)) return left;
+
+    return constant(binary(deriver, TOK_CARET, left, right));
+}
+
+static Node *call1(Deriver *deriver, BuiltinId id, Node *argument) {
+    return constant(call(deriver, &builtins[id], &argument));
+}
+
+static Node *copy_identifier(Deriver *deriver, const IdentifierData *source) {
+    // Builtin constants become numbers, as optimizer_fold does
+    const Builtin *builtin = builtin_lookup(source->name, source->length);
+    if (builtin != NULL && builtin->arity < 0) return number(deriver, builtin->value);
+
+    Node *node = make_node(deriver, NODE_IDENTIFIER);
+    char *name = arena_alloc(deriver->arena, source->length + 1);
+    if (node == NULL) return NULL;
+
+    if (name == NULL) {
+        fprintf(stderr, "Error: Unable to allocate node\n");
+        deriver->failed = true;
+        return NULL;
+    }
+
+    memcpy(name, source->name, source->length);
+    name[source->length] = '\0';
+    node->as.identifier = (IdentifierData){name, source->length, -1};
+    return node;
+}
+
+static bool same_name(const IdentifierData *identifier, const char *name, int length) {
+    return identifier->length == length && memcmp(identifier->name, name, length) == 0;
+}
+
+// Latest assignment to the identifier before the current point of evaluation
+static const Assignment *assigned(const Deriver *deriver, const IdentifierData *identifier) {
+    for (int i = deriver->assignment_count - 1; i >= 0; i--) {
+        const IdentifierData *target = deriver->assignments[i].target;
+        if (same_name(target, identifier->name, identifier->length)) return &deriver->assignments[i];
+    }
+
+    return NULL;
+}
+
+static void push_assignment(Deriver *deriver, const IdentifierData *target, Node *value, Node *derivative) {
+    if (deriver->assignment_count == deriver->assignment_capacity) {
+        int capacity = deriver->assignment_capacity ? deriver->assignment_capacity * 2 : 8;
+        Assignment *assignments = realloc(deriver->assignments, sizeof(Assignment) * capacity);
+        if (assignments == NULL) {
+            fprintf(stderr, "Error: Unable to allocate assignment\n");
+            deriver->failed = true;
+            return;
+        }
+
+        deriver->assignments = assignments;
+        deriver->assignment_capacity = capacity;
+    }
+
+    deriver->assignments[deriver->assignment_count++] = (Assignment){target, value, derivative};
+}
+
+// Derivative of a builtin of one argument 'u' with respect to 'u', given the
+// copy of the call. Returns NULL for functions without a known derivative.
+static Node *derivative_of(Deriver *deriver, BuiltinId id, Node *u, Node *value) {
+    switch (id) {
+        case BUILTIN_SIN:     return call1(deriver, BUILTIN_COS, u);
+        case BUILTIN_COS:     return neg(deriver, call1(deriver, BUILTIN_SIN, u));
+        case BUILTIN_TAN:     return add(deriver, number(deriver, 1.0), mul(deriver, value, value));
+        case BUILTIN_ARCSIN:
+            return divide(deriver, number(deriver, 1.0),
+                          call1(deriver, BUILTIN_SQRT, sub(deriver, number(deriver, 1.0), mul(deriver, u, u))));
+        case BUILTIN_ARCCOS:
+            return divide(deriver, number(deriver, -1.0),
+                          call1(deriver, BUILTIN_SQRT, sub(deriver, number(deriver, 1.0), mul(deriver, u, u))));
+        case BUILTIN_ARCTAN:  return divide(deriver, number(deriver, 1.0), add(deriver, number(deriver, 1.0), mul(deriver, u, u)));
+        case BUILTIN_SINH:    return call1(deriver, BUILTIN_COSH, u);
+        case BUILTIN_COSH:    return call1(deriver, BUILTIN_SINH, u);
+        case BUILTIN_TANH:    return sub(deriver, number(deriver, 1.0), mul(deriver, value, value));
+        case BUILTIN_ARCSINH:
+            return divide(deriver, number(deriver, 1.0),
+                          call1(deriver, BUILTIN_SQRT, add(deriver, mul(deriver, u, u), number(deriver, 1.0))));
+        case BUILTIN_ARCCOSH:
+            return divide(deriver, number(deriver, 1.0),
+                          call1(deriver, BUILTIN_SQRT, sub(deriver, mul(deriver, u, u), number(deriver, 1.0))));
+        case BUILTIN_ARCTANH: return divide(deriver, number(deriver, 1.0), sub(deriver, number(deriver, 1.0), mul(deriver, u, u)));
+        case BUILTIN_ABS:     return divide(deriver, u, value); // Undefined at 0, where it divides by zero
+        case BUILTIN_SQRT:    return divide(deriver, number(deriver, 0.5), value);
+        case BUILTIN_LN:      return divide(deriver, number(deriver, 1.0), u);
+        case BUILTIN_LOG:     return divide(deriver, number(deriver, 1.0 / log(10.0)), u);
+        case BUILTIN_EXP:     return value;
+        default:              return NULL;
+    }
+}
+
+static Node *derive_node(Deriver *deriver, Node *node, Node **value);
+
+// u^v as custom_pow computes it. v * u^(v - 1) keeps the sign custom_pow gives
+// negative bases, for integers and odd roots alike, and ln(u) is only needed
+// when the exponent varies.
+static Node *derive_power(Deriver *deriver, Node *u, Node *du, Node *v, Node *dv, Node *value) {
+    Node *result = number(deriver, 0.0);
+
+    if (!is_zero(du))
+        result = mul(deriver, mul(deriver, v, power(deriver, u, sub(deriver, v, number(deriver, 1.0)))), du);
+
+    if (!is_zero(dv))
+        result = add(deriver, result, mul(deriver, mul(deriver, value, call1(deriver, BUILTIN_LN, u)), dv));
+
+    return result;
+}
+
+static Node *derive_call(Deriver *deriver, Node *node, Node **value, bool copied) {
+    const CallData *data = &node->as.call;
+    Node *values[BUILTIN_MAX_ARGUMENTS];
+    Node *derivatives[BUILTIN_MAX_ARGUMENTS];
+    bool varies = false;
+
+    for (int i = 0; i < data->argument_count; i++) {
+        derivatives[i] = derive_node(deriver, data->arguments[i], &values[i]);
+        varies = varies || !is_zero(derivatives[i]);
+    }
+
+    if (!copied) *value = constant(call(deriver, data->builtin, values));
+    if (!varies || deriver->failed) return number(deriver, 0.0);
+
+    Node *factor = (data->builtin->id < BUILTIN_COUNT && data->argument_count == 1)
+                       ? derivative_of(deriver, (BuiltinId)data->builtin->id, values[0], *value)
+                       : NULL;
+
+    if (factor == NULL) {
+        if (!deriver->failed)
+            fprintf(stderr, "Error: No derivative for function '%.*s'\n", data->builtin->length, data->builtin->name);
+        deriver->failed = true;
+        return NULL;
+    }
+
+    return mul(deriver, factor, derivatives[0]);
+}
+
+// Returns the derivative of 'node' and sets *value to a copy of it. Copies are
+// made in evaluation order, so an identifier read after an assignment in the
+// same tree stands for the assigned value, and the result has no assignments.
+static Node *derive_node(Deriver *deriver, Node *node, Node **value) {
+    int64_t memo;
+    if (pointer_map_get(&deriver->derivatives, node, &memo)) {
+        int64_t copy;
+        pointer_map_get(&deriver->values, node, &copy);
+        *value = (Node *)(intptr_t)copy;
+        return (Node *)(intptr_t)memo;
+    }
+
+    bool copied = pointer_map_get(&deriver->values, node, &memo);
+    *value = copied ? (Node *)(intptr_t)memo : NULL;
+    Node *derivative = NULL;
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            if (!copied) *value = number(deriver, node->as.number);
+            derivative = number(deriver, 0.0);
+            break;
+
+        case NODE_IDENTIFIER: {
+            const IdentifierData *identifier = &node->as.identifier;
+            const Assignment *assignment = assigned(deriver, identifier);
+
+            if (assignment != NULL) {
+                *value = assignment->value;
+                derivative = assignment->derivative;
+                break;
+            }
+
+            if (!copied) *value = copy_identifier(deriver, identifier);
+
+            const Builtin *builtin = builtin_lookup(identifier->name, identifier->length);
+            bool variable = same_name(identifier, deriver->name, deriver->length) && builtin == NULL;
+            derivative = number(deriver, variable ? 1.0 : 0.0);
+            break;
+        }
+
+        case NODE_UNARY: {
+            Node *right;
+            Node *d_right = derive_node(deriver, node->as.unary.right, &right);
+            TokenType op = node->as.unary.op.type;
+
+            if (!copied) *value = constant(unary(deriver, op, right));
+
+            if (op == TOK_MINUS) derivative = neg(deriver, d_right);
+            else if (op != TOK_BANG || is_zero(d_right)) derivative = d_right;
+            else {
+                // (u!)' = u! * digamma(u + 1) * u'
+                Node *digamma = call1(deriver, BUILTIN_DIGAMMA, add(deriver, right, number(deriver, 1.0)));
+                derivative = mul(deriver, mul(deriver, *value, digamma), d_right);
+            }
+            break;
+        }
+
+        case NODE_BINARY: {
+            TokenType op = node->as.binary.op.type;
+
+            if (op == TOK_EQUAL) {
+                derivative = derive_node(deriver, node->as.binary.right, value);
+                push_assignment(deriver, &node->as.binary.left->as.identifier, *value, derivative);
+                break;
+            }
+
+            Node *left, *right;
+            Node *d_left = derive_node(deriver, node->as.binary.left, &left);
+            Node *d_right = derive_node(deriver, node->as.binary.right, &right);
+
+            if (!copied) *value = constant(binary(deriver, op, left, right));
+
+            switch (op) {
+                case TOK_PLUS:  derivative = add(deriver, d_left, d_right); break;
+                case TOK_MINUS: derivative = sub(deriver, d_left, d_right); break;
+                case TOK_STAR:
+                    derivative = add(deriver, mul(deriver, d_left, right), mul(deriver, left, d_right));
+                    break;
+                case TOK_SLASH:
+                    // (u / v)' = (u' - (u / v) * v') / v
+                    derivative = divide(deriver, sub(deriver, d_left, mul(deriver, *value, d_right)), right);
+                    break;
+                case TOK_CARET:
+                    derivative = derive_power(deriver, left, d_left, right, d_right, *value);
+                    break;
+                default:
+                    derivative = number(deriver, 0.0);
+                    break;
+            }
+            break;
+        }
+
+        case NODE_CALL:
+            derivative = derive_call(deriver, node, value, copied);
+            break;
+    }
+
+    if (deriver->failed || *value == NULL || derivative == NULL) {
+        deriver->failed = true;
+        return NULL;
+    }
+
+    if (!pointer_map_set(&deriver->values, node, (int64_t)(intptr_t)*value) ||
+        !pointer_map_set(&deriver->derivatives, node, (int64_t)(intptr_t)derivative)) {
+        fprintf(stderr, "Error: Unable to allocate derivative\n");
+        deriver->failed = true;
+        return NULL;
+    }
+
+    return derivative;
+}
+
+// Builds the partial derivatives of 'root' with respect to each of 'names' as
+// new trees allocated in 'arena', which do not refer to the original tree.
+// The trees share the copies of the original subtrees, and are then merged
+// with optimizer_share, so a subexpression common to several partials is
+// computed once by a compiled program of all of them. Returns false when a
+// function has no known derivative (registered functions and digamma).
+bool derive_gradient(Arena *arena, Node *root, const char *const *names, int count, Node **gradient) {
+    Deriver deriver = {0};
+    deriver.arena = arena;
+    deriver.values = pointer_map_init();
+
+    for (int i = 0; i < count && !deriver.failed; i++) {
+        deriver.name = names[i];
+        deriver.length = (int)strlen(names[i]);
+        deriver.derivatives = pointer_map_init();
+        deriver.assignment_count = 0;
+
+        Node *value;
+        gradient[i] = derive_node(&deriver, root, &value);
+        pointer_map_free(&deriver.derivatives);
+    }
+
+    pointer_map_free(&deriver.values);
+    free(deriver.assignments);
+
+    if (deriver.failed) return false;
+
+    optimizer_share(gradient, count);
+    return true;
+}
+
+// Derivative of 'root' with respect to one variable, see derive_gradient
+Node *derive(Arena *arena, Node *root, const char *name) {
+    Node *result;
+    return derive_gradient(arena, root, &name, 1, &result) ? result : NULL;
+}
@@ -1,45 +1,123 @@
+#include <float.h>
 #include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "compiler.h"
 #include "environment.h"
+#include "stats.h"
+#include "vm.h"
 
 #define SYMBOL_ARENA_CAPACITY (1024 * 2)
+#define SYMBOL_INITIAL_CAPACITY 64
+#define PARALLEL_CHUNK_ROWS (VM_BLOCK_SIZE * 64)
 
-static double custom_pow(double a, double b) {
+#define POW_MAX_DENOMINATOR 1000000
+#define POW_TOLERANCE 1e-9
+
+// Smallest q below POW_MAX_DENOMINATOR with b * q within POW_TOLERANCE of an
+// integer, or 0 when there is none. The tolerance also covers the rounding
+// error of b once b * q is large. Any such q approximates b better than all
+// smaller denominators, which makes it the denominator of a convergent of b.
+// The continued fraction of b's fractional part, computed exactly in 62-bit
+// fixed point, reaches it in a few dozen steps at most.
+static int64_t rational_denominator(double b) {
+    uint64_t numerator = (uint64_t)ldexp(b - floor(b), 62);
+    uint64_t denominator = (uint64_t)1 << 62;
+    int64_t previous = 0, q = 1;
+
+    while (q < POW_MAX_DENOMINATOR) {
+        double p = b * (double)q;
+        if (fabs(p - round(p)) < fmax(POW_TOLERANCE, fabs(p) * DBL_EPSILON)) return q;
+        if (numerator == 0) break;
+
+        uint64_t quotient = denominator / numerator, remainder = denominator % numerator;
+        if (quotient >= POW_MAX_DENOMINATOR) break;
+
+        denominator = numerator;
+        numerator = remainder;
+
+        int64_t next = (int64_t)quotient * q + previous;
+        previous = q;
+        q = next;
+    }
+
+    return 0;
+}
+
+double custom_pow(double a, double b) {
     if (a == 0.0) {
         if (b == 0.0) return 1.0;
         if (b < 0.0) return INFINITY;
         return 0.0;
     }
 
+    // Both exact, where pow is not always correctly rounded for 0.5
+    if (b == 2.0) return a * a;
+    if (b == 0.5) return sqrt(a);
+
     if (a > 0.0) return pow(a, b);
 
-    double int_part;
-    if (modf(b, &int_part) == 0.0) {
+    // Integers and infinities, with the sign following the parity. Doubles from
+    // 2^53 on are even, and infinities count as odd.
+    if (b == trunc(b)) {
         double res = pow(-a, b);
-        return (fmod(int_part, 2.0) != 0.0) ? -res : res;
+        bool odd = (fabs(b) < 0x1p53) ? ((int64_t)b & 1) != 0 : isinf(b);
+        return odd ? -res : res;
     }
 
-    for (int q = 1; q < 1000000; q++) {
-        double p = b * q;
-        if (fabs(p - round(p)) < 1e-9) {
-            int p_int = (int)round(p);
-            if (q % 2 != 0) {
-                double res = pow(fabs(a), b);
-                return (p_int % 2 != 0) ? -res : res;
-            }
-            break;
-        }
+    if (isnan(b)) return NAN;
+
+    // Rationals p/q with an odd q, where the sign follows the parity of p
+    int64_t q = rational_denominator(b);
+    if (q == 0 || q % 2 == 0) return NAN;
+
+    double res = pow(-a, b);
+    return (fmod(round(b * (double)q), 2.0) != 0.0) ? -res : res;
+}
+
+static uint32_t hash_name(const char *name, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool grow_index(SymbolTable *table, int capacity) {
+    int *index = malloc(sizeof(int) * capacity);
+    if (index == NULL) return false;
+
+    for (int i = 0; i < capacity; i++) index[i] = -1;
+
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (int i = 0; i < table->count; i++) {
+        uint32_t position = table->symbols[i].hash & mask;
+        while (index[position] != -1) position = (position + 1) & mask;
+        index[position] = i;
     }
 
-    return NAN;
+    free(table->index);
+    table->index = index;
+    table->index_capacity = capacity;
+    return true;
 }
 
 SymbolTable symbol_table_init() {
-    SymbolTable table;
-    table.count = 0;
+    SymbolTable table = {0};
+    table.capacity = SYMBOL_INITIAL_CAPACITY;
+    table.symbols = malloc(sizeof(Symbol) * table.capacity);
+
+    if (table.symbols == NULL || !grow_index(&table, SYMBOL_INITIAL_CAPACITY * 2)) {
+        fprintf(stderr, "Error: Unable to initialize symbol table\n");
+        exit(EXIT_FAILURE);
+    }
+
     table.arena = arena_init(SYMBOL_ARENA_CAPACITY);
 
     if (table.arena == NULL) {
@@ -47,33 +125,66 @@ SymbolTable symbol_table_init() {
         exit(EXIT_FAILURE);
     }
 
-    symbol_table_set(&table, "e", 1, 2.7182818284590452354);
-    symbol_table_set(&table, "pi", 2, 3.14159265358979323846);
+    for (int i = 0; i < BUILTIN_COUNT; i++) {
+        if (builtins[i].arity < 0) symbol_table_set(&table, builtins[i].name, builtins[i].length, builtins[i].value);
+    }
 
     return table;
 }
 
 void symbol_table_free(SymbolTable *symbol_table) {
     arena_free(symbol_table->arena);
+    free(symbol_table->symbols);
+    free(symbol_table->index);
 }
 
-Symbol *symbol_table_get(SymbolTable *table, const char *name, int length) {
-    for (int i = 0; i < table->count; i++) {
-        if (table->symbols[i].length == length && strncmp(table->symbols[i].name, name, length) == 0)
-            return &table->symbols[i];
+// Returns the index of the symbol, or -1 when it doesn't exist
+static int find(const SymbolTable *table, const char *name, int length) {
+    uint32_t hash = hash_name(name, length);
+    uint32_t mask = (uint32_t)table->index_capacity - 1;
+    uint32_t position = hash & mask;
+
+    for (; table->index[position] != -1; position = (position + 1) & mask) {
+        const Symbol *symbol = &table->symbols[table->index[position]];
+        if (symbol->hash == hash && symbol->length == length && memcmp(symbol->name, name, length) == 0)
+            break;
     }
 
-    return NULL;
+    // Slots checked, counting the one that ended the search
+    STATS_ADD(lookups, 1);
+    STATS_ADD(probes, ((position - hash) & mask) + 1);
+    STATS_MAX(max_probes, ((position - hash) & mask) + 1);
+    return table->index[position];
+}
+
+Symbol *symbol_table_get(SymbolTable *table, const char *name, int length) {
+    int index = find(table, name, length);
+    return (index >= 0) ? &table->symbols[index] : NULL;
 }
 
 void symbol_table_set(SymbolTable *table, const char *name, int length, double value) {
-    Symbol *existing = symbol_table_get(table, name, length);
-    if (existing) {
-        existing->value = value;
+    int existing = find(table, name, length);
+    if (existing >= 0) {
+        symbol_table_store(table, existing, value);
         return;
     }
 
-    if (table->count >= MAX_SYMBOLS) fprintf(stderr, "Error: Symbol table full\n");
+    // Keep the load factor at or below one half
+    if ((table->count + 1) * 2 > table->index_capacity && !grow_index(table, table->index_capacity * 2)) {
+        fprintf(stderr, "Error: Unable to allocate symbol\n");
+        return;
+    }
+
+    if (table->count == table->capacity) {
+        Symbol *symbols = realloc(table->symbols, sizeof(Symbol) * table->capacity * 2);
+        if (symbols == NULL) {
+            fprintf(stderr, "Error: Unable to allocate symbol\n");
+            return;
+        }
+
+        table->symbols = symbols;
+        table->capacity *= 2;
+    }
 
     char *persistent_name = arena_alloc(table->arena, length + 1);
     if (persistent_name == NULL) {
@@ -83,7 +194,31 @@ void symbol_table_set(SymbolTable *table, const char *name, int length, double v
 
     memcpy(persistent_name, name, length);
     persistent_name[length] = '\0';
-    table->symbols[table->count++] = (Symbol){persistent_name, length, value};
+
+    uint32_t hash = hash_name(name, length);
+    uint32_t mask = (uint32_t)table->index_capacity - 1;
+    uint32_t position = hash & mask;
+    while (table->index[position] != -1) position = (position + 1) & mask;
+
+    table->index[position] = table->count;
+    table->symbols[table->count++] = (Symbol){persistent_name, length, hash, value};
+
+    if (table->on_set != NULL) table->on_set(table->on_set_context, table->count - 1);
+}
+
+// Sets the value of a symbol by index, notifying the on_set hook
+void symbol_table_store(SymbolTable *table, int symbol, double value) {
+    table->symbols[symbol].value = value;
+    if (table->on_set != NULL) table->on_set(table->on_set_context, symbol);
+}
+
+// Removes every symbol, keeping the allocated capacity
+void symbol_table_clear(SymbolTable *table) {
+    if (table->count == 0) return;
+
+    for (int i = 0; i < table->index_capacity; i++) table->index[i] = -1;
+    table->count = 0;
+    arena_clear(table->arena);
 }
 
 void symbol_table_print(SymbolTable *symbol_table) {
@@ -92,21 +227,68 @@ void symbol_table_print(SymbolTable *symbol_table) {
     }
 }
 
-double env_evaluate(Node *node, SymbolTable *symbol_table) {
+// Resolves identifiers to symbol indices so evaluation skips the name lookup.
+// Returns how many stayed unresolved; those keep falling back to a lookup
+// until the tree is bound again after their symbols are created.
+int env_bind(Node *node, SymbolTable *symbol_table) {
     switch (node->type) {
         case NODE_NUMBER:
-            return node->as.number;
+            return 0;
 
         case NODE_IDENTIFIER: {
+            if (node->as.identifier.slot >= 0) return 0;
+
             Symbol *symbol = symbol_table_get(symbol_table, node->as.identifier.name, node->as.identifier.length);
-            if (symbol) return symbol->value;
+            node->as.identifier.slot = symbol ? (int)(symbol - symbol_table->symbols) : -1;
+            return symbol ? 0 : 1;
+        }
+
+        case NODE_UNARY:
+            return env_bind(node->as.unary.right, symbol_table);
+
+        case NODE_BINARY:
+            return env_bind(node->as.binary.left, symbol_table) + env_bind(node->as.binary.right, symbol_table);
+
+        case NODE_CALL: {
+            int unresolved = 0;
+            for (int i = 0; i < node->as.call.argument_count; i++)
+                unresolved += env_bind(node->as.call.arguments[i], symbol_table);
+            return unresolved;
+        }
+    }
 
-            fprintf(stderr, "Error: Undefined variable '%.*s'\n", node->as.identifier.length, node->as.identifier.name);
+    return 0;
+}
+
+// Reads 'locals' before the symbol table and writes assignments to 'locals'.
+// Both are the same table unless the symbol table is a shared snapshot.
+static double evaluate(Node *node, const SymbolTable *symbol_table, SymbolTable *locals) {
+    STATS_ADD(visits[node->type], symbol_table != NULL);
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            return node->as.number;
+
+        case NODE_IDENTIFIER: {
+            const IdentifierData *identifier = &node->as.identifier;
+
+            if (locals != symbol_table && locals->count > 0) {
+                int local = find(locals, identifier->name, identifier->length);
+                if (local >= 0) return locals->symbols[local].value;
+            }
+
+            if (identifier->slot >= 0) return symbol_table->symbols[identifier->slot].value;
+
+            int index = find(symbol_table, identifier->name, identifier->length);
+            if (index >= 0) return symbol_table->symbols[index].value;
+
+            fprintf(stderr, "Error: Undefined variable '%.*s'\n", identifier->length, identifier->name);
+            STATS_ADD(errors, 1);
             return NAN;
         }
 
         case NODE_UNARY: {
-            double right = env_evaluate(node->as.unary.right, symbol_table);
+            double right = evaluate(node->as.unary.right, symbol_table, locals);
             switch (node->as.unary.op.type) {
                 case TOK_PLUS:  return right;
                 case TOK_MINUS: return -right;
@@ -117,14 +299,17 @@ double env_evaluate(Node *node, SymbolTable *symbol_table) {
 
         case NODE_BINARY: {
             if (node->as.binary.op.type == TOK_EQUAL) {
-                double value = env_evaluate(node->as.binary.right, symbol_table);
-                symbol_table_set(symbol_table, node->as.binary.left->as.identifier.name, node->as.binary.left->as.identifier.length, value);
+                double value = evaluate(node->as.binary.right, symbol_table, locals);
+                IdentifierData *target = &node->as.binary.left->as.identifier;
+
+                if (target->slot >= 0 && locals == symbol_table) symbol_table_store(locals, target->slot, value);
+                else symbol_table_set(locals, target->name, target->length, value);
 
                 return value;
             }
 
-            double left = env_evaluate(node->as.binary.left, symbol_table);
-            double right = env_evaluate(node->as.binary.right, symbol_table);
+            double left = evaluate(node->as.binary.left, symbol_table, locals);
+            double right = evaluate(node->as.binary.right, symbol_table, locals);
 
             switch (node->as.binary.op.type) {
                 case TOK_PLUS:  return left + right;
@@ -133,6 +318,7 @@ double env_evaluate(Node *node, SymbolTable *symbol_table) {
                 case TOK_SLASH:
                     if (right == 0.0) {
                         fprintf(stderr, "Error: Division by zero\n");
+                        STATS_ADD(errors, symbol_table != NULL);
                         return NAN;
                     }
                     return left / right;
@@ -142,32 +328,162 @@ double env_evaluate(Node *node, SymbolTable *symbol_table) {
         }
 
         case NODE_CALL: {
-            double argument = env_evaluate(node->as.call.argument, symbol_table);
-            const char *name = node->as.call.function->as.identifier.name;
-            int length = node->as.call.function->as.identifier.length;
-
-            if (strncmp(name, "sin", length) == 0)     return sin(argument);
-            if (strncmp(name, "cos", length) == 0)     return cos(argument);
-            if (strncmp(name, "tan", length) == 0)     return tan(argument);
-            if (strncmp(name, "arcsin", length) == 0)  return asin(argument);
-            if (strncmp(name, "arccos", length) == 0)  return acos(argument);
-            if (strncmp(name, "arctan", length) == 0)  return atan(argument);
-            if (strncmp(name, "sinh", length) == 0)    return sinh(argument);
-            if (strncmp(name, "cosh", length) == 0)    return cosh(argument);
-            if (strncmp(name, "tanh", length) == 0)    return tanh(argument);
-            if (strncmp(name, "arcsinh", length) == 0) return asinh(argument);
-            if (strncmp(name, "arccosh", length) == 0) return acosh(argument);
-            if (strncmp(name, "arctanh", length) == 0) return atanh(argument);
-            if (strncmp(name, "abs", length) == 0)     return fabs(argument);
-            if (strncmp(name, "sqrt", length) == 0)    return sqrt(argument);
-            if (strncmp(name, "ln", length) == 0)      return log(argument);
-            if (strncmp(name, "log", length) == 0)     return log10(argument);
-            if (strncmp(name, "exp", length) == 0)     return exp(argument);
+            double arguments[BUILTIN_MAX_ARGUMENTS];
+            for (int i = 0; i < node->as.call.argument_count; i++)
+                arguments[i] = evaluate(node->as.call.arguments[i], symbol_table, locals);
 
-            return 0.0;
+            const Builtin *builtin = node->as.call.builtin;
+            STATS_ADD(calls[builtin->id < BUILTIN_COUNT ? builtin->id : BUILTIN_COUNT], symbol_table != NULL);
+            return builtin->function(arguments);
         }
 
         default:
             return 0.0;
     }
-}
\ No newline at end of file
+}
+
+double env_evaluate(Node *node, SymbolTable *symbol_table) {
+    // Constant folding, which stays out of the instrumentation counters
+    if (symbol_table == NULL) return evaluate(node, NULL, NULL);
+
+    STATS_START(start);
+    double value = evaluate(node, symbol_table, symbol_table);
+    STATS_STOP(start, evaluations, evaluate_cycles);
+    STATS_ADD(nans, isnan(value));
+    return value;
+}
+
+// Evaluates against a symbol table that is only read, so threads can share it
+// as a snapshot. Assignments go to 'locals' instead, which shadows the table.
+double env_evaluate_local(Node *node, const SymbolTable *symbol_table, SymbolTable *locals) {
+    return evaluate(node, symbol_table, locals);
+}
+
+// Compiles the tree and resolves every input slot to a column or to a scalar
+// read from the symbol table. Returns the inputs, or NULL on failure.
+static VmInput *batch_prepare(Node *node, SymbolTable *symbol_table, const Column *columns, int column_count,
+                              Program *program) {
+    if (!compiler_compile(program, node)) return NULL;
+
+    VmInput *inputs = malloc(sizeof(VmInput) * ((size_t)program->slot_count + 1));
+    if (inputs == NULL) {
+        fprintf(stderr, "Error: Unable to allocate batch inputs\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < program->slot_count; i++) {
+        const ProgramSlot *slot = &program->slots[i];
+        inputs[i] = (VmInput){NULL, NAN};
+        if (!slot->input) continue;
+
+        for (int j = 0; j < column_count; j++) {
+            if (columns[j].length == slot->length && memcmp(columns[j].name, slot->name, slot->length) == 0) {
+                inputs[i].column = columns[j].data;
+                break;
+            }
+        }
+
+        if (inputs[i].column != NULL) continue;
+
+        Symbol *symbol = symbol_table_get(symbol_table, slot->name, slot->length);
+        if (symbol == NULL) {
+            fprintf(stderr, "Error: Undefined variable '%.*s'\n", slot->length, slot->name);
+            free(inputs);
+            return NULL;
+        }
+
+        inputs[i].scalar = symbol->value;
+    }
+
+    return inputs;
+}
+
+// Identifiers named by a column read it row by row, any other identifier reads
+// its symbol table value for every row. Assignments stay local to each row and
+// never touch the symbol table. Errors are reported through the per-row flags
+// in 'errors' (optional) instead of stderr. Returns the number of rows with
+// errors, or -1 when the expression cannot be evaluated at all.
+long env_evaluate_batch(Node *node, SymbolTable *symbol_table, const Column *columns, int column_count,
+                        size_t rows, double *out, uint8_t *errors) {
+    Program program = program_init();
+    VmInput *inputs = batch_prepare(node, symbol_table, columns, column_count, &program);
+    if (inputs == NULL) {
+        program_free(&program);
+        return -1;
+    }
+
+    long result = -1;
+    void *scratch = malloc(vm_batch_scratch_size(&program));
+
+    if (scratch == NULL) fprintf(stderr, "Error: Unable to allocate batch scratch\n");
+    else result = (long)vm_run_batch(&program, inputs, 0, rows, out, errors, scratch);
+
+    free(scratch);
+    free(inputs);
+    program_free(&program);
+    return result;
+}
+
+typedef struct {
+    size_t error_rows;
+    bool failed;
+} ParallelWorker;
+
+typedef struct {
+    const Program *program;
+    const VmInput *inputs;
+    size_t rows;
+    double *out;
+    uint8_t *errors;
+    ParallelWorker *workers;
+} ParallelBatch;
+
+static void parallel_task(void *context, size_t task, int worker, Arena *scratch) {
+    ParallelBatch *batch = context;
+    size_t first_row = task * PARALLEL_CHUNK_ROWS;
+    size_t row_count = batch->rows - first_row;
+    if (row_count > PARALLEL_CHUNK_ROWS) row_count = PARALLEL_CHUNK_ROWS;
+
+    void *memory = arena_alloc(scratch, vm_batch_scratch_size(batch->program));
+    if (memory == NULL) {
+        batch->workers[worker].failed = true;
+        return;
+    }
+
+    batch->workers[worker].error_rows += vm_run_batch(batch->program, batch->inputs, first_row, row_count,
+                                                      batch->out, batch->errors, memory);
+}
+
+// Same contract as env_evaluate_batch, with rows split into chunks across the
+// pool. Workers only read the compiled program and the inputs resolved here on
+// the calling thread, and each writes disjoint slices of 'out' and 'errors', so
+// the symbol table is never touched while the pool runs.
+long env_evaluate_parallel(Node *node, SymbolTable *symbol_table, const Column *columns, int column_count,
+                           size_t rows, double *out, uint8_t *errors, Pool *pool) {
+    Program program = program_init();
+    VmInput *inputs = batch_prepare(node, symbol_table, columns, column_count, &program);
+    ParallelWorker *workers = calloc(pool_size(pool), sizeof(ParallelWorker));
+    long result = -1;
+
+    if (inputs == NULL || workers == NULL) goto cleanup;
+
+    ParallelBatch batch = {&program, inputs, rows, out, errors, workers};
+    pool_run(pool, (rows + PARALLEL_CHUNK_ROWS - 1) / PARALLEL_CHUNK_ROWS, parallel_task, &batch);
+
+    result = 0;
+    for (int i = 0; i < pool_size(pool); i++) {
+        if (workers[i].failed) {
+            fprintf(stderr, "Error: Unable to allocate batch scratch\n");
+            result = -1;
+            break;
+        }
+
+        result += (long)workers[i].error_rows;
+    }
+
+cleanup:
+    free(workers);
+    free(inputs);
+    program_free(&program);
+    return result;
+}
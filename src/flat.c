@@ -0,0 +1,466 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat.h"
+#include "pointer_map.h"
+
+#define FLAT_STACK_VALUES 256
+
+typedef struct {
+    FlatTree *tree;
+    uint32_t node_capacity;
+    uint32_t constant_capacity;
+    uint32_t name_capacity;
+    uint32_t string_capacity;
+    uint32_t argument_capacity;
+    PointerMap emitted; // Node -> index, so nodes shared in a DAG are stored once
+} FlatBuilder;
+
+typedef struct {
+    TokenType type;
+    const char *text;
+} FlatOperator;
+
+static const FlatOperator operators[] = {
+    [FLAT_ASSIGN]    = {TOK_EQUAL, "="},
+    [FLAT_PLUS]      = {TOK_PLUS,  "+"},
+    [FLAT_NEGATE]    = {TOK_MINUS, "-"},
+    [FLAT_FACTORIAL] = {TOK_BANG,  "!"},
+    [FLAT_ADD]       = {TOK_PLUS,  "+"},
+    [FLAT_SUBTRACT]  = {TOK_MINUS, "-"},
+    [FLAT_MULTIPLY]  = {TOK_STAR,  "*"},
+    [FLAT_DIVIDE]    = {TOK_SLASH, "/"},
+    [FLAT_POWER]     = {TOK_CARET, "^"},
+    [FLAT_CALL]      = {TOK_ERROR, NULL},
+};
+
+// Returns the (possibly moved) array with room for 'needed' elements, or NULL
+static void *grow(void *data, uint32_t *capacity, uint32_t needed, size_t size) {
+    if (needed <= *capacity) return data;
+
+    uint32_t new_capacity = *capacity ? *capacity * 2 : 16;
+    while (new_capacity < needed) new_capacity *= 2;
+
+    void *new_data = realloc(data, (size_t)new_capacity * size);
+    if (new_data == NULL) {
+        fprintf(stderr, "Error: Unable to allocate flat tree\n");
+        return NULL;
+    }
+
+    *capacity = new_capacity;
+    return new_data;
+}
+
+static bool push_node(FlatBuilder *builder, FlatOp op, uint32_t a, uint32_t b, uint32_t *index) {
+    FlatTree *tree = builder->tree;
+    FlatNode *nodes = grow(tree->nodes, &builder->node_capacity, tree->count + 1, sizeof(FlatNode));
+    if (nodes == NULL) return false;
+
+    tree->nodes = nodes;
+    tree->nodes[tree->count] = (FlatNode){(uint8_t)op, a, b};
+    *index = tree->count++;
+    return true;
+}
+
+static bool add_constant(FlatBuilder *builder, double value, uint32_t *index) {
+    FlatTree *tree = builder->tree;
+    double *constants = grow(tree->constants, &builder->constant_capacity, tree->constant_count + 1, sizeof(double));
+    if (constants == NULL) return false;
+
+    tree->constants = constants;
+    tree->constants[tree->constant_count] = value;
+    *index = tree->constant_count++;
+    return true;
+}
+
+static bool add_arguments(FlatBuilder *builder, const uint32_t *arguments, int count, uint32_t *offset) {
+    FlatTree *tree = builder->tree;
+    uint32_t *entries = grow(tree->arguments, &builder->argument_capacity, tree->argument_count + count + 1, sizeof(uint32_t));
+    if (entries == NULL) return false;
+
+    tree->arguments = entries;
+    memcpy(tree->arguments + tree->argument_count, arguments, sizeof(uint32_t) * count);
+    *offset = tree->argument_count;
+    tree->argument_count += count;
+    return true;
+}
+
+static bool add_name(FlatBuilder *builder, const char *name, int length, uint32_t *index) {
+    FlatTree *tree = builder->tree;
+
+    for (uint32_t i = 0; i < tree->name_count; i++) {
+        if (tree->names[i].length == (uint32_t)length && memcmp(tree->strings + tree->names[i].offset, name, length) == 0) {
+            *index = i;
+            return true;
+        }
+    }
+
+    FlatName *names = grow(tree->names, &builder->name_capacity, tree->name_count + 1, sizeof(FlatName));
+    if (names == NULL) return false;
+    tree->names = names;
+
+    char *strings = grow(tree->strings, &builder->string_capacity, tree->string_size + length + 1, sizeof(char));
+    if (strings == NULL) return false;
+    tree->strings = strings;
+
+    memcpy(tree->strings + tree->string_size, name, length);
+    tree->strings[tree->string_size + length] = '\0';
+
+    tree->names[tree->name_count] = (FlatName){tree->string_size, (uint32_t)length};
+    tree->string_size += length + 1;
+    *index = tree->name_count++;
+    return true;
+}
+
+static bool emit(FlatBuilder *builder, Node *node, uint32_t *index) {
+    int64_t emitted;
+    if (pointer_map_get(&builder->emitted, node, &emitted)) {
+        *index = (uint32_t)emitted;
+        return true;
+    }
+
+    uint32_t a, b;
+    bool ok = false;
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            ok = add_constant(builder, node->as.number, &a) && push_node(builder, FLAT_NUMBER, a, 0, index);
+            break;
+
+        case NODE_IDENTIFIER:
+            ok = add_name(builder, node->as.identifier.name, node->as.identifier.length, &a) &&
+                 push_node(builder, FLAT_IDENTIFIER, a, 0, index);
+            break;
+
+        case NODE_UNARY: {
+            FlatOp op;
+            switch (node->as.unary.op.type) {
+                case TOK_PLUS:  op = FLAT_PLUS; break;
+                case TOK_MINUS: op = FLAT_NEGATE; break;
+                case TOK_BANG:  op = FLAT_FACTORIAL; break;
+                default:        return false;
+            }
+
+            ok = emit(builder, node->as.unary.right, &a) && push_node(builder, op, a, 0, index);
+            break;
+        }
+
+        case NODE_BINARY: {
+            if (node->as.binary.op.type == TOK_EQUAL) {
+                IdentifierData *target = &node->as.binary.left->as.identifier;
+                ok = emit(builder, node->as.binary.right, &b) &&
+                     add_name(builder, target->name, target->length, &a) &&
+                     push_node(builder, FLAT_ASSIGN, a, b, index);
+                break;
+            }
+
+            FlatOp op;
+            switch (node->as.binary.op.type) {
+                case TOK_PLUS:  op = FLAT_ADD; break;
+                case TOK_MINUS: op = FLAT_SUBTRACT; break;
+                case TOK_STAR:  op = FLAT_MULTIPLY; break;
+                case TOK_SLASH: op = FLAT_DIVIDE; break;
+                case TOK_CARET: op = FLAT_POWER; break;
+                default:        return false;
+            }
+
+            ok = emit(builder, node->as.binary.left, &a) && emit(builder, node->as.binary.right, &b) &&
+                 push_node(builder, op, a, b, index);
+            break;
+        }
+
+        case NODE_CALL: {
+            uint32_t arguments[BUILTIN_MAX_ARGUMENTS];
+            ok = true;
+            for (int i = 0; ok && i < node->as.call.argument_count; i++)
+                ok = emit(builder, node->as.call.arguments[i], &arguments[i]);
+
+            ok = ok && add_arguments(builder, arguments, node->as.call.argument_count, &a) &&
+                 push_node(builder, FLAT_CALL, a, node->as.call.builtin->id, index);
+            break;
+        }
+    }
+
+    return ok && pointer_map_set(&builder->emitted, node, *index);
+}
+
+bool flat_from_node(FlatTree *tree, Node *root) {
+    *tree = (FlatTree){0};
+    FlatBuilder builder = {tree, 0, 0, 0, 0, 0, pointer_map_init()};
+
+    uint32_t index;
+    bool ok = emit(&builder, root, &index);
+    pointer_map_free(&builder.emitted);
+
+    if (!ok) flat_free(tree);
+    return ok;
+}
+
+// Rebuilds a pointer-based tree, sharing nodes where the flat tree does.
+// Identifier names point into the flat tree, which must outlive the result.
+Node *flat_to_node(const FlatTree *tree, Arena *arena) {
+    if (tree->count == 0) return NULL;
+
+    Node **built = malloc(sizeof(Node *) * tree->count);
+    if (built == NULL) {
+        fprintf(stderr, "Error: Unable to allocate flat tree\n");
+        return NULL;
+    }
+
+    Node *root = NULL;
+    for (uint32_t i = 0; i < tree->count; i++) {
+        const FlatNode *flat = &tree->nodes[i];
+        Node *node = arena_alloc(arena, sizeof(Node));
+        if (node == NULL) {
+            fprintf(stderr, "Error: Unable to allocate node\n");
+            root = NULL;
+            break;
+        }
+
+        Token op = {operators[flat->op].type, 1, operators[flat->op].text};
+
+        switch ((FlatOp)flat->op) {
+            case FLAT_NUMBER:
+                node->type = NODE_NUMBER;
+                node->as.number = tree->constants[flat->a];
+                break;
+
+            case FLAT_IDENTIFIER:
+                node->type = NODE_IDENTIFIER;
+                node->as.identifier = (IdentifierData){tree->strings + tree->names[flat->a].offset, (int)tree->names[flat->a].length, -1};
+                break;
+
+            case FLAT_PLUS:
+            case FLAT_NEGATE:
+            case FLAT_FACTORIAL:
+                node->type = NODE_UNARY;
+                node->as.unary = (UnaryData){op, built[flat->a]};
+                break;
+
+            case FLAT_ASSIGN:
+            case FLAT_CALL: {
+                Node *name = arena_alloc(arena, sizeof(Node));
+                if (name == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate node\n");
+                    free(built);
+                    return NULL;
+                }
+
+                name->type = NODE_IDENTIFIER;
+
+                if (flat->op == FLAT_ASSIGN) {
+                    name->as.identifier = (IdentifierData){tree->strings + tree->names[flat->a].offset, (int)tree->names[flat->a].length, -1};
+                    node->type = NODE_BINARY;
+                    node->as.binary = (BinaryData){op, name, built[flat->b]};
+                    break;
+                }
+
+                const Builtin *function = builtin_get(flat->b);
+                Node **arguments = arena_alloc(arena, sizeof(Node *) * (function->arity ? function->arity : 1));
+                if (arguments == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate node\n");
+                    free(built);
+                    return NULL;
+                }
+
+                for (int j = 0; j < function->arity; j++) arguments[j] = built[tree->arguments[flat->a + j]];
+
+                name->as.identifier = (IdentifierData){function->name, function->length, -1};
+                node->type = NODE_CALL;
+                node->as.call = (CallData){name, arguments, function->arity, function};
+                break;
+            }
+
+            default:
+                node->type = NODE_BINARY;
+                node->as.binary = (BinaryData){op, built[flat->a], built[flat->b]};
+                break;
+        }
+
+        built[i] = root = node;
+    }
+
+    free(built);
+    return root;
+}
+
+void flat_free(FlatTree *tree) {
+    free(tree->nodes);
+    free(tree->constants);
+    free(tree->names);
+    free(tree->arguments);
+    free(tree->strings);
+    *tree = (FlatTree){0};
+}
+
+static void print_name(const FlatTree *tree, uint32_t name) {
+    printf("%.*s", (int)tree->names[name].length, tree->strings + tree->names[name].offset);
+}
+
+static void print_node(const FlatTree *tree, uint32_t index) {
+    const FlatNode *node = &tree->nodes[index];
+
+    switch ((FlatOp)node->op) {
+        case FLAT_NUMBER:
+            printf("%lf", tree->constants[node->a]);
+            break;
+
+        case FLAT_IDENTIFIER:
+            print_name(tree, node->a);
+            break;
+
+        case FLAT_PLUS:
+        case FLAT_NEGATE:
+        case FLAT_FACTORIAL:
+            printf("(%s ", operators[node->op].text);
+            print_node(tree, node->a);
+            printf(")");
+            break;
+
+        case FLAT_ASSIGN:
+            printf("(= ");
+            print_name(tree, node->a);
+            printf(" ");
+            print_node(tree, node->b);
+            printf(")");
+            break;
+
+        case FLAT_CALL: {
+            const Builtin *function = builtin_get(node->b);
+            printf("(%s", function->name);
+            for (int i = 0; i < function->arity; i++) {
+                printf(" ");
+                print_node(tree, tree->arguments[node->a + i]);
+            }
+            printf(")");
+            break;
+        }
+
+        default:
+            printf("(%s ", operators[node->op].text);
+            print_node(tree, node->a);
+            printf(" ");
+            print_node(tree, node->b);
+            printf(")");
+            break;
+    }
+}
+
+// Same output as node_print on the equivalent tree
+void flat_print(const FlatTree *tree) {
+    if (tree->count > 0) print_node(tree, tree->count - 1);
+}
+
+static int resolve(const FlatTree *tree, SymbolTable *symbol_table, int *symbols, uint32_t name) {
+    if (symbols[name] >= 0) return symbols[name];
+
+    const FlatName *entry = &tree->names[name];
+    Symbol *symbol = symbol_table_get(symbol_table, tree->strings + entry->offset, (int)entry->length);
+    symbols[name] = symbol ? (int)(symbol - symbol_table->symbols) : -1;
+
+    return symbols[name];
+}
+
+// Computes node 'index' from the values of the nodes before it. Identifiers
+// are left to the caller, and an assignment gives the value it stores.
+double flat_apply(const FlatTree *tree, uint32_t index, const double *values) {
+    const FlatNode *node = &tree->nodes[index];
+    // Operands are only meaningful for the opcodes that reference nodes
+    #define A values[node->a]
+    #define B values[node->b]
+
+    switch ((FlatOp)node->op) {
+        case FLAT_NUMBER:     return tree->constants[node->a];
+        case FLAT_ASSIGN:     return B;
+        case FLAT_PLUS:       return A;
+        case FLAT_NEGATE:     return -A;
+        case FLAT_FACTORIAL:  return tgamma(A + 1);
+        case FLAT_ADD:        return A + B;
+        case FLAT_SUBTRACT:   return A - B;
+        case FLAT_MULTIPLY:   return A * B;
+
+        case FLAT_DIVIDE:
+            if (B == 0.0) {
+                fprintf(stderr, "Error: Division by zero\n");
+                return NAN;
+            }
+            return A / B;
+
+        case FLAT_POWER:
+            return custom_pow(A, B);
+
+        case FLAT_CALL: {
+            const Builtin *function = builtin_get(node->b);
+            double arguments[BUILTIN_MAX_ARGUMENTS];
+            for (int k = 0; k < function->arity; k++) arguments[k] = values[tree->arguments[node->a + k]];
+
+            return function->function(arguments);
+        }
+
+        default:
+            return NAN;
+    }
+
+    #undef A
+    #undef B
+}
+
+// Same semantics as env_evaluate, computed in one pass over the nodes. Each
+// name is looked up at most until it resolves, then read by symbol index.
+double flat_evaluate(const FlatTree *tree, SymbolTable *symbol_table) {
+    if (tree->count == 0) return NAN;
+
+    double stack_values[FLAT_STACK_VALUES];
+    int stack_symbols[FLAT_STACK_VALUES];
+    double *values = stack_values;
+    int *symbols = stack_symbols;
+
+    if (tree->count > FLAT_STACK_VALUES) values = malloc(sizeof(double) * tree->count);
+    if (tree->name_count > FLAT_STACK_VALUES) symbols = malloc(sizeof(int) * tree->name_count);
+
+    if (values == NULL || symbols == NULL) {
+        fprintf(stderr, "Error: Unable to allocate flat evaluation\n");
+        if (values != stack_values) free(values);
+        if (symbols != stack_symbols) free(symbols);
+        return NAN;
+    }
+
+    for (uint32_t i = 0; i < tree->name_count; i++) symbols[i] = -1;
+
+    for (uint32_t i = 0; i < tree->count; i++) {
+        const FlatNode *node = &tree->nodes[i];
+
+        if (node->op == FLAT_IDENTIFIER) {
+            int symbol = resolve(tree, symbol_table, symbols, node->a);
+            if (symbol >= 0) {
+                values[i] = symbol_table->symbols[symbol].value;
+                continue;
+            }
+
+            const FlatName *name = &tree->names[node->a];
+            fprintf(stderr, "Error: Undefined variable '%.*s'\n", (int)name->length, tree->strings + name->offset);
+            values[i] = NAN;
+            continue;
+        }
+
+        values[i] = flat_apply(tree, i, values);
+
+        if (node->op == FLAT_ASSIGN) {
+            int symbol = resolve(tree, symbol_table, symbols, node->a);
+            if (symbol >= 0) {
+                symbol_table_store(symbol_table, symbol, values[i]);
+            } else {
+                const FlatName *name = &tree->names[node->a];
+                symbol_table_set(symbol_table, tree->strings + name->offset, (int)name->length, values[i]);
+            }
+        }
+    }
+
+    double result = values[tree->count - 1];
+
+    if (values != stack_values) free(values);
+    if (symbols != stack_symbols) free(symbols);
+    return result;
+}
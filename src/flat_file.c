@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat_file.h"
+
+#define FLAT_FILE_ALIGNMENT 8
+#define FLAT_FILE_BATCH 1024
+
+static const size_t section_sizes[FLAT_SECTION_COUNT] = {
+    [FLAT_SECTION_TREES]     = sizeof(FlatFileTree),
+    [FLAT_SECTION_NODES]     = sizeof(FlatNode),
+    [FLAT_SECTION_CONSTANTS] = sizeof(double),
+    [FLAT_SECTION_NAMES]     = sizeof(FlatName),
+    [FLAT_SECTION_ARGUMENTS] = sizeof(uint32_t),
+    [FLAT_SECTION_FUNCTIONS] = sizeof(FlatFileFunction),
+    [FLAT_SECTION_STRINGS]   = sizeof(char),
+};
+
+static uint64_t align(uint64_t offset) {
+    return (offset + FLAT_FILE_ALIGNMENT - 1) & ~(uint64_t)(FLAT_FILE_ALIGNMENT - 1);
+}
+
+// Collects the distinct callees of the trees, with their names appended after
+// the strings of the trees
+static bool collect_functions(const FlatTree *trees, uint32_t tree_count, uint64_t string_size,
+                              FlatFileFunction **result, uint32_t *function_count) {
+    FlatFileFunction *functions = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+
+    for (uint32_t t = 0; t < tree_count; t++) {
+        for (uint32_t i = 0; i < trees[t].count; i++) {
+            if (trees[t].nodes[i].op != FLAT_CALL) continue;
+
+            uint32_t id = trees[t].nodes[i].b;
+            uint32_t j = 0;
+            while (j < count && functions[j].id != id) j++;
+            if (j < count) continue;
+
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                FlatFileFunction *grown = realloc(functions, sizeof(FlatFileFunction) * capacity);
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Unable to allocate flat file functions\n");
+                    free(functions);
+                    return false;
+                }
+                functions = grown;
+            }
+
+            const Builtin *function = builtin_get(id);
+            functions[count++] = (FlatFileFunction){id, function->arity, {(uint32_t)string_size, (uint32_t)function->length}};
+            string_size += function->length;
+        }
+    }
+
+    *result = functions;
+    *function_count = count;
+    return true;
+}
+
+static bool write_padding(FILE *output, uint64_t *position) {
+    static const char zeros[FLAT_FILE_ALIGNMENT] = {0};
+    size_t padding = (size_t)(align(*position) - *position);
+
+    *position += padding;
+    return fwrite(zeros, 1, padding, output) == padding;
+}
+
+static bool write_section(FILE *output, uint64_t *position, const void *data, size_t count, size_t size) {
+    *position += (uint64_t)count * size;
+    return count == 0 || fwrite(data, size, count, output) == count;
+}
+
+// Copies nodes field by field, so the padding written is zero
+static bool write_nodes(FILE *output, uint64_t *position, const FlatNode *nodes, uint32_t count) {
+    FlatNode batch[FLAT_FILE_BATCH];
+
+    for (uint32_t first = 0; first < count; first += FLAT_FILE_BATCH) {
+        uint32_t size = (count - first < FLAT_FILE_BATCH) ? count - first : FLAT_FILE_BATCH;
+
+        memset(batch, 0, sizeof(FlatNode) * size);
+        for (uint32_t i = 0; i < size; i++) {
+            batch[i].op = nodes[first + i].op;
+            batch[i].a = nodes[first + i].a;
+            batch[i].b = nodes[first + i].b;
+        }
+
+        if (!write_section(output, position, batch, size, sizeof(FlatNode))) return false;
+    }
+
+    return true;
+}
+
+// Writes the trees to a single file, in which they keep their order
+bool flat_file_write(const char *path, const FlatTree *trees, uint32_t tree_count) {
+    FlatFileHeader header = {0};
+    memcpy(header.magic, FLAT_FILE_MAGIC, sizeof(header.magic));
+    header.version = FLAT_FILE_VERSION;
+    header.byte_order = FLAT_FILE_BYTE_ORDER;
+
+    uint64_t totals[FLAT_SECTION_COUNT] = {0};
+    totals[FLAT_SECTION_TREES] = (uint64_t)tree_count + 1;
+
+    for (uint32_t t = 0; t < tree_count; t++) {
+        totals[FLAT_SECTION_NODES] += trees[t].count;
+        totals[FLAT_SECTION_CONSTANTS] += trees[t].constant_count;
+        totals[FLAT_SECTION_NAMES] += trees[t].name_count;
+        totals[FLAT_SECTION_ARGUMENTS] += trees[t].argument_count;
+        totals[FLAT_SECTION_STRINGS] += trees[t].string_size;
+    }
+
+    FlatFileFunction *functions;
+    uint32_t function_count;
+    if (!collect_functions(trees, tree_count, totals[FLAT_SECTION_STRINGS], &functions, &function_count)) return false;
+
+    totals[FLAT_SECTION_FUNCTIONS] = function_count;
+    for (uint32_t i = 0; i < function_count; i++) totals[FLAT_SECTION_STRINGS] += functions[i].name.length;
+
+    // Offsets within the trees are 32 bits
+    for (int s = 0; s < FLAT_SECTION_COUNT; s++) {
+        if (totals[s] > UINT32_MAX) {
+            fprintf(stderr, "Error: Too many trees for a flat file\n");
+            free(functions);
+            return false;
+        }
+    }
+
+    uint64_t offset = align(sizeof(FlatFileHeader));
+    for (int s = 0; s < FLAT_SECTION_COUNT; s++) {
+        header.sections[s] = (FlatFileSection){offset, totals[s]};
+        offset = align(offset + totals[s] * section_sizes[s]);
+    }
+    header.size = offset;
+
+    FILE *output = fopen(path, "wb");
+    if (output == NULL) {
+        fprintf(stderr, "Error: Unable to open '%s'\n", path);
+        free(functions);
+        return false;
+    }
+
+    uint64_t position = 0;
+    bool ok = write_section(output, &position, &header, 1, sizeof(header)) && write_padding(output, &position);
+
+    FlatFileTree entry = {0};
+    for (uint32_t t = 0; ok && t <= tree_count; t++) {
+        ok = write_section(output, &position, &entry, 1, sizeof(entry));
+        if (t == tree_count) break;
+
+        entry.node_offset += trees[t].count;
+        entry.constant_offset += trees[t].constant_count;
+        entry.name_offset += trees[t].name_count;
+        entry.argument_offset += trees[t].argument_count;
+        entry.string_offset += trees[t].string_size;
+    }
+    ok = ok && write_padding(output, &position);
+
+    for (uint32_t t = 0; ok && t < tree_count; t++) ok = write_nodes(output, &position, trees[t].nodes, trees[t].count);
+    ok = ok && write_padding(output, &position);
+
+    for (uint32_t t = 0; ok && t < tree_count; t++)
+        ok = write_section(output, &position, trees[t].constants, trees[t].constant_count, sizeof(double));
+    ok = ok && write_padding(output, &position);
+
+    for (uint32_t t = 0; ok && t < tree_count; t++)
+        ok = write_section(output, &position, trees[t].names, trees[t].name_count, sizeof(FlatName));
+    ok = ok && write_padding(output, &position);
+
+    for (uint32_t t = 0; ok && t < tree_count; t++)
+        ok = write_section(output, &position, trees[t].arguments, trees[t].argument_count, sizeof(uint32_t));
+    ok = ok && write_padding(output, &position);
+
+    ok = ok && write_section(output, &position, functions, function_count, sizeof(FlatFileFunction)) &&
+         write_padding(output, &position);
+
+    for (uint32_t t = 0; ok && t < tree_count; t++)
+        ok = write_section(output, &position, trees[t].strings, trees[t].string_size, sizeof(char));
+    for (uint32_t i = 0; ok && i < function_count; i++) {
+        const Builtin *function = builtin_get(functions[i].id);
+        ok = write_section(output, &position, function->name, function->length, sizeof(char));
+    }
+    ok = ok && write_padding(output, &position);
+
+    if (fclose(output) != 0) ok = false;
+    if (!ok) fprintf(stderr, "Error: Unable to write '%s'\n", path);
+
+    free(functions);
+    return ok;
+}
+
+static const void *section(const FlatFile *file, FlatSection index) {
+    return file->source.text + file->header->sections[index].offset;
+}
+
+static bool valid_header(const FlatFile *file) {
+    const FlatFileHeader *header = file->header;
+    size_t size = file->source.length;
+
+    if (size < sizeof(FlatFileHeader) || memcmp(header->magic, FLAT_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Error: Not a flat file\n");
+        return false;
+    }
+
+    if (header->version != FLAT_FILE_VERSION || header->byte_order != FLAT_FILE_BYTE_ORDER) {
+        fprintf(stderr, "Error: Unsupported flat file version or byte order\n");
+        return false;
+    }
+
+    if (header->size != size) {
+        fprintf(stderr, "Error: Truncated flat file\n");
+        return false;
+    }
+
+    for (int s = 0; s < FLAT_SECTION_COUNT; s++) {
+        const FlatFileSection *entry = &header->sections[s];
+        if (entry->offset % FLAT_FILE_ALIGNMENT != 0 || entry->offset > size ||
+            entry->count > (size - entry->offset) / section_sizes[s] || entry->count > UINT32_MAX ||
+            (s == FLAT_SECTION_TREES && entry->count == 0)) {
+            fprintf(stderr, "Error: Corrupt flat file section\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Matches the callees of the file with the current builtins by name. When an
+// id differs, the nodes are copied so their calls can be renumbered.
+static bool resolve_functions(FlatFile *file) {
+    const FlatFileFunction *functions = section(file, FLAT_SECTION_FUNCTIONS);
+    const char *strings = section(file, FLAT_SECTION_STRINGS);
+    uint64_t function_count = file->header->sections[FLAT_SECTION_FUNCTIONS].count;
+    uint64_t string_size = file->header->sections[FLAT_SECTION_STRINGS].count;
+    uint64_t node_count = file->header->sections[FLAT_SECTION_NODES].count;
+
+    uint32_t *ids = malloc(sizeof(uint32_t) * (function_count ? function_count : 1));
+    if (ids == NULL) {
+        fprintf(stderr, "Error: Unable to allocate flat file functions\n");
+        return false;
+    }
+
+    bool moved = false;
+    for (uint64_t i = 0; i < function_count; i++) {
+        const FlatName *name = &functions[i].name;
+        if ((uint64_t)name->offset + name->length > string_size) {
+            fprintf(stderr, "Error: Corrupt flat file function\n");
+            free(ids);
+            return false;
+        }
+
+        const Builtin *function = builtin_lookup(strings + name->offset, (int)name->length);
+        if (function == NULL || function->arity != functions[i].arity) {
+            fprintf(stderr, "Error: Unknown function '%.*s' in flat file\n", (int)name->length, strings + name->offset);
+            free(ids);
+            return false;
+        }
+
+        ids[i] = function->id;
+        moved |= function->id != functions[i].id;
+    }
+
+    if (moved) {
+        file->nodes = malloc(sizeof(FlatNode) * (node_count ? node_count : 1));
+        if (file->nodes == NULL) {
+            fprintf(stderr, "Error: Unable to allocate flat file nodes\n");
+            free(ids);
+            return false;
+        }
+
+        memcpy(file->nodes, section(file, FLAT_SECTION_NODES), sizeof(FlatNode) * node_count);
+        file->patched = true;
+
+        for (uint64_t i = 0; i < node_count; i++) {
+            FlatNode *node = &file->nodes[i];
+            if (node->op != FLAT_CALL) continue;
+
+            uint64_t j = 0;
+            while (j < function_count && functions[j].id != node->b) j++;
+            node->b = (j < function_count) ? ids[j] : UINT32_MAX; // Rejected by flat_file_tree
+        }
+    }
+
+    free(ids);
+    return true;
+}
+
+// Maps the file and checks its header. Trees are checked one at a time by
+// flat_file_tree, so opening a large file doesn't read all of it.
+bool flat_file_open(FlatFile *file, const char *path) {
+    *file = (FlatFile){0};
+    if (!stream_open(&file->source, path)) return false;
+
+    file->header = (const FlatFileHeader *)file->source.text;
+    if (!valid_header(file)) {
+        flat_file_close(file);
+        return false;
+    }
+
+    file->nodes = (FlatNode *)section(file, FLAT_SECTION_NODES);
+    file->trees = section(file, FLAT_SECTION_TREES);
+    file->tree_count = (uint32_t)file->header->sections[FLAT_SECTION_TREES].count - 1;
+
+    if (!resolve_functions(file)) {
+        flat_file_close(file);
+        return false;
+    }
+
+    return true;
+}
+
+void flat_file_close(FlatFile *file) {
+    if (file->patched) free(file->nodes);
+    stream_close(&file->source);
+    *file = (FlatFile){0};
+}
+
+static bool within(uint32_t offset, uint32_t count, uint64_t total) {
+    return (uint64_t)offset + count <= total;
+}
+
+// Runs of a tree go from its offset to the offset of the next one
+static bool run(uint32_t offset, uint32_t end, uint64_t total, uint32_t *count) {
+    *count = end - offset;
+    return offset <= end && end <= total;
+}
+
+static bool valid_tree(const FlatTree *tree) {
+    for (uint32_t i = 0; i < tree->name_count; i++) {
+        if (!within(tree->names[i].offset, tree->names[i].length, tree->string_size)) return false;
+    }
+
+    for (uint32_t i = 0; i < tree->count; i++) {
+        const FlatNode *node = &tree->nodes[i];
+
+        switch ((FlatOp)node->op) {
+            case FLAT_NUMBER:
+                if (node->a >= tree->constant_count) return false;
+                break;
+
+            case FLAT_IDENTIFIER:
+                if (node->a >= tree->name_count) return false;
+                break;
+
+            case FLAT_ASSIGN:
+                if (node->a >= tree->name_count || node->b >= i) return false;
+                break;
+
+            case FLAT_PLUS:
+            case FLAT_NEGATE:
+            case FLAT_FACTORIAL:
+                if (node->a >= i) return false;
+                break;
+
+            case FLAT_ADD:
+            case FLAT_SUBTRACT:
+            case FLAT_MULTIPLY:
+            case FLAT_DIVIDE:
+            case FLAT_POWER:
+                if (node->a >= i || node->b >= i) return false;
+                break;
+
+            case FLAT_CALL: {
+                const Builtin *function = builtin_get(node->b);
+                if (function == NULL || function->arity < 0 || !within(node->a, (uint32_t)function->arity, tree->argument_count))
+                    return false;
+
+                for (int k = 0; k < function->arity; k++) {
+                    if (tree->arguments[node->a + k] >= i) return false;
+                }
+                break;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Points 'tree' at the arrays of tree 'index' inside the file, without
+// copying. The tree stays valid until the file is closed and must not be
+// passed to flat_free.
+bool flat_file_tree(const FlatFile *file, uint32_t index, FlatTree *tree) {
+    if (index >= file->tree_count) {
+        fprintf(stderr, "Error: No flat file tree %u\n", index);
+        return false;
+    }
+
+    const FlatFileSection *sections = file->header->sections;
+    const FlatFileTree *entry = &file->trees[index];
+    const FlatFileTree *next = entry + 1;
+
+    *tree = (FlatTree){0};
+    bool ok = run(entry->node_offset, next->node_offset, sections[FLAT_SECTION_NODES].count, &tree->count) &&
+              run(entry->constant_offset, next->constant_offset, sections[FLAT_SECTION_CONSTANTS].count, &tree->constant_count) &&
+              run(entry->name_offset, next->name_offset, sections[FLAT_SECTION_NAMES].count, &tree->name_count) &&
+              run(entry->argument_offset, next->argument_offset, sections[FLAT_SECTION_ARGUMENTS].count, &tree->argument_count) &&
+              run(entry->string_offset, next->string_offset, sections[FLAT_SECTION_STRINGS].count, &tree->string_size);
+
+    if (ok) {
+        tree->nodes = file->nodes + entry->node_offset;
+        tree->constants = (double *)section(file, FLAT_SECTION_CONSTANTS) + entry->constant_offset;
+        tree->names = (FlatName *)section(file, FLAT_SECTION_NAMES) + entry->name_offset;
+        tree->arguments = (uint32_t *)section(file, FLAT_SECTION_ARGUMENTS) + entry->argument_offset;
+        tree->strings = (char *)section(file, FLAT_SECTION_STRINGS) + entry->string_offset;
+    }
+
+    if (!ok || !valid_tree(tree)) {
+        fprintf(stderr, "Error: Corrupt flat file tree %u\n", index);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,423 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat.h"
+#include "graph.h"
+
+#define NAME_READ (1 << 0)
+#define NAME_WRITE (1 << 1)
+
+typedef struct {
+    FlatTree tree;
+    double *values;   // Last value of every node
+    int *symbols;     // Symbol index of every name, or -1 while undefined
+    uint8_t *usage;   // NAME_READ and NAME_WRITE, per name
+} GraphFormula;
+
+struct Graph {
+    SymbolTable *symbol_table;
+    int known_symbols; // Symbols that existed at the last resolve
+
+    GraphFormula *formulas;
+    int count;
+    int capacity;
+
+    int *order; // Formula indices, writers of a symbol before its readers
+
+    uint8_t *changed; // Per symbol, during an update
+    int changed_capacity;
+
+    uint8_t *dirty; // Per node of the formula being recomputed
+    uint32_t dirty_capacity;
+
+    bool updating;
+    GraphStats stats;
+};
+
+static void on_set(void *context, int symbol);
+
+Graph *graph_init(SymbolTable *symbol_table) {
+    Graph *graph = calloc(1, sizeof(Graph));
+    if (graph == NULL) {
+        fprintf(stderr, "Error: Unable to allocate graph\n");
+        return NULL;
+    }
+
+    graph->symbol_table = symbol_table;
+    graph->known_symbols = symbol_table->count;
+    symbol_table->on_set = on_set;
+    symbol_table->on_set_context = graph;
+    return graph;
+}
+
+static void formula_free(GraphFormula *formula) {
+    flat_free(&formula->tree);
+    free(formula->values);
+    free(formula->symbols);
+    free(formula->usage);
+}
+
+void graph_free(Graph *graph) {
+    if (graph->symbol_table->on_set_context == graph) {
+        graph->symbol_table->on_set = NULL;
+        graph->symbol_table->on_set_context = NULL;
+    }
+
+    for (int i = 0; i < graph->count; i++) formula_free(&graph->formulas[i]);
+
+    free(graph->formulas);
+    free(graph->order);
+    free(graph->changed);
+    free(graph->dirty);
+    free(graph);
+}
+
+// Returns true when a name was resolved that wasn't before
+static bool resolve(Graph *graph, GraphFormula *formula) {
+    bool resolved = false;
+
+    for (uint32_t i = 0; i < formula->tree.name_count; i++) {
+        if (formula->symbols[i] >= 0) continue;
+
+        const FlatName *name = &formula->tree.names[i];
+        Symbol *symbol = symbol_table_get(graph->symbol_table, formula->tree.strings + name->offset, (int)name->length);
+        if (symbol == NULL) continue;
+
+        formula->symbols[i] = (int)(symbol - graph->symbol_table->symbols);
+        resolved = true;
+    }
+
+    return resolved;
+}
+
+// Lists, for every symbol, the formulas using it in the way 'flag' says.
+// Entry p of the lists is formula[p], followed by entry next[p].
+static void link_users(const Graph *graph, uint8_t flag, int *first, int *formula, int *next) {
+    int pair = 0;
+
+    for (int s = 0; s < graph->symbol_table->count; s++) first[s] = -1;
+
+    for (int f = 0; f < graph->count; f++) {
+        const GraphFormula *user = &graph->formulas[f];
+        for (uint32_t n = 0; n < user->tree.name_count; n++) {
+            int symbol = user->symbols[n];
+            if (!(user->usage[n] & flag) || symbol < 0) continue;
+
+            formula[pair] = f;
+            next[pair] = first[symbol];
+            first[symbol] = pair++;
+        }
+    }
+}
+
+// Orders the formulas so that every writer of a symbol comes before its
+// readers. Returns false when the formulas depend on each other in a cycle.
+static bool sort(Graph *graph) {
+    size_t symbols = (size_t)graph->symbol_table->count + 1;
+    size_t formulas = (size_t)graph->count + 1;
+    size_t pairs = 1;
+    for (int f = 0; f < graph->count; f++) pairs += graph->formulas[f].tree.name_count;
+
+    int *memory = malloc(sizeof(int) * (2 * symbols + 2 * formulas + 4 * pairs));
+    if (memory == NULL) {
+        fprintf(stderr, "Error: Unable to allocate graph order\n");
+        return false;
+    }
+
+    int *first_reader = memory;
+    int *first_writer = first_reader + symbols;
+    int *indegree = first_writer + symbols;
+    int *order = indegree + formulas;
+    int *reader = order + formulas;
+    int *next_reader = reader + pairs;
+    int *writer = next_reader + pairs;
+    int *next_writer = writer + pairs;
+
+    link_users(graph, NAME_READ, first_reader, reader, next_reader);
+    link_users(graph, NAME_WRITE, first_writer, writer, next_writer);
+
+    // One incoming edge per writer of each symbol a formula reads
+    for (int f = 0; f < graph->count; f++) indegree[f] = 0;
+    for (int s = 0; s < graph->symbol_table->count; s++) {
+        for (int w = first_writer[s]; w >= 0; w = next_writer[w]) {
+            for (int r = first_reader[s]; r >= 0; r = next_reader[r]) indegree[reader[r]]++;
+        }
+    }
+
+    int head = 0, tail = 0;
+    for (int f = 0; f < graph->count; f++) {
+        if (indegree[f] == 0) order[tail++] = f;
+    }
+
+    while (head < tail) {
+        const GraphFormula *done = &graph->formulas[order[head++]];
+
+        for (uint32_t n = 0; n < done->tree.name_count; n++) {
+            int symbol = done->symbols[n];
+            if (!(done->usage[n] & NAME_WRITE) || symbol < 0) continue;
+
+            for (int r = first_reader[symbol]; r >= 0; r = next_reader[r]) {
+                if (--indegree[reader[r]] == 0) order[tail++] = reader[r];
+            }
+        }
+    }
+
+    bool ok = tail == graph->count;
+    if (ok) memcpy(graph->order, order, sizeof(int) * graph->count);
+
+    free(memory);
+    return ok;
+}
+
+// Makes room for a flag per symbol and per node of 'formula'
+static bool reserve(Graph *graph, const GraphFormula *formula) {
+    int symbols = graph->symbol_table->count;
+    if (symbols > graph->changed_capacity) {
+        uint8_t *changed = realloc(graph->changed, symbols);
+        if (changed == NULL) return false;
+
+        memset(changed + graph->changed_capacity, 0, symbols - graph->changed_capacity);
+        graph->changed = changed;
+        graph->changed_capacity = symbols;
+    }
+
+    if (formula != NULL && formula->tree.count > graph->dirty_capacity) {
+        uint8_t *dirty = realloc(graph->dirty, formula->tree.count);
+        if (dirty == NULL) return false;
+
+        graph->dirty = dirty;
+        graph->dirty_capacity = formula->tree.count;
+    }
+
+    return true;
+}
+
+static bool reads_changed(const Graph *graph, const GraphFormula *formula) {
+    for (uint32_t n = 0; n < formula->tree.name_count; n++) {
+        int symbol = formula->symbols[n];
+        if ((formula->usage[n] & NAME_READ) && symbol >= 0 && graph->changed[symbol]) return true;
+    }
+
+    return false;
+}
+
+// Recomputes the nodes that read a changed symbol, directly or through their
+// children, or every node when 'all' is set. Symbols assigned a different
+// value are marked as changed in turn, for the formulas after this one.
+static void recompute(Graph *graph, GraphFormula *formula, bool all) {
+    const FlatTree *tree = &formula->tree;
+    Symbol *symbols = graph->symbol_table->symbols;
+    uint8_t *dirty = graph->dirty;
+
+    for (uint32_t i = 0; i < tree->count; i++) {
+        const FlatNode *node = &tree->nodes[i];
+        bool stale = all;
+
+        switch ((FlatOp)node->op) {
+            case FLAT_NUMBER:
+                break;
+
+            case FLAT_IDENTIFIER: {
+                int symbol = formula->symbols[node->a];
+                stale = stale || (symbol >= 0 && graph->changed[symbol]);
+                break;
+            }
+
+            case FLAT_ASSIGN:
+                stale = stale || dirty[node->b];
+                break;
+
+            case FLAT_PLUS:
+            case FLAT_NEGATE:
+            case FLAT_FACTORIAL:
+                stale = stale || dirty[node->a];
+                break;
+
+            case FLAT_CALL: {
+                int arity = builtin_get(node->b)->arity;
+                for (int k = 0; k < arity && !stale; k++) stale = dirty[tree->arguments[node->a + k]];
+                break;
+            }
+
+            default:
+                stale = stale || dirty[node->a] || dirty[node->b];
+                break;
+        }
+
+        dirty[i] = stale;
+        if (!stale) {
+            graph->stats.skipped++;
+            continue;
+        }
+
+        graph->stats.recomputed++;
+
+        if (node->op == FLAT_IDENTIFIER) {
+            int symbol = formula->symbols[node->a];
+            formula->values[i] = (symbol >= 0) ? symbols[symbol].value : NAN;
+
+            if (symbol < 0) {
+                const FlatName *name = &tree->names[node->a];
+                fprintf(stderr, "Error: Undefined variable '%.*s'\n", (int)name->length, tree->strings + name->offset);
+            }
+            continue;
+        }
+
+        double value = flat_apply(tree, i, formula->values);
+        formula->values[i] = value;
+
+        if (node->op == FLAT_ASSIGN) {
+            int symbol = formula->symbols[node->a];
+            if (memcmp(&symbols[symbol].value, &value, sizeof(double)) != 0) {
+                symbols[symbol].value = value;
+                graph->changed[symbol] = 1;
+            }
+        }
+    }
+}
+
+// Brings every formula after a change up to date, in order, skipping those
+// that read none of the changed symbols
+static void propagate(Graph *graph, int skip) {
+    for (int k = 0; k < graph->count; k++) {
+        GraphFormula *formula = &graph->formulas[graph->order[k]];
+        if (graph->order[k] == skip) continue;
+
+        if (!reads_changed(graph, formula)) {
+            graph->stats.skipped += formula->tree.count;
+            continue;
+        }
+
+        if (!reserve(graph, formula)) {
+            fprintf(stderr, "Error: Unable to allocate graph update\n");
+            return;
+        }
+
+        recompute(graph, formula, false);
+    }
+}
+
+static void on_set(void *context, int symbol) {
+    Graph *graph = context;
+    if (graph->updating) return;
+
+    if (!reserve(graph, NULL)) {
+        fprintf(stderr, "Error: Unable to allocate graph update\n");
+        return;
+    }
+
+    graph->updating = true;
+
+    // A new symbol can't have writers in the graph, so the order stays valid
+    if (graph->symbol_table->count > graph->known_symbols) {
+        for (int f = 0; f < graph->count; f++) resolve(graph, &graph->formulas[f]);
+        graph->known_symbols = graph->symbol_table->count;
+    }
+
+    graph->changed[symbol] = 1;
+    propagate(graph, -1);
+    memset(graph->changed, 0, graph->changed_capacity);
+
+    graph->updating = false;
+}
+
+// Adds a copy of the formula and evaluates it, which updates the formulas
+// reading what it assigns. Returns its index, or -1 on failure, including
+// when it would make formulas depend on each other in a cycle.
+int graph_add(Graph *graph, Node *root) {
+    if (graph->count == graph->capacity) {
+        int capacity = graph->capacity ? graph->capacity * 2 : 16;
+        GraphFormula *formulas = realloc(graph->formulas, sizeof(GraphFormula) * capacity);
+        if (formulas != NULL) graph->formulas = formulas;
+
+        int *order = (formulas != NULL) ? realloc(graph->order, sizeof(int) * capacity) : NULL;
+        if (order == NULL) {
+            fprintf(stderr, "Error: Unable to allocate graph formula\n");
+            return -1;
+        }
+
+        graph->order = order;
+        graph->capacity = capacity;
+    }
+
+    int index = graph->count;
+    GraphFormula *formula = &graph->formulas[index];
+    *formula = (GraphFormula){0};
+
+    if (!flat_from_node(&formula->tree, root)) return -1;
+
+    uint32_t names = formula->tree.name_count ? formula->tree.name_count : 1;
+    formula->values = malloc(sizeof(double) * formula->tree.count);
+    formula->symbols = malloc(sizeof(int) * names);
+    formula->usage = calloc(names, sizeof(uint8_t));
+
+    if (formula->values == NULL || formula->symbols == NULL || formula->usage == NULL) {
+        fprintf(stderr, "Error: Unable to allocate graph formula\n");
+        formula_free(formula);
+        return -1;
+    }
+
+    for (uint32_t n = 0; n < formula->tree.name_count; n++) formula->symbols[n] = -1;
+
+    for (uint32_t i = 0; i < formula->tree.count; i++) {
+        const FlatNode *node = &formula->tree.nodes[i];
+        if (node->op == FLAT_IDENTIFIER) formula->usage[node->a] |= NAME_READ;
+        if (node->op == FLAT_ASSIGN) formula->usage[node->a] |= NAME_WRITE;
+    }
+
+    graph->updating = true;
+
+    // Assigned symbols are created up front, so the order can account for them
+    for (uint32_t n = 0; n < formula->tree.name_count; n++) {
+        const FlatName *name = &formula->tree.names[n];
+        const char *text = formula->tree.strings + name->offset;
+
+        if ((formula->usage[n] & NAME_WRITE) && symbol_table_get(graph->symbol_table, text, (int)name->length) == NULL)
+            symbol_table_set(graph->symbol_table, text, (int)name->length, NAN);
+    }
+
+    graph->count++;
+    for (int f = 0; f < graph->count; f++) resolve(graph, &graph->formulas[f]);
+    graph->known_symbols = graph->symbol_table->count;
+
+    bool ok = true;
+    for (uint32_t n = 0; n < formula->tree.name_count; n++) {
+        if ((formula->usage[n] & NAME_WRITE) && formula->symbols[n] < 0) ok = false; // Symbol allocation failed
+    }
+
+    if (ok && !sort(graph)) {
+        fprintf(stderr, "Error: Circular dependency between formulas\n");
+        ok = false;
+    }
+
+    if (ok && !reserve(graph, formula)) {
+        fprintf(stderr, "Error: Unable to allocate graph update\n");
+        ok = false;
+    }
+
+    if (!ok) {
+        graph->count--;
+        formula_free(formula);
+        graph->updating = false;
+        return -1;
+    }
+
+    recompute(graph, formula, true);
+    propagate(graph, index);
+    memset(graph->changed, 0, graph->changed_capacity);
+
+    graph->updating = false;
+    return index;
+}
+
+double graph_value(const Graph *graph, int formula) {
+    const GraphFormula *entry = &graph->formulas[formula];
+    return entry->values[entry->tree.count - 1];
+}
+
+GraphStats graph_stats(const Graph *graph) {
+    return graph->stats;
+}
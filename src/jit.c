@@ -0,0 +1,369 @@
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "environment.h"
+#include "jit.h"
+#include "vm.h"
+
+#if defined(MATHPARSER_JIT) && defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define JIT_NATIVE
+#endif
+
+Jit jit_init() {
+    Jit jit = {0};
+    jit.program = program_init();
+    return jit;
+}
+
+#ifdef JIT_NATIVE
+// Registers live in the stack frame, which is not probed page by page
+#define JIT_MAX_FRAME 4096
+#define JIT_INSTRUCTION_SIZE 64 // Upper bound of the code emitted per instruction
+#define JIT_EXTRA_SIZE 64       // Prologue and epilogue
+
+// Constants ahead of those of the program
+#define DATA_ONE 0
+#define DATA_SIGN 1
+#define DATA_ABS 2
+#define DATA_PROGRAM 3
+
+#define PREFIX_SD 0xf2 // Scalar double
+#define PREFIX_PD 0x66 // Packed double
+
+#define SSE_LOAD 0x10
+#define SSE_STORE 0x11
+#define SSE_SQRT 0x51
+#define SSE_AND 0x54
+#define SSE_XOR 0x57
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+#define SSE_UCOMI 0x2e
+
+typedef enum {
+    BASE_REGISTERS, // [rsp + disp]
+    BASE_SLOTS,     // [rbx + disp]
+    BASE_DATA,      // [rip + disp], addressed by offset in the mapping
+} Base;
+
+typedef void (*Target)(void);
+
+typedef struct {
+    uint8_t *memory; // Data, then code
+    size_t size;
+    size_t data_size;
+    int cached; // Register whose value xmm0 still holds, or -1
+} Emitter;
+
+// Libm functions behind the builtins, called directly instead of through the
+// wrappers taking an argument array. abs and sqrt are single instructions.
+static double (*const direct[BUILTIN_COUNT])(double) = {
+    [BUILTIN_SIN]     = sin,
+    [BUILTIN_COS]     = cos,
+    [BUILTIN_TAN]     = tan,
+    [BUILTIN_ARCSIN]  = asin,
+    [BUILTIN_ARCCOS]  = acos,
+    [BUILTIN_ARCTAN]  = atan,
+    [BUILTIN_SINH]    = sinh,
+    [BUILTIN_COSH]    = cosh,
+    [BUILTIN_TANH]    = tanh,
+    [BUILTIN_ARCSINH] = asinh,
+    [BUILTIN_ARCCOSH] = acosh,
+    [BUILTIN_ARCTANH] = atanh,
+    [BUILTIN_LN]      = log,
+    [BUILTIN_LOG]     = log10,
+    [BUILTIN_EXP]     = exp,
+};
+
+static double division_by_zero() {
+    fprintf(stderr, "Error: Division by zero\n");
+    return NAN;
+}
+
+static void byte(Emitter *emitter, uint8_t value) {
+    emitter->memory[emitter->size++] = value;
+}
+
+static void word(Emitter *emitter, uint32_t value) {
+    for (int i = 0; i < 4; i++) byte(emitter, (uint8_t)(value >> (8 * i)));
+}
+
+// SSE instruction between xmm register 'xmm' and memory
+static void sse_memory(Emitter *emitter, uint8_t prefix, uint8_t opcode, int xmm, Base base, uint32_t offset) {
+    byte(emitter, prefix);
+    byte(emitter, 0x0f);
+    byte(emitter, opcode);
+
+    switch (base) {
+        case BASE_REGISTERS:
+            byte(emitter, (uint8_t)(0x84 | (xmm << 3)));
+            byte(emitter, 0x24);
+            word(emitter, offset);
+            break;
+
+        case BASE_SLOTS:
+            byte(emitter, (uint8_t)(0x83 | (xmm << 3)));
+            word(emitter, offset);
+            break;
+
+        case BASE_DATA:
+            byte(emitter, (uint8_t)(0x05 | (xmm << 3)));
+            word(emitter, (uint32_t)((int64_t)offset - (int64_t)(emitter->size + 4)));
+            break;
+    }
+}
+
+static void sse_registers(Emitter *emitter, uint8_t prefix, uint8_t opcode, int destination, int source) {
+    byte(emitter, prefix);
+    byte(emitter, 0x0f);
+    byte(emitter, opcode);
+    byte(emitter, (uint8_t)(0xc0 | (destination << 3) | source));
+}
+
+static uint32_t data_offset(int index) {
+    return (uint32_t)index * sizeof(double);
+}
+
+static void load(Emitter *emitter, uint32_t reg) {
+    if (emitter->cached == (int)reg) return;
+
+    sse_memory(emitter, PREFIX_SD, SSE_LOAD, 0, BASE_REGISTERS, reg * sizeof(double));
+    emitter->cached = (int)reg;
+}
+
+static void store(Emitter *emitter, uint32_t reg) {
+    sse_memory(emitter, PREFIX_SD, SSE_STORE, 0, BASE_REGISTERS, reg * sizeof(double));
+    emitter->cached = (int)reg;
+}
+
+// mov rax, target; call rax
+static void call(Emitter *emitter, Target target) {
+    uint64_t address;
+    memcpy(&address, &target, sizeof(address));
+
+    byte(emitter, 0x48);
+    byte(emitter, 0xb8);
+    word(emitter, (uint32_t)address);
+    word(emitter, (uint32_t)(address >> 32));
+    byte(emitter, 0xff);
+    byte(emitter, 0xd0);
+    emitter->cached = -1;
+}
+
+static void patch_jump(Emitter *emitter, size_t jump) {
+    emitter->memory[jump + 1] = (uint8_t)(emitter->size - (jump + 2));
+}
+
+// xmm1 = r[b], and r[a] / r[b] unless it is zero, reported like the VM does
+static void divide(Emitter *emitter, const Instruction *ins) {
+    sse_memory(emitter, PREFIX_SD, SSE_LOAD, 1, BASE_REGISTERS, ins->b * sizeof(double));
+    sse_registers(emitter, PREFIX_PD, SSE_XOR, 2, 2);
+    sse_registers(emitter, PREFIX_PD, SSE_UCOMI, 1, 2);
+
+    int cached = emitter->cached;
+    size_t unordered = emitter->size;
+    byte(emitter, 0x7a); // jp nonzero
+    byte(emitter, 0);
+    size_t different = emitter->size;
+    byte(emitter, 0x75); // jne nonzero
+    byte(emitter, 0);
+
+    call(emitter, (Target)division_by_zero);
+    size_t done = emitter->size;
+    byte(emitter, 0xeb); // jmp done
+    byte(emitter, 0);
+
+    patch_jump(emitter, unordered);
+    patch_jump(emitter, different);
+    emitter->cached = cached;
+    load(emitter, ins->a);
+    sse_registers(emitter, PREFIX_SD, SSE_DIV, 0, 1);
+
+    patch_jump(emitter, done);
+}
+
+static void call_builtin(Emitter *emitter, const Builtin *function, uint32_t a) {
+    uint32_t id = function->id;
+
+    if (id == BUILTIN_ABS) {
+        load(emitter, a);
+        sse_memory(emitter, PREFIX_SD, SSE_LOAD, 1, BASE_DATA, data_offset(DATA_ABS));
+        sse_registers(emitter, PREFIX_PD, SSE_AND, 0, 1);
+    } else if (id == BUILTIN_SQRT) {
+        load(emitter, a);
+        sse_registers(emitter, PREFIX_SD, SSE_SQRT, 0, 0);
+    } else if (id < BUILTIN_COUNT && direct[id] != NULL) {
+        load(emitter, a);
+        call(emitter, (Target)direct[id]);
+    } else {
+        // lea rdi, [rsp + a * 8], pointing at the consecutive argument registers
+        byte(emitter, 0x48);
+        byte(emitter, 0x8d);
+        byte(emitter, 0xbc);
+        byte(emitter, 0x24);
+        word(emitter, a * sizeof(double));
+        call(emitter, (Target)function->function);
+    }
+}
+
+static void emit_instruction(Emitter *emitter, const Program *program, const Instruction *ins, uint32_t frame) {
+    switch (ins->op) {
+        case OP_CONST:
+            sse_memory(emitter, PREFIX_SD, SSE_LOAD, 0, BASE_DATA, data_offset(DATA_PROGRAM + (int)ins->a));
+            break;
+
+        case OP_LOAD:
+            sse_memory(emitter, PREFIX_SD, SSE_LOAD, 0, BASE_SLOTS, ins->a * sizeof(double));
+            break;
+
+        case OP_STORE:
+            load(emitter, ins->a);
+            sse_memory(emitter, PREFIX_SD, SSE_STORE, 0, BASE_SLOTS, ins->dst * sizeof(double));
+            return;
+
+        case OP_MOVE:
+            load(emitter, ins->a);
+            break;
+
+        case OP_NEG:
+            load(emitter, ins->a);
+            sse_memory(emitter, PREFIX_SD, SSE_LOAD, 1, BASE_DATA, data_offset(DATA_SIGN));
+            sse_registers(emitter, PREFIX_PD, SSE_XOR, 0, 1);
+            break;
+
+        case OP_FACT:
+            load(emitter, ins->a);
+            sse_memory(emitter, PREFIX_SD, SSE_ADD, 0, BASE_DATA, data_offset(DATA_ONE));
+            call(emitter, (Target)tgamma);
+            break;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL: {
+            uint8_t opcode = (ins->op == OP_ADD) ? SSE_ADD : (ins->op == OP_SUB) ? SSE_SUB : SSE_MUL;
+            load(emitter, ins->a);
+            sse_memory(emitter, PREFIX_SD, opcode, 0, BASE_REGISTERS, ins->b * sizeof(double));
+            break;
+        }
+
+        case OP_DIV:
+            divide(emitter, ins);
+            break;
+
+        case OP_POW:
+            load(emitter, ins->a);
+            sse_memory(emitter, PREFIX_SD, SSE_LOAD, 1, BASE_REGISTERS, ins->b * sizeof(double));
+            call(emitter, (Target)custom_pow);
+            break;
+
+        case OP_CALL:
+            call_builtin(emitter, program->functions[ins->b], ins->a);
+            break;
+
+        case OP_RETURN:
+            load(emitter, ins->a);
+            // add rsp, frame; pop rbx; ret
+            byte(emitter, 0x48);
+            byte(emitter, 0x81);
+            byte(emitter, 0xc4);
+            word(emitter, frame);
+            byte(emitter, 0x5b);
+            byte(emitter, 0xc3);
+            return;
+    }
+
+    store(emitter, ins->dst);
+}
+
+// Emits the program as one function of the slot array, following the System V
+// calling convention. rbx holds the slots and the registers are spilled to the
+// stack frame, so only xmm0 carries a value from one instruction to the next.
+// Arithmetic uses the same scalar SSE2 operations as the compiled VM, in the
+// same order, so results are identical bit for bit.
+static bool emit_program(Jit *jit) {
+    const Program *program = &jit->program;
+    uint32_t frame = ((uint32_t)program->register_count * sizeof(double) + 15) & ~15u;
+    if (frame > JIT_MAX_FRAME) return false;
+
+    size_t data_size = ((size_t)program->constant_count + DATA_PROGRAM) * sizeof(double);
+    size_t size = data_size + (size_t)program->count * JIT_INSTRUCTION_SIZE + JIT_EXTRA_SIZE;
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error: Unable to allocate native code\n");
+        return false;
+    }
+
+    Emitter emitter = {memory, data_size, data_size, -1};
+    double *data = memory;
+    uint64_t sign = 0x8000000000000000ull, abs = 0x7fffffffffffffffull;
+
+    data[DATA_ONE] = 1.0;
+    memcpy(&data[DATA_SIGN], &sign, sizeof(double));
+    memcpy(&data[DATA_ABS], &abs, sizeof(double));
+    if (program->constant_count > 0) {
+        memcpy(&data[DATA_PROGRAM], program->constants, sizeof(double) * program->constant_count);
+    }
+
+    Emitter *e = &emitter;
+
+    // push rbx; mov rbx, rdi; sub rsp, frame
+    byte(e, 0x53);
+    byte(e, 0x48);
+    byte(e, 0x89);
+    byte(e, 0xfb);
+    byte(e, 0x48);
+    byte(e, 0x81);
+    byte(e, 0xec);
+    word(e, frame);
+
+    for (int i = 0; i < program->count; i++) emit_instruction(e, program, &program->code[i], frame);
+
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "Error: Unable to make native code executable\n");
+        munmap(memory, size);
+        return false;
+    }
+
+    uint8_t *entry = (uint8_t *)memory + data_size;
+    memcpy(&jit->native, &entry, sizeof(jit->native));
+    jit->code = memory;
+    jit->code_size = size;
+    return true;
+}
+#endif
+
+void jit_free(Jit *jit) {
+#ifdef JIT_NATIVE
+    if (jit->code != NULL) munmap(jit->code, jit->code_size);
+#endif
+
+    program_free(&jit->program);
+    *jit = jit_init();
+}
+
+// Compiles the tree to bytecode, then to native code where the JIT is built
+// in. Native code is optional: when it cannot be emitted, the program still
+// runs on the VM, and only a failed bytecode compilation returns false.
+bool jit_compile(Jit *jit, Node *root) {
+    jit_free(jit);
+    if (!compiler_compile(&jit->program, root)) return false;
+
+#ifdef JIT_NATIVE
+    emit_program(jit);
+#endif
+
+    return true;
+}
+
+double jit_run(const Jit *jit, double *slots) {
+    if (jit->native != NULL) return jit->native(slots);
+    return vm_run(&jit->program, slots);
+}
@@ -1,74 +1,187 @@
-#include <ctype.h>
-#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "lexer.h"
+#include "stats.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define LEXER_SSE2
+#endif
+
+#define CLASS_BLANK      (1 << 0) // Whitespace other than '\n'
+#define CLASS_NEWLINE    (1 << 1)
+#define CLASS_DIGIT      (1 << 2)
+#define CLASS_HEX        (1 << 3)
+#define CLASS_IDENTIFIER (1 << 4) // Letters, digits and '_'
+#define CLASS_START      (1 << 5) // Letters and '_'
+
+// ASCII only and independent of the locale; bytes above 0x7f have no class
+static const uint8_t char_classes[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x01, 0x01, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x38, 0x38, 0x38, 0x38, 0x38, 0x38, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30,
+    0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x00, 0x00, 0x00, 0x00, 0x30,
+    0x00, 0x38, 0x38, 0x38, 0x38, 0x38, 0x38, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30,
+    0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
 
 static void token_print(FILE *stream, Token token) {
     fprintf(stream, "[Type: %d, Value: %.*s]", token.type, token.length, token.start);
 }
 
-static char peek(const Lexer *lexer) {
-    return *lexer->current;
+static unsigned char_class(char c) {
+    return char_classes[(uint8_t)c];
 }
 
-static char consume(Lexer *lexer) {
-    return *lexer->current++;
+// Reads 'offset' bytes ahead, or '\0' past the end
+static char peek_at(const Lexer *lexer, size_t offset) {
+    return (size_t)(lexer->end - lexer->current) > offset ? lexer->current[offset] : '\0';
+}
+
+#ifdef LEXER_SSE2
+// Bit i is set when byte i is in the class. Only blanks, newlines and digits
+// are tested this way, since those are the runs worth skipping in bulk.
+static unsigned simd_mask(__m128i bytes, unsigned classes) {
+    __m128i match = _mm_setzero_si128();
+
+    if (classes & CLASS_BLANK) {
+        // ' ' or '\t'..'\r' except '\n'
+        __m128i control = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+        control = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control);
+        control = _mm_andnot_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')), control);
+        match = _mm_or_si128(match, _mm_or_si128(control, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '))));
+    }
+
+    if (classes & CLASS_NEWLINE) match = _mm_or_si128(match, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+
+    if (classes & CLASS_DIGIT) {
+        __m128i digit = _mm_sub_epi8(bytes, _mm_set1_epi8('0'));
+        match = _mm_or_si128(match, _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit));
+    }
+
+    return (unsigned)_mm_movemask_epi8(match);
+}
+#endif
+
+// Returns the first byte in [cursor, end) outside 'classes'
+static const char *skip_scalar(const char *cursor, const char *end, unsigned classes) {
+    while (cursor < end && (char_class(*cursor) & classes)) cursor++;
+    return cursor;
+}
+
+// Same as skip_scalar, 16 bytes at a time where the classes allow it
+static const char *skip(const char *cursor, const char *end, unsigned classes) {
+    // Most runs are a byte or two long, too short to pay for a vector scan
+    for (int i = 0; i < 2; i++) {
+        if (cursor == end || !(char_class(*cursor) & classes)) return cursor;
+        cursor++;
+    }
+
+#ifdef LEXER_SSE2
+    while (end - cursor >= 16) {
+        unsigned mask = simd_mask(_mm_loadu_si128((const __m128i *)cursor), classes);
+        if (mask != 0xffff) return cursor + __builtin_ctz(~mask);
+        cursor += 16;
+    }
+#endif
+
+    return skip_scalar(cursor, end, classes);
 }
 
 void lexer_reset(Lexer *lexer, const char *text) {
+    size_t length = 0;
+    while (text[length] != '\0') length++;
+
+    lexer_reset_span(lexer, text, length);
+}
+
+void lexer_reset_span(Lexer *lexer, const char *text, size_t length) {
     lexer->current = text;
+    lexer->end = text + length;
+    lexer->lines = false;
+}
+
+static bool is_hex_prefix(const Lexer *lexer) {
+    return (peek_at(lexer, 1) | 0x20) == 'x' &&
+           ((char_class(peek_at(lexer, 2)) & CLASS_HEX) ||
+            (peek_at(lexer, 2) == '.' && (char_class(peek_at(lexer, 3)) & CLASS_HEX)));
+}
+
+static Token number(Lexer *lexer, Token token) {
+    unsigned exponent = 'e';
+
+    if (*lexer->current == '0' && is_hex_prefix(lexer)) {
+        // Hex literals are rare, so their digits are not worth a vector scan
+        lexer->current = skip_scalar(lexer->current + 2, lexer->end, CLASS_HEX);
+        if (peek_at(lexer, 0) == '.') lexer->current = skip_scalar(lexer->current + 1, lexer->end, CLASS_HEX);
+        exponent = 'p';
+    } else {
+        lexer->current = skip(lexer->current, lexer->end, CLASS_DIGIT);
+        if (peek_at(lexer, 0) == '.') lexer->current = skip(lexer->current + 1, lexer->end, CLASS_DIGIT);
+    }
+
+    // Only take the exponent when digits follow, so "2e" stays two tokens
+    if (((unsigned)peek_at(lexer, 0) | 0x20) == exponent) {
+        size_t sign = (peek_at(lexer, 1) == '+' || peek_at(lexer, 1) == '-') ? 1 : 0;
+        if (char_class(peek_at(lexer, 1 + sign)) & CLASS_DIGIT)
+            lexer->current = skip(lexer->current + 1 + sign, lexer->end, CLASS_DIGIT);
+    }
+
+    token.type = TOK_NUMBER;
+    token.length = (int)(lexer->current - token.start);
+    return token;
 }
 
 Token lexer_next(Lexer *lexer) {
-    while (isspace(peek(lexer))) consume(lexer);
+    unsigned space = lexer->lines ? CLASS_BLANK : CLASS_BLANK | CLASS_NEWLINE;
+    if (lexer->current < lexer->end && (char_class(*lexer->current) & space))
+        lexer->current = skip(lexer->current + 1, lexer->end, space);
 
-    char c = peek(lexer);
     Token token;
     token.start = lexer->current;
 
-    if (c == '\0') {
+    if (lexer->current == lexer->end) {
         // Do not consume, return EOF indefinitely
         token.type = TOK_EOF;
         token.length = 0;
         return token;
     }
 
-    if (isdigit(c)) {
-        while (isdigit(peek(lexer))) consume(lexer);
+    STATS_ADD(tokens, 1);
 
-        if (peek(lexer) == '.') {
-            consume(lexer);
-            while (isdigit(peek(lexer))) consume(lexer);
-        }
+    char c = *lexer->current;
+    unsigned class = char_class(c);
 
-        token.type = TOK_NUMBER;
-        token.length = (int)(lexer->current - token.start);
-        return token;
-    }
+    if (class & CLASS_DIGIT) return number(lexer, token);
 
-    if (isalpha(c) || peek(lexer) == '_') {
-        while (isalnum(peek(lexer)) || peek(lexer) == '_') consume(lexer);
+    if (class & CLASS_START) {
+        lexer->current = skip_scalar(lexer->current + 1, lexer->end, CLASS_IDENTIFIER);
 
         token.type = TOK_IDENTIFIER;
         token.length = (int)(lexer->current - token.start);
         return token;
     }
 
-    consume(lexer);
+    lexer->current++;
     token.length = 1;
 
     switch (c) {
-        case '+': token.type = TOK_PLUS;   break;
-        case '-': token.type = TOK_MINUS;  break;
-        case '*': token.type = TOK_STAR;   break;
-        case '/': token.type = TOK_SLASH;  break;
-        case '^': token.type = TOK_CARET;  break;
-        case '=': token.type = TOK_EQUAL;  break;
-        case '!': token.type = TOK_BANG;   break;
-        case '(': token.type = TOK_LPAREN; break;
-        case ')': token.type = TOK_RPAREN; break;
-        default:  token.type = TOK_ERROR;  break;
+        case '+':  token.type = TOK_PLUS;    break;
+        case '-':  token.type = TOK_MINUS;   break;
+        case '*':  token.type = TOK_STAR;    break;
+        case '/':  token.type = TOK_SLASH;   break;
+        case '^':  token.type = TOK_CARET;   break;
+        case '=':  token.type = TOK_EQUAL;   break;
+        case '!':  token.type = TOK_BANG;    break;
+        case '(':  token.type = TOK_LPAREN;  break;
+        case ')':  token.type = TOK_RPAREN;  break;
+        case ',':  token.type = TOK_COMMA;   break;
+        case '\n': token.type = TOK_NEWLINE; break;
+        default:   token.type = TOK_ERROR;   break;
     }
 
     return token;
@@ -91,4 +204,39 @@ int lexer_print(Lexer *lexer) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Lexes a whole buffer at once, so the parser can run over a contiguous
+// array. Lines are separated by TOK_NEWLINE, and the list ends with TOK_EOF.
+bool lexer_tokenize(TokenList *list, const char *text, size_t length) {
+    Lexer lexer = {0};
+    lexer_reset_span(&lexer, text, length);
+    lexer.lines = true;
+
+    *list = (TokenList){0};
+
+    for (;;) {
+        if (list->count == list->capacity) {
+            // Formulas average a few bytes per token
+            size_t capacity = list->capacity ? list->capacity * 2 : length / 4 + 16;
+            Token *tokens = realloc(list->tokens, sizeof(Token) * capacity);
+            if (tokens == NULL) {
+                fprintf(stderr, "Error: Unable to allocate tokens\n");
+                token_list_free(list);
+                return false;
+            }
+
+            list->tokens = tokens;
+            list->capacity = capacity;
+        }
+
+        Token token = lexer_next(&lexer);
+        list->tokens[list->count++] = token;
+        if (token.type == TOK_EOF) return true;
+    }
+}
+
+void token_list_free(TokenList *list) {
+    free(list->tokens);
+    *list = (TokenList){0};
+}
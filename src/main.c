@@ -1,10 +1,18 @@
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "compiler.h"
+#include "derive.h"
 #include "parser.h"
 #include "environment.h"
+#include "flat_file.h"
+#include "number.h"
+#include "optimizer.h"
+#include "stats.h"
+#include "stream.h"
 
 #define LINE_SIZE 1024
 
@@ -12,11 +20,14 @@ void help() {
     printf("Available commands:\n");
     printf("  .help  Display this help\n");
     printf("  .tree  Toggle AST printing\n");
+    printf("  .code  Toggle bytecode printing\n");
     printf("  .list  Show list of variables\n");
+    printf("  .derive NAME EXPRESSION  Show and evaluate the derivative with respect to NAME\n");
+    printf("  .stats  Show and reset the instrumentation counters\n");
     printf("  .exit  Quit REPL\n");
 }
 
-void parse(Parser *parser, const char *expr, bool show_tree, SymbolTable *symbol_table) {
+void parse(Parser *parser, const char *expr, bool show_tree, bool show_code, SymbolTable *symbol_table) {
     Node *root = parser_parse(parser, expr);
     if (root == NULL) return;
 
@@ -26,23 +37,189 @@ void parse(Parser *parser, const char *expr, bool show_tree, SymbolTable *symbol
         printf("\n");
     }
 
+    if (show_code) {
+        Program program = program_init();
+        if (compiler_compile(&program, root)) {
+            printf("Bytecode:\n");
+            program_print(&program);
+        }
+        program_free(&program);
+    }
+
     double result = env_evaluate(root, symbol_table);
     printf("%lf\n", result);
 }
 
+// Prints the derivative of an expression given as "NAME EXPRESSION", then its value
+void derivative(Parser *parser, char *arguments, SymbolTable *symbol_table) {
+    char *name = arguments + strspn(arguments, " ");
+    char *expr = name + strcspn(name, " ");
+    if (*expr != '\0') *expr++ = '\0';
+
+    if (*name == '\0' || *expr == '\0') {
+        fprintf(stderr, "Error: Expected a variable and an expression after '.derive'\n");
+        return;
+    }
+
+    Node *root = parser_parse(parser, expr);
+    if (root == NULL) return;
+
+    Node *result = derive(parser->arena, root, name);
+    if (result == NULL) return;
+
+    printf("Derivative: ");
+    node_print(result);
+    printf("\n%lf\n", env_evaluate(result, symbol_table));
+}
+
+// Evaluates one formula per line from a file, or stdin when no path is given
+int stream(const char *path) {
+    FILE *input = (path != NULL) ? fopen(path, "rb") : stdin;
+    if (input == NULL) {
+        fprintf(stderr, "Error: Unable to open '%s'\n", path);
+        return EXIT_FAILURE;
+    }
+
+    Parser parser = parser_init();
+    SymbolTable symbol_table = symbol_table_init();
+
+    bool ok = stream_evaluate(&parser, &symbol_table, input, stdout, NULL);
+
+    if (input != stdin) fclose(input);
+    symbol_table_free(&symbol_table);
+    parser_free(&parser);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Evaluates the lines of a file as independent formulas on every core
+int parallel(const char *path) {
+    StreamFile file;
+    if (!stream_open(&file, path)) return EXIT_FAILURE;
+
+    Pool *pool = pool_init(0);
+    if (pool == NULL) {
+        stream_close(&file);
+        return EXIT_FAILURE;
+    }
+
+    SymbolTable symbol_table = symbol_table_init();
+    bool ok = stream_evaluate_parallel(file.text, file.length, &symbol_table, NULL, stdout, NULL, pool);
+
+    pool_free(pool);
+    symbol_table_free(&symbol_table);
+    stream_close(&file);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool is_blank(const char *line, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r') return false;
+    }
+    return true;
+}
+
+// Parses and simplifies every line of a formula file into a flat file. Blank
+// lines become empty trees and lines with errors a NaN constant, so trees
+// match lines and load prints what --stream would.
+int compile(const char *path, const char *output) {
+    StreamFile file;
+    if (!stream_open(&file, path)) return EXIT_FAILURE;
+
+    size_t line_count = stream_line_count(file.text, file.length);
+    FlatTree *trees = calloc(line_count ? line_count : 1, sizeof(FlatTree));
+    if (trees == NULL) {
+        fprintf(stderr, "Error: Unable to allocate flat trees\n");
+        stream_close(&file);
+        return EXIT_FAILURE;
+    }
+
+    Parser parser = parser_init();
+    const char *cursor = file.text;
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < line_count; i++) {
+        const char *end = memchr(cursor, '\n', (size_t)(file.text + file.length - cursor));
+        size_t length = end ? (size_t)(end - cursor) : (size_t)(file.text + file.length - cursor);
+
+        if (!is_blank(cursor, length)) {
+            Node *root = parser_parse_span(&parser, cursor, length);
+            if (root != NULL) {
+                optimizer_fold(root, 0);
+                optimizer_share(&root, 1);
+                ok = flat_from_node(&trees[i], root);
+            } else {
+                fprintf(stderr, "Error: Invalid expression on line %zu\n", i + 1);
+                Node failed = {.type = NODE_NUMBER, .as.number = NAN};
+                ok = flat_from_node(&trees[i], &failed);
+            }
+            arena_clear(parser.arena);
+        }
+
+        cursor += length + 1;
+    }
+
+    ok = ok && flat_file_write(output, trees, (uint32_t)line_count);
+
+    for (size_t i = 0; i < line_count; i++) flat_free(&trees[i]);
+    free(trees);
+    parser_free(&parser);
+    stream_close(&file);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Evaluates the trees of a flat file in order, like --stream does for text
+int load(const char *path) {
+    FlatFile file;
+    if (!flat_file_open(&file, path)) return EXIT_FAILURE;
+
+    SymbolTable symbol_table = symbol_table_init();
+    char buffer[NUMBER_FORMAT_SIZE];
+    bool ok = true;
+
+    for (uint32_t i = 0; ok && i < file.tree_count; i++) {
+        FlatTree tree;
+        ok = flat_file_tree(&file, i, &tree);
+
+        if (ok && tree.count > 0) {
+            number_format(flat_evaluate(&tree, &symbol_table), buffer);
+            fputs(buffer, stdout);
+        }
+        putchar('\n');
+    }
+
+    symbol_table_free(&symbol_table);
+    flat_file_close(&file);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char **argv) {
-    if (argc > 2) {
-        fprintf(stderr, "Usage: %s [EXPRESSION]\n", argv[0]);
+    const char *mode = (argc > 1) ? argv[1] : "";
+    bool streaming = strcmp(mode, "--stream") == 0 && argc <= 3;
+    bool parallel_file = strcmp(mode, "--parallel") == 0 && argc == 3;
+    bool compiling = strcmp(mode, "--compile") == 0 && argc == 4;
+    bool loading = strcmp(mode, "--load") == 0 && argc == 3;
+
+    if (argc > 2 && !streaming && !parallel_file && !compiling && !loading) {
+        fprintf(stderr, "Usage: %s [EXPRESSION | --stream [FILE] | --parallel FILE | --compile FILE OUTPUT | --load FILE]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
+    if (streaming) return stream(argc == 3 ? argv[2] : NULL);
+    if (parallel_file) return parallel(argv[2]);
+    if (compiling) return compile(argv[2], argv[3]);
+    if (loading) return load(argv[2]);
+
     Parser parser = parser_init();
     SymbolTable symbol_table = symbol_table_init();
 
     if (argc == 2) {
         if (strlen(argv[1]) == 0) return EXIT_SUCCESS;
 
-        parse(&parser, argv[1], false, &symbol_table);
+        parse(&parser, argv[1], false, false, &symbol_table);
         symbol_table_free(&symbol_table);
         parser_free(&parser);
 
@@ -51,6 +228,7 @@ int main(int argc, char **argv) {
 
     char line[LINE_SIZE];
     bool show_tree = false;
+    bool show_code = false;
     printf("Initializing REPL (type '.help' to see available commands)\n");
 
     while (1) {
@@ -65,16 +243,37 @@ int main(int argc, char **argv) {
             printf("AST printing: %s\n", show_tree ? "ON" : "OFF");
             continue;
         }
+        if (strcmp(line, ".code") == 0) {
+            show_code = !show_code;
+            printf("Bytecode printing: %s\n", show_code ? "ON" : "OFF");
+            continue;
+        }
         if (strcmp(line, ".list") == 0) {
             symbol_table_print(&symbol_table);
             continue;
         }
+        if (strncmp(line, ".derive ", 8) == 0) {
+            derivative(&parser, line + 8, &symbol_table);
+            arena_clear(parser.arena);
+            continue;
+        }
+        if (strcmp(line, ".stats") == 0) {
+            if (!stats_enabled()) {
+                fprintf(stderr, "Error: Built without MATHPARSER_STATS (use 'make STATS=1')\n");
+                continue;
+            }
+
+            Stats stats = stats_snapshot();
+            stats_print(stdout, &stats);
+            stats_reset();
+            continue;
+        }
         if (strcmp(line, ".help") == 0) {
             help();
             continue;
         }
 
-        parse(&parser, line, show_tree, &symbol_table);
+        parse(&parser, line, show_tree, show_code, &symbol_table);
         arena_clear(parser.arena);
     }
 
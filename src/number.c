@@ -0,0 +1,329 @@
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+#define NUMBER_BUFSIZE 64
+#define NUMBER_MAX_DIGITS 19    // Any 19 decimal digits fit in a uint64_t
+#define NUMBER_MAX_EXACT (1ull << 53)
+
+// Powers of ten that are exact in a double
+static const double exact_powers[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define NUMBER_MAX_EXACT_POWER 22
+
+// strtod needs a terminated string, so the span is copied first
+static double parse_slow(const char *start, int length) {
+    char stack_buffer[NUMBER_BUFSIZE];
+    char *buffer = stack_buffer;
+
+    if (length >= NUMBER_BUFSIZE) {
+        buffer = malloc((size_t)length + 1);
+        if (buffer == NULL) {
+            fprintf(stderr, "Error: Unable to allocate number\n");
+            return NAN;
+        }
+    }
+
+    memcpy(buffer, start, length);
+    buffer[length] = '\0';
+    double value = strtod(buffer, NULL);
+
+    if (buffer != stack_buffer) free(buffer);
+    return value;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    return (tolower((unsigned char)c) - 'a') + 10;
+}
+
+static int parse_exponent(const char *cursor, const char *end) {
+    bool negative = false;
+    if (cursor < end && (*cursor == '+' || *cursor == '-')) negative = *cursor++ == '-';
+
+    // Saturate, far beyond where every result is zero or infinite
+    int exponent = 0;
+    for (; cursor < end; cursor++) {
+        if (exponent < 100000) exponent = exponent * 10 + (*cursor - '0');
+    }
+
+    return negative ? -exponent : exponent;
+}
+
+// Exact when the significant digits fit in 53 bits, since scaling by a power
+// of two only changes the exponent
+static double parse_hex(const char *start, int length) {
+    const char *cursor = start + 2, *end = start + length;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool fraction = false;
+
+    for (; cursor < end && *cursor != 'p' && *cursor != 'P'; cursor++) {
+        if (*cursor == '.') {
+            fraction = true;
+            continue;
+        }
+
+        if (mantissa == 0 && *cursor == '0') {
+            if (fraction) exponent -= 4;
+            continue;
+        }
+
+        if (++digits > 13) return parse_slow(start, length);
+        mantissa = mantissa * 16 + hex_digit(*cursor);
+        if (fraction) exponent -= 4;
+    }
+
+    if (cursor < end) exponent += parse_exponent(cursor + 1, end);
+    return ldexp((double)mantissa, exponent);
+}
+
+// Clinger's fast path: when the decimal significand and the power of ten are
+// both exact doubles, one correctly rounded multiply or divide gives the
+// correctly rounded result. Anything else goes through strtod.
+double number_parse(const char *start, int length) {
+    if (length > 2 && start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) return parse_hex(start, length);
+
+#if FLT_EVAL_METHOD != 0
+    // Extended precision intermediates would round twice
+    return parse_slow(start, length);
+#else
+    const char *cursor = start, *end = start + length;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool fraction = false;
+
+    for (; cursor < end && *cursor != 'e' && *cursor != 'E'; cursor++) {
+        if (*cursor == '.') {
+            fraction = true;
+            continue;
+        }
+
+        if (mantissa == 0 && *cursor == '0') {
+            if (fraction) exponent--;
+            continue;
+        }
+
+        if (++digits > NUMBER_MAX_DIGITS) return parse_slow(start, length);
+        mantissa = mantissa * 10 + (uint64_t)(*cursor - '0');
+        if (fraction) exponent--;
+    }
+
+    if (cursor < end) exponent += parse_exponent(cursor + 1, end);
+
+    if (mantissa == 0) return 0.0;
+    if (mantissa > NUMBER_MAX_EXACT) return parse_slow(start, length);
+
+    if (exponent < 0) {
+        if (exponent < -NUMBER_MAX_EXACT_POWER) return parse_slow(start, length);
+        return (double)mantissa / exact_powers[-exponent];
+    }
+
+    // Move surplus powers of ten into the significand while it stays exact
+    while (exponent > NUMBER_MAX_EXACT_POWER) {
+        if (mantissa > NUMBER_MAX_EXACT / 10) return parse_slow(start, length);
+        mantissa *= 10;
+        exponent--;
+    }
+
+    return (double)mantissa * exact_powers[exponent];
+#endif
+}
+
+#if LDBL_MANT_DIG >= 64
+#define NUMBER_EXTENDED_FORMAT
+#endif
+
+#ifdef NUMBER_EXTENDED_FORMAT
+#define NUMBER_MAX_EXTENDED_POWER 27
+
+// Powers of ten that are exact in an extended double
+static const long double extended_powers[] = {
+    1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+    1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+    1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L,
+};
+
+static long double scale(long double value, int power) {
+    return (power >= 0) ? value * extended_powers[power] : value / extended_powers[-power];
+}
+
+// Finds the shortest digits with 64-bit precision arithmetic. The value is
+// scaled to 17 integer digits, and the rounding interval of the double, in
+// which every decimal converts back to it, is scaled alike. The fewer digits
+// are kept, the coarser the grid of candidates, so the shortest is found by
+// a binary search over the number of digits dropped. Returns false when the
+// value is out of range, or when a candidate lies too close to the edge of
+// the interval for the rounding errors to decide.
+static bool shortest_extended(double value, uint64_t *digits, int *exponent) {
+    int binary;
+    double fraction = frexp(value, &binary);
+
+    int power = 16 - (int)floor((binary - 1) * 0.30102999566398120);
+    long double scaled = 0;
+
+    for (int tries = 0; tries < 2; tries++) {
+        if (power < -NUMBER_MAX_EXTENDED_POWER || power > NUMBER_MAX_EXTENDED_POWER) return false;
+
+        scaled = scale(value, power);
+        if (scaled >= 1e17L) power--;
+        else if (scaled < 1e16L) power++;
+        else break;
+    }
+
+    if (scaled < 1e16L || scaled >= 1e17L) return false;
+
+    // Half the distance to the neighbouring doubles, which is smaller below
+    // powers of two
+    long double above = scale(ldexpl(1.0L, binary - 54), power);
+    long double below = (fraction == 0.5) ? above / 2 : above;
+    long double margin = scaled * 0x1p-60L;
+
+    int low = 0, high = 16; // Digits dropped: 0 always fits, 17 never does
+    uint64_t best = 0;
+    int best_dropped = -1;
+
+    while (low <= high) {
+        int dropped = (low + high) / 2;
+        long double unit = extended_powers[dropped];
+        long double candidate = (long double)(uint64_t)(scaled / unit + 0.5L);
+        long double distance = candidate * unit - scaled;
+        long double limit = (distance >= 0) ? above : below;
+
+        if (fabsl(fabsl(distance) - limit) <= margin) return false;
+
+        if (fabsl(distance) < limit) {
+            best = (uint64_t)candidate;
+            best_dropped = dropped;
+            low = dropped + 1;
+        } else {
+            high = dropped - 1;
+        }
+    }
+
+    if (best_dropped < 0) return false;
+
+    *digits = best;
+    *exponent = best_dropped - power;
+    return true;
+}
+#endif
+
+// Tries 15, 16 and 17 significant digits through printf, keeping the first
+// that converts back exactly. Any decimal with 15 digits or fewer that does is
+// what rounding to 15 digits gives, so trailing zeros are the only excess.
+// Subnormals have fewer bits, so every precision is tried for them.
+static void shortest_printf(double value, uint64_t *digits, int *exponent) {
+    char buffer[NUMBER_BUFSIZE];
+
+    for (int precision = (value < DBL_MIN) ? 1 : 15; precision <= 17; precision++) {
+        snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+        if (precision == 17 || strtod(buffer, NULL) == value) break;
+    }
+
+    uint64_t significand = 0;
+    int count = 0;
+    char *cursor = buffer;
+
+    for (; *cursor != 'e'; cursor++) {
+        if (*cursor == '.') continue;
+        significand = significand * 10 + (uint64_t)(*cursor - '0');
+        count++;
+    }
+
+    *digits = significand;
+    *exponent = atoi(cursor + 1) - (count - 1);
+}
+
+static int write_digits(char *buffer, uint64_t digits) {
+    char reversed[20];
+    int count = 0;
+
+    do {
+        reversed[count++] = (char)('0' + digits % 10);
+        digits /= 10;
+    } while (digits > 0);
+
+    for (int i = 0; i < count; i++) buffer[i] = reversed[count - 1 - i];
+    return count;
+}
+
+int number_format(double value, char *buffer) {
+    if (isnan(value)) return sprintf(buffer, "nan");
+    if (isinf(value)) return sprintf(buffer, value < 0 ? "-inf" : "inf");
+
+    char *cursor = buffer;
+    if (signbit(value)) {
+        *cursor++ = '-';
+        value = -value;
+    }
+
+    if (value == 0.0) {
+        *cursor++ = '0';
+        *cursor = '\0';
+        return (int)(cursor - buffer);
+    }
+
+    // value = digits * 10^exponent
+    uint64_t digits;
+    int exponent;
+
+#ifdef NUMBER_EXTENDED_FORMAT
+    if (!shortest_extended(value, &digits, &exponent))
+#endif
+        shortest_printf(value, &digits, &exponent);
+
+    while (digits % 10 == 0) {
+        digits /= 10;
+        exponent++;
+    }
+
+    char text[20];
+    int count = write_digits(text, digits);
+    int point = count + exponent; // Position of the decimal point within the digits
+
+    if (point > 21 || point < -6) {
+        // Scientific notation: d.ddde+x
+        *cursor++ = text[0];
+        if (count > 1) {
+            *cursor++ = '.';
+            memcpy(cursor, text + 1, count - 1);
+            cursor += count - 1;
+        }
+        cursor += sprintf(cursor, "e%+d", point - 1);
+        return (int)(cursor - buffer);
+    }
+
+    if (point <= 0) {
+        *cursor++ = '0';
+        *cursor++ = '.';
+        memset(cursor, '0', -point);
+        cursor += -point;
+        memcpy(cursor, text, count);
+        cursor += count;
+    } else if (point >= count) {
+        memcpy(cursor, text, count);
+        cursor += count;
+        memset(cursor, '0', point - count);
+        cursor += point - count;
+    } else {
+        memcpy(cursor, text, point);
+        cursor += point;
+        *cursor++ = '.';
+        memcpy(cursor, text + point, count - point);
+        cursor += count - point;
+    }
+
+    *cursor = '\0';
+    return (int)(cursor - buffer);
+}
@@ -0,0 +1,501 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "environment.h"
+#include "optimizer.h"
+#include "pointer_map.h"
+
+#define SHARE_INITIAL_CAPACITY 256
+
+typedef struct {
+    Node **nodes; // Canonical nodes by structure, NULL when empty
+    uint64_t *hashes;
+    int count;
+    int capacity; // Power of two
+
+    PointerMap visited;     // Node -> canonical node, low bit set when tainted
+    IdentifierData **targets; // Assignment targets in the trees
+    int target_count;
+    int merged;
+    bool failed;
+} Sharer;
+
+static int count_nodes(Node *node) {
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_IDENTIFIER: return 1;
+        case NODE_UNARY:      return 1 + count_nodes(node->as.unary.right);
+        case NODE_BINARY:     return 1 + count_nodes(node->as.binary.left) + count_nodes(node->as.binary.right);
+        case NODE_CALL: {
+            int count = 1 + count_nodes(node->as.call.function);
+            for (int i = 0; i < node->as.call.argument_count; i++) count += count_nodes(node->as.call.arguments[i]);
+            return count;
+        }
+    }
+
+    return 0;
+}
+
+// Whether a subtree can be dropped without losing an assignment or an error report
+static bool is_removable(Node *node) {
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_IDENTIFIER:
+            return true;
+        case NODE_UNARY:
+            return is_removable(node->as.unary.right);
+        case NODE_BINARY:
+            if (node->as.binary.op.type == TOK_EQUAL || node->as.binary.op.type == TOK_SLASH) return false;
+            return is_removable(node->as.binary.left) && is_removable(node->as.binary.right);
+        case NODE_CALL:
+            if (!(node->as.call.builtin->flags & BUILTIN_PURE)) return false;
+            for (int i = 0; i < node->as.call.argument_count; i++) {
+                if (!is_removable(node->as.call.arguments[i])) return false;
+            }
+            return true;
+    }
+
+    return false;
+}
+
+static bool is_same(Node *a, Node *b) {
+    if (a->type != b->type) return false;
+
+    switch (a->type) {
+        case NODE_NUMBER:
+            return memcmp(&a->as.number, &b->as.number, sizeof(double)) == 0;
+        case NODE_IDENTIFIER:
+            return a->as.identifier.length == b->as.identifier.length &&
+                   strncmp(a->as.identifier.name, b->as.identifier.name, a->as.identifier.length) == 0;
+        case NODE_UNARY:
+            return a->as.unary.op.type == b->as.unary.op.type && is_same(a->as.unary.right, b->as.unary.right);
+        case NODE_BINARY:
+            return a->as.binary.op.type == b->as.binary.op.type &&
+                   is_same(a->as.binary.left, b->as.binary.left) && is_same(a->as.binary.right, b->as.binary.right);
+        case NODE_CALL:
+            if (a->as.call.builtin != b->as.call.builtin || !(a->as.call.builtin->flags & BUILTIN_PURE)) return false;
+            for (int i = 0; i < a->as.call.argument_count; i++) {
+                if (!is_same(a->as.call.arguments[i], b->as.call.arguments[i])) return false;
+            }
+            return true;
+    }
+
+    return false;
+}
+
+static bool is_number(Node *node, double value) {
+    return node->type == NODE_NUMBER && node->as.number == value;
+}
+
+static int replace_with_child(Node *node, Node *child) {
+    int removed = count_nodes(node) - count_nodes(child);
+    *node = *child;
+    return removed;
+}
+
+static int replace_with_number(Node *node, double value) {
+    int removed = count_nodes(node) - 1;
+    node->type = NODE_NUMBER;
+    node->as.number = value;
+    return removed;
+}
+
+// Lowers x^2, and x^3 and x^4 with OPTIMIZE_FAST_MATH, to multiplications.
+// The exponent's node becomes x*x, shared by both factors. Only identifiers are
+// lowered, since tree walkers evaluate a shared subtree once per use.
+static int lower_power(Node *node, bool fast) {
+    static const Token star = {TOK_STAR, 1, "*"};
+    Node *base = node->as.binary.left;
+    Node *exponent = node->as.binary.right;
+    if (base->type != NODE_IDENTIFIER || exponent->type != NODE_NUMBER) return 0;
+
+    double power = exponent->as.number;
+    if (power == 2.0) {
+        // Same as custom_pow, which squares with a multiplication too
+        node->as.binary = (BinaryData){star, base, base};
+        return 1;
+    }
+
+    if (!fast || (power != 3.0 && power != 4.0)) return 0;
+
+    exponent->type = NODE_BINARY;
+    exponent->as.binary = (BinaryData){star, base, base};
+    node->as.binary = (BinaryData){star, exponent, (power == 3.0) ? base : exponent};
+    return 0;
+}
+
+static int fold_unary(Node *node) {
+    Node *right = node->as.unary.right;
+
+    if (right->type == NODE_NUMBER) return replace_with_number(node, env_evaluate(node, NULL));
+
+    // +x -> x
+    if (node->as.unary.op.type == TOK_PLUS) return replace_with_child(node, right);
+
+    // -(-x) -> x
+    if (node->as.unary.op.type == TOK_MINUS && right->type == NODE_UNARY && right->as.unary.op.type == TOK_MINUS)
+        return replace_with_child(node, right->as.unary.right);
+
+    return 0;
+}
+
+static int fold_binary(Node *node, unsigned flags) {
+    Node *left = node->as.binary.left;
+    Node *right = node->as.binary.right;
+    TokenType op = node->as.binary.op.type;
+    bool fast = flags & OPTIMIZE_FAST_MATH;
+
+    if (left->type == NODE_NUMBER && right->type == NODE_NUMBER) {
+        // Leave division by zero to report its error at evaluation time
+        if (op == TOK_SLASH && right->as.number == 0.0) return 0;
+        return replace_with_number(node, env_evaluate(node, NULL));
+    }
+
+    switch (op) {
+        case TOK_STAR:
+            if (is_number(right, 1.0)) return replace_with_child(node, left);
+            if (is_number(left, 1.0)) return replace_with_child(node, right);
+            if (fast && (is_number(left, 0.0) || is_number(right, 0.0)) && is_removable(node))
+                return replace_with_number(node, 0.0);
+            break;
+
+        case TOK_SLASH:
+            if (is_number(right, 1.0)) return replace_with_child(node, left);
+            if (fast && is_same(left, right) && is_removable(left)) return replace_with_number(node, 1.0);
+            break;
+
+        case TOK_MINUS:
+            // x - (+0) keeps the sign of a negative zero, x + 0 does not
+            if (is_number(right, 0.0) && !signbit(right->as.number)) return replace_with_child(node, left);
+            if (fast && is_same(left, right) && is_removable(left)) return replace_with_number(node, 0.0);
+            break;
+
+        case TOK_PLUS:
+            if (fast && is_number(right, 0.0)) return replace_with_child(node, left);
+            if (fast && is_number(left, 0.0)) return replace_with_child(node, right);
+            break;
+
+        case TOK_CARET:
+            // custom_pow(x, 0) is 1 for every x, including NaN and zero
+            if (is_number(right, 0.0) && is_removable(left)) return replace_with_number(node, 1.0);
+            if (fast && is_number(right, 1.0)) return replace_with_child(node, left);
+            return lower_power(node, fast);
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+// Folds constant subtrees into numbers and applies identities that hold for
+// every IEEE input (more with OPTIMIZE_FAST_MATH). The tree is rewritten in
+// place and the number of nodes removed is returned. Constant subtrees are
+// evaluated with env_evaluate, so folding never changes a result.
+int optimizer_fold(Node *node, unsigned flags) {
+    switch (node->type) {
+        case NODE_NUMBER:
+            return 0;
+
+        case NODE_IDENTIFIER: {
+            // Assignment to builtin constants is rejected by the parser
+            const Builtin *builtin = builtin_lookup(node->as.identifier.name, node->as.identifier.length);
+            if (builtin == NULL || builtin->arity >= 0) return 0;
+
+            return replace_with_number(node, builtin->value);
+        }
+
+        case NODE_UNARY: {
+            int removed = optimizer_fold(node->as.unary.right, flags);
+            return removed + fold_unary(node);
+        }
+
+        case NODE_BINARY: {
+            if (node->as.binary.op.type == TOK_EQUAL) return optimizer_fold(node->as.binary.right, flags);
+
+            int removed = optimizer_fold(node->as.binary.left, flags);
+            removed += optimizer_fold(node->as.binary.right, flags);
+            return removed + fold_binary(node, flags);
+        }
+
+        case NODE_CALL: {
+            int removed = 0;
+            bool constant = node->as.call.builtin->flags & BUILTIN_PURE;
+
+            for (int i = 0; i < node->as.call.argument_count; i++) {
+                removed += optimizer_fold(node->as.call.arguments[i], flags);
+                constant = constant && node->as.call.arguments[i]->type == NODE_NUMBER;
+            }
+
+            if (!constant) return removed;
+            return removed + replace_with_number(node, env_evaluate(node, NULL));
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t mix(uint64_t hash, uint64_t value) {
+    hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+static uint64_t hash_name(const char *name, int length) {
+    uint64_t hash = 1469598103934665603ull;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static bool same_name(IdentifierData *a, IdentifierData *b) {
+    return a->length == b->length && strncmp(a->name, b->name, a->length) == 0;
+}
+
+// Hash and equality only look one level deep: children are already canonical,
+// so structurally equal subtrees are pointer-equal
+static uint64_t hash_shallow(Node *node) {
+    uint64_t hash = mix(0, node->type);
+
+    switch (node->type) {
+        case NODE_NUMBER: {
+            uint64_t bits;
+            memcpy(&bits, &node->as.number, sizeof(bits));
+            return mix(hash, bits);
+        }
+        case NODE_IDENTIFIER:
+            return mix(hash, hash_name(node->as.identifier.name, node->as.identifier.length));
+        case NODE_UNARY:
+            hash = mix(hash, node->as.unary.op.type);
+            return mix(hash, (uintptr_t)node->as.unary.right);
+        case NODE_BINARY:
+            hash = mix(hash, node->as.binary.op.type);
+            hash = mix(hash, (uintptr_t)node->as.binary.left);
+            return mix(hash, (uintptr_t)node->as.binary.right);
+        case NODE_CALL:
+            hash = mix(hash, (uintptr_t)node->as.call.builtin);
+            for (int i = 0; i < node->as.call.argument_count; i++) hash = mix(hash, (uintptr_t)node->as.call.arguments[i]);
+            return hash;
+    }
+
+    return hash;
+}
+
+static bool equal_shallow(Node *a, Node *b) {
+    if (a->type != b->type) return false;
+
+    switch (a->type) {
+        case NODE_NUMBER:
+            return memcmp(&a->as.number, &b->as.number, sizeof(double)) == 0;
+        case NODE_IDENTIFIER:
+            return same_name(&a->as.identifier, &b->as.identifier);
+        case NODE_UNARY:
+            return a->as.unary.op.type == b->as.unary.op.type && a->as.unary.right == b->as.unary.right;
+        case NODE_BINARY:
+            return a->as.binary.op.type == b->as.binary.op.type &&
+                   a->as.binary.left == b->as.binary.left && a->as.binary.right == b->as.binary.right;
+        case NODE_CALL:
+            if (a->as.call.builtin != b->as.call.builtin) return false;
+            for (int i = 0; i < a->as.call.argument_count; i++) {
+                if (a->as.call.arguments[i] != b->as.call.arguments[i]) return false;
+            }
+            return true;
+    }
+
+    return false;
+}
+
+static bool grow_sharer(Sharer *sharer) {
+    int capacity = sharer->capacity ? sharer->capacity * 2 : SHARE_INITIAL_CAPACITY;
+    Node **nodes = calloc(capacity, sizeof(Node *));
+    uint64_t *hashes = malloc(sizeof(uint64_t) * capacity);
+
+    if (nodes == NULL || hashes == NULL) {
+        free(nodes);
+        free(hashes);
+        return false;
+    }
+
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (int i = 0; i < sharer->capacity; i++) {
+        if (sharer->nodes[i] == NULL) continue;
+
+        uint32_t position = (uint32_t)sharer->hashes[i] & mask;
+        while (nodes[position] != NULL) position = (position + 1) & mask;
+        nodes[position] = sharer->nodes[i];
+        hashes[position] = sharer->hashes[i];
+    }
+
+    free(sharer->nodes);
+    free(sharer->hashes);
+    sharer->nodes = nodes;
+    sharer->hashes = hashes;
+    sharer->capacity = capacity;
+    return true;
+}
+
+// Returns the canonical node structurally equal to 'node', registering it when new
+static Node *intern(Sharer *sharer, Node *node) {
+    if ((sharer->count + 1) * 2 > sharer->capacity && !grow_sharer(sharer)) {
+        sharer->failed = true;
+        return node;
+    }
+
+    uint64_t hash = hash_shallow(node);
+    uint32_t mask = (uint32_t)sharer->capacity - 1;
+    uint32_t position = (uint32_t)hash & mask;
+
+    for (; sharer->nodes[position] != NULL; position = (position + 1) & mask) {
+        if (sharer->hashes[position] == hash && equal_shallow(sharer->nodes[position], node))
+            return sharer->nodes[position];
+    }
+
+    sharer->nodes[position] = node;
+    sharer->hashes[position] = hash;
+    sharer->count++;
+    return node;
+}
+
+static void collect_targets(Sharer *sharer, Node *node) {
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_IDENTIFIER:
+            return;
+        case NODE_UNARY:
+            collect_targets(sharer, node->as.unary.right);
+            return;
+        case NODE_BINARY:
+            if (node->as.binary.op.type == TOK_EQUAL) {
+                IdentifierData **targets = realloc(sharer->targets, sizeof(IdentifierData *) * (sharer->target_count + 1));
+                if (targets == NULL) {
+                    sharer->failed = true;
+                    return;
+                }
+
+                sharer->targets = targets;
+                sharer->targets[sharer->target_count++] = &node->as.binary.left->as.identifier;
+            } else {
+                collect_targets(sharer, node->as.binary.left);
+            }
+            collect_targets(sharer, node->as.binary.right);
+            return;
+        case NODE_CALL:
+            for (int i = 0; i < node->as.call.argument_count; i++) collect_targets(sharer, node->as.call.arguments[i]);
+            return;
+    }
+}
+
+// A tainted subtree assigns, or reads a variable assigned somewhere in the
+// trees, so two occurrences may see different values and must stay separate
+static Node *share(Sharer *sharer, Node *node, bool *tainted) {
+    int64_t visited;
+    if (pointer_map_get(&sharer->visited, node, &visited)) {
+        *tainted = visited & 1;
+        return (Node *)(intptr_t)(visited & ~(int64_t)1);
+    }
+
+    bool left = false, right = false;
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            break;
+
+        case NODE_IDENTIFIER:
+            for (int i = 0; i < sharer->target_count && !left; i++)
+                left = same_name(&node->as.identifier, sharer->targets[i]);
+            break;
+
+        case NODE_UNARY:
+            node->as.unary.right = share(sharer, node->as.unary.right, &left);
+            break;
+
+        case NODE_BINARY:
+            if (node->as.binary.op.type == TOK_EQUAL) left = true;
+            else node->as.binary.left = share(sharer, node->as.binary.left, &left);
+
+            node->as.binary.right = share(sharer, node->as.binary.right, &right);
+            break;
+
+        case NODE_CALL:
+            // Impure calls may return something else every time, so they are never merged
+            left = !(node->as.call.builtin->flags & BUILTIN_PURE);
+            for (int i = 0; i < node->as.call.argument_count; i++) {
+                node->as.call.arguments[i] = share(sharer, node->as.call.arguments[i], &right);
+                left = left || right;
+            }
+            right = false;
+            break;
+    }
+
+    *tainted = left || right;
+    Node *canonical = *tainted ? node : intern(sharer, node);
+    if (canonical != node) sharer->merged++;
+
+    if (!pointer_map_set(&sharer->visited, node, (int64_t)(intptr_t)canonical | *tainted)) sharer->failed = true;
+    return canonical;
+}
+
+// Hash-conses the trees into one DAG in which structurally identical subtrees
+// are a single node. Roots are replaced by their canonical node, and the number
+// of merged occurrences is returned, or -1 if memory ran out (the trees are then
+// still valid, just partially shared). Subtrees touching assigned variables are
+// never merged, since their value can change during one evaluation.
+int optimizer_share(Node **roots, int root_count) {
+    Sharer sharer = {0};
+    sharer.visited = pointer_map_init();
+
+    for (int i = 0; i < root_count; i++) collect_targets(&sharer, roots[i]);
+
+    for (int i = 0; i < root_count && !sharer.failed; i++) {
+        bool tainted;
+        roots[i] = share(&sharer, roots[i], &tainted);
+    }
+
+    free(sharer.nodes);
+    free(sharer.hashes);
+    free(sharer.targets);
+    pointer_map_free(&sharer.visited);
+
+    return sharer.failed ? -1 : sharer.merged;
+}
+
+static long count_total(Node *node, PointerMap *totals, long *unique) {
+    int64_t total = 0;
+    if (pointer_map_get(totals, node, &total)) return (long)total;
+
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_IDENTIFIER:
+            total = 1;
+            break;
+        case NODE_UNARY:
+            total = 1 + count_total(node->as.unary.right, totals, unique);
+            break;
+        case NODE_BINARY:
+            total = 1 + count_total(node->as.binary.left, totals, unique) + count_total(node->as.binary.right, totals, unique);
+            break;
+        case NODE_CALL:
+            total = 1 + count_total(node->as.call.function, totals, unique);
+            for (int i = 0; i < node->as.call.argument_count; i++)
+                total += count_total(node->as.call.arguments[i], totals, unique);
+            break;
+    }
+
+    (*unique)++;
+    pointer_map_set(totals, node, total);
+    return (long)total;
+}
+
+NodeCount optimizer_count(Node *root) {
+    NodeCount count = {0, 0};
+    PointerMap totals = pointer_map_init();
+
+    count.total = count_total(root, &totals, &count.unique);
+
+    pointer_map_free(&totals);
+    return count;
+}
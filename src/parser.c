@@ -4,10 +4,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "number.h"
 #include "parser.h"
+#include "stats.h"
 
 #define PARSER_ARENA_CAPACITY (1024 * 2)
-#define NUMBER_BUFSIZE 100
 
 static Node *make_node(Parser *parser, NodeType type) {
     Node *node = arena_alloc(parser->arena, sizeof(Node));
@@ -17,6 +18,7 @@ static Node *make_node(Parser *parser, NodeType type) {
     }
 
     node->type = type;
+    STATS_ADD(nodes, 1);
     return node;
 }
 
@@ -27,55 +29,38 @@ static Token peek(Parser *parser) {
     return parser->current;
 }
 
+static Token next_token(Parser *parser) {
+    if (parser->tokens == NULL) return lexer_next(&parser->lexer);
+
+    // Like the lexer, return EOF indefinitely
+    return (parser->tokens->type == TOK_EOF) ? *parser->tokens : *parser->tokens++;
+}
+
 static Token consume(Parser *parser) {
     Token current = parser->current;
     parser->previous = current;
-    parser->current = lexer_next(&parser->lexer);
+    parser->current = next_token(parser);
 
     return current;
 }
 
-static bool is_constant(Node *node) {
-    const char *constants[] = {
-        "e", "pi"
-    };
-
-    for (size_t i = 0; i < sizeof(constants) / sizeof(constants[0]); i++) {
-        if (strlen(constants[i]) == (size_t)node->as.identifier.length &&
-            strncmp(constants[i], node->as.identifier.name, node->as.identifier.length) == 0)
-            return true;
-    }
-
-    return false;
+static const Builtin *builtin(Node *node) {
+    return builtin_lookup(node->as.identifier.name, node->as.identifier.length);
 }
 
 static bool is_function(Node *node) {
-    const char *functions[] = {
-        "sin", "cos", "tan", "arcsin", "arccos", "arctan",
-        "sinh", "cosh", "tanh", "arcsinh", "arccosh", "arctanh",
-        "abs", "sqrt", "ln", "log", "exp"
-    };
-
-    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
-        if (strlen(functions[i]) == (size_t)node->as.identifier.length &&
-            strncmp(functions[i], node->as.identifier.name, node->as.identifier.length) == 0)
-            return true;
-    }
-
-    return false;
+    const Builtin *found = builtin(node);
+    return found != NULL && found->arity >= 0;
 }
 
 static Node *number(Parser *parser, Node *left) {
     (void)left;
     Token token = parser->previous;
 
-    char buffer[NUMBER_BUFSIZE];
-    sprintf(buffer, "%.*s", token.length, token.start);
-
     Node *node = make_node(parser, NODE_NUMBER);
     if (node == NULL) return NULL;
 
-    node->as.number = strtod(buffer, NULL);
+    node->as.number = number_parse(token.start, token.length);
     return node;
 }
 
@@ -89,6 +74,7 @@ static Node *identifier(Parser *parser, Node *left) {
     node->as.identifier = (IdentifierData){
         .name = token.start,
         .length = token.length,
+        .slot = -1,
     };
 
     if (is_function(node) && peek(parser).type != TOK_LPAREN) {
@@ -161,7 +147,7 @@ static Node *assignment(Parser *parser, Node *left) {
         return NULL;
     }
 
-    if (is_function(left) || is_constant(left)) {
+    if (builtin(left) != NULL) {
         fprintf(stderr, "Error: Cannot assign to reserved keyword '%.*s'\n",
                 left->as.identifier.length, left->as.identifier.name);
         return NULL;
@@ -209,23 +195,57 @@ static Node *call(Parser *parser, Node *left) {
         return NULL;
     }
 
-    if (!is_function(left)) {
+    const Builtin *function = builtin(left);
+    if (function == NULL || function->arity < 0) {
         fprintf(stderr, "Error: Non-function '%.*s' called\n",
                 left->as.identifier.length, left->as.identifier.name);
         return NULL;
     }
 
+    Node *arguments[BUILTIN_MAX_ARGUMENTS];
+    int count = 0;
+
+    while (peek(parser).type != TOK_RPAREN) {
+        if ((count > 0 && consume(parser).type != TOK_COMMA) || peek(parser).type == TOK_EOF) {
+            fprintf(stderr, "Error: Expected token ')'\n");
+            return NULL;
+        }
+
+        if (count == function->arity) {
+            fprintf(stderr, "Error: Too many arguments in call to '%.*s', expected %d\n",
+                    left->as.identifier.length, left->as.identifier.name, function->arity);
+            return NULL;
+        }
+
+        arguments[count] = expression(parser, BP_NONE);
+        if (arguments[count++] == NULL) {
+            fprintf(stderr, "Error: Expected argument in function call\n");
+            return NULL;
+        }
+    }
+
+    consume(parser);
+
+    if (count != function->arity) {
+        fprintf(stderr, "Error: Too few arguments in call to '%.*s', expected %d\n",
+                left->as.identifier.length, left->as.identifier.name, function->arity);
+        return NULL;
+    }
+
     Node *node = make_node(parser, NODE_CALL);
     if (node == NULL) return NULL;
 
     node->as.call.function = left;
-    node->as.call.argument = grouping(parser, left);
+    node->as.call.builtin = function;
+    node->as.call.argument_count = count;
+    node->as.call.arguments = arena_alloc(parser->arena, sizeof(Node *) * (count ? count : 1));
 
-    if (node->as.call.argument == NULL) {
-        fprintf(stderr, "Error: Expected argument in function call\n");
+    if (node->as.call.arguments == NULL) {
+        fprintf(stderr, "Error: Unable to allocate node\n");
         return NULL;
     }
 
+    memcpy(node->as.call.arguments, arguments, sizeof(Node *) * count);
     return node;
 }
 
@@ -241,6 +261,8 @@ ParseRule rules[] = {
     [TOK_BANG]       = {NULL,       postfix,    BP_POSTFIX},
     [TOK_LPAREN]     = {grouping,   call,       BP_CALL},
     [TOK_RPAREN]     = {NULL,       NULL,       BP_NONE},
+    [TOK_COMMA]      = {NULL,       NULL,       BP_NONE},
+    [TOK_NEWLINE]    = {NULL,       NULL,       BP_NONE},
     [TOK_ERROR]      = {NULL,       NULL,       BP_NONE},
     [TOK_EOF]        = {NULL,       NULL,       BP_NONE},
 };
@@ -258,7 +280,7 @@ static Node *expression(Parser *parser, BindingPower right_bp) {
     Token first_token = consume(parser);
     ParseRule *first_rule = get_rule(first_token);
     if (first_rule == NULL || first_rule->prefix == NULL) {
-        if (first_token.length > 0) // Don't report unexpected EOF
+        if (first_token.type != TOK_EOF && first_token.type != TOK_NEWLINE) // Don't report unexpected end of input
             fprintf(stderr, "Error: Unexpected token '%.*s'\n", first_token.length, first_token.start);
 
         return NULL;
@@ -306,8 +328,10 @@ void node_print(Node *node) {
         case NODE_CALL:
             printf("(");
             node_print(node->as.call.function);
-            printf(" ");
-            node_print(node->as.call.argument);
+            for (int i = 0; i < node->as.call.argument_count; i++) {
+                printf(" ");
+                node_print(node->as.call.arguments[i]);
+            }
             printf(")");
             break;
     }
@@ -317,6 +341,7 @@ Parser parser_init() {
     Lexer lexer = {0};
     Parser parser;
     parser.lexer = lexer;
+    parser.tokens = NULL;
     parser.arena = arena_init(PARSER_ARENA_CAPACITY);
 
     if (parser.arena == NULL) {
@@ -331,15 +356,69 @@ void parser_free(Parser *parser) {
     arena_free(parser->arena);
 }
 
+static Node *parse_lexer(Parser *parser) {
+    parser->tokens = NULL;
+    parser->current = next_token(parser);
+
+    // Roll back the nodes of a failed parse, keeping earlier trees intact
+    ArenaMark mark = arena_save(parser->arena);
+
+    Node *root = expression(parser, BP_NONE);
+    if (root != NULL && parser->current.type != TOK_EOF) {
+        fprintf(stderr, "Error: Unexpected trailing tokens\n");
+        root = NULL;
+    }
+
+    if (root == NULL) arena_restore(parser->arena, mark);
+    return root;
+}
+
 Node *parser_parse(Parser *parser, const char *expr) {
+    STATS_START(start);
     lexer_reset(&parser->lexer, expr);
-    parser->current = lexer_next(&parser->lexer);
+    Node *root = parse_lexer(parser);
+    STATS_STOP(start, parses, parse_cycles);
+    return root;
+}
+
+// Same as parser_parse for a span that does not need to be terminated
+Node *parser_parse_span(Parser *parser, const char *text, size_t length) {
+    STATS_START(start);
+    lexer_reset_span(&parser->lexer, text, length);
+    Node *root = parse_lexer(parser);
+    STATS_STOP(start, parses, parse_cycles);
+    return root;
+}
+
+// Parses the line of a token list (see lexer_tokenize) starting at *position,
+// then moves *position to the next line, even when the line has errors. Blank
+// lines are skipped, and NULL is returned without an error at the end.
+Node *parser_parse_tokens(Parser *parser, const TokenList *list, size_t *position) {
+    const Token *tokens = list->tokens + *position;
+    while (tokens->type == TOK_NEWLINE) tokens++;
+
+    *position = (size_t)(tokens - list->tokens);
+    if (tokens->type == TOK_EOF) return NULL;
+
+    const Token *end = tokens;
+    while (end->type != TOK_NEWLINE && end->type != TOK_EOF) end++;
+    *position = (size_t)(end - list->tokens) + (end->type == TOK_NEWLINE);
+
+    STATS_START(start);
+    parser->tokens = tokens;
+    parser->current = next_token(parser);
+
+    ArenaMark mark = arena_save(parser->arena);
 
     Node *root = expression(parser, BP_NONE);
-    if (root != NULL && parser->current.type != TOK_EOF) {
+    if (root != NULL && parser->current.type != TOK_NEWLINE && parser->current.type != TOK_EOF) {
         fprintf(stderr, "Error: Unexpected trailing tokens\n");
-        return NULL;
+        root = NULL;
     }
 
+    if (root == NULL) arena_restore(parser->arena, mark);
+
+    parser->tokens = NULL;
+    STATS_STOP(start, parses, parse_cycles);
     return root;
-}
\ No newline at end of file
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pointer_map.h"
+
+#define POINTER_MAP_INITIAL_CAPACITY 64
+
+static uint32_t hash_pointer(const void *key) {
+    uint64_t x = (uint64_t)(uintptr_t)key;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+static int find(const PointerMap *map, const void *key) {
+    uint32_t mask = (uint32_t)map->capacity - 1;
+    uint32_t position = hash_pointer(key) & mask;
+
+    while (map->keys[position] != NULL && map->keys[position] != key) position = (position + 1) & mask;
+    return (int)position;
+}
+
+static bool grow(PointerMap *map) {
+    int capacity = map->capacity ? map->capacity * 2 : POINTER_MAP_INITIAL_CAPACITY;
+    PointerMap grown = {calloc(capacity, sizeof(void *)), malloc(sizeof(int64_t) * capacity), map->count, capacity};
+
+    if (grown.keys == NULL || grown.values == NULL) {
+        free(grown.keys);
+        free(grown.values);
+        fprintf(stderr, "Error: Unable to allocate pointer map\n");
+        return false;
+    }
+
+    for (int i = 0; i < map->capacity; i++) {
+        if (map->keys[i] == NULL) continue;
+
+        int position = find(&grown, map->keys[i]);
+        grown.keys[position] = map->keys[i];
+        grown.values[position] = map->values[i];
+    }
+
+    pointer_map_free(map);
+    *map = grown;
+    return true;
+}
+
+PointerMap pointer_map_init() {
+    PointerMap map = {0};
+    return map;
+}
+
+void pointer_map_free(PointerMap *map) {
+    free(map->keys);
+    free(map->values);
+    *map = pointer_map_init();
+}
+
+bool pointer_map_get(const PointerMap *map, const void *key, int64_t *value) {
+    if (map->count == 0) return false;
+
+    int position = find(map, key);
+    if (map->keys[position] == NULL) return false;
+
+    *value = map->values[position];
+    return true;
+}
+
+bool pointer_map_set(PointerMap *map, const void *key, int64_t value) {
+    // Keep the load factor at or below one half
+    if ((map->count + 1) * 2 > map->capacity && !grow(map)) return false;
+
+    int position = find(map, key);
+    if (map->keys[position] == NULL) {
+        map->keys[position] = key;
+        map->count++;
+    }
+
+    map->values[position] = value;
+    return true;
+}
@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// Range of task indices owned by one worker. The owner takes tasks from the
+// front, thieves split off the back half.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+    Arena *scratch;
+} PoolQueue;
+
+typedef struct {
+    Pool *pool;
+    int worker;
+} PoolWorker;
+
+struct Pool {
+    int thread_count; // Including the calling thread
+    pthread_t *threads;
+    PoolWorker *workers;
+    PoolQueue *queues;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long generation;
+    int active;
+    bool stopping;
+
+    PoolTaskFn fn;
+    void *context;
+};
+
+static bool take(PoolQueue *queue, size_t *task) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->begin < queue->end;
+    if (found) *task = queue->begin++;
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+static bool steal(Pool *pool, int thief) {
+    for (int i = 1; i < pool->thread_count; i++) {
+        PoolQueue *victim = &pool->queues[(thief + i) % pool->thread_count];
+
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->end - victim->begin;
+        size_t end = victim->end;
+        size_t begin = end - (remaining + 1) / 2;
+        if (remaining > 0) victim->end = begin;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (remaining == 0) continue;
+
+        PoolQueue *own = &pool->queues[thief];
+        pthread_mutex_lock(&own->lock);
+        own->begin = begin;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+
+    return false;
+}
+
+static void work(Pool *pool, int worker) {
+    PoolQueue *own = &pool->queues[worker];
+    size_t task;
+
+    while (1) {
+        if (!take(own, &task)) {
+            if (!steal(pool, worker)) break;
+            continue;
+        }
+
+        pool->fn(pool->context, task, worker, own->scratch);
+        arena_reset(own->scratch);
+    }
+}
+
+static void *worker_main(void *argument) {
+    PoolWorker *self = argument;
+    Pool *pool = self->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stopping && pool->generation == seen) pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stopping) break;
+
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        work(pool, self->worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+Pool *pool_init(int thread_count) {
+    if (thread_count <= 0) thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count <= 0) thread_count = 1;
+
+    Pool *pool = calloc(1, sizeof(Pool));
+    if (pool == NULL) return NULL;
+
+    pool->thread_count = thread_count;
+    pool->threads = calloc(thread_count, sizeof(pthread_t));
+    pool->workers = calloc(thread_count, sizeof(PoolWorker));
+    pool->queues = calloc(thread_count, sizeof(PoolQueue));
+
+    if (pool->threads == NULL || pool->workers == NULL || pool->queues == NULL) {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        pool->queues[i].scratch = arena_init(POOL_SCRATCH_CAPACITY);
+        pool->workers[i] = (PoolWorker){pool, i};
+
+        if (pool->queues[i].scratch == NULL) {
+            fprintf(stderr, "Error: Unable to initialize worker arena\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Worker 0 is whichever thread calls pool_run
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, &pool->workers[i]) != 0) {
+            fprintf(stderr, "Error: Unable to start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return pool;
+}
+
+void pool_free(Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->thread_count; i++) pthread_join(pool->threads[i], NULL);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        arena_free(pool->queues[i].scratch);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->queues);
+    free(pool);
+}
+
+int pool_size(const Pool *pool) {
+    return pool->thread_count;
+}
+
+// Splits tasks [0, task_count) evenly across the workers and returns once all
+// of them ran. Idle workers steal half of the remaining range of a busy one.
+void pool_run(Pool *pool, size_t task_count, PoolTaskFn fn, void *context) {
+    for (int i = 0; i < pool->thread_count; i++) {
+        PoolQueue *queue = &pool->queues[i];
+        pthread_mutex_lock(&queue->lock);
+        queue->begin = task_count * i / pool->thread_count;
+        queue->end = task_count * (i + 1) / pool->thread_count;
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->context = context;
+    pool->active = pool->thread_count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    work(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,81 @@
+#include <inttypes.h>
+#include <time.h>
+
+#include "stats.h"
+
+Stats stats_counters;
+
+static const char *node_names[STATS_NODE_TYPES] = {"number", "identifier", "unary", "binary", "call"};
+
+bool stats_enabled() {
+#ifdef MATHPARSER_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Every field is a uint64_t, so the counters are read and written as an array
+#define COUNTER_COUNT (sizeof(Stats) / sizeof(uint64_t))
+
+Stats stats_snapshot() {
+    Stats snapshot;
+    uint64_t *from = (uint64_t *)&stats_counters, *to = (uint64_t *)&snapshot;
+    for (size_t i = 0; i < COUNTER_COUNT; i++) to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    return snapshot;
+}
+
+// Keeps the bytes the arenas hold, which later frees are subtracted from
+void stats_reset() {
+    uint64_t *counters = (uint64_t *)&stats_counters;
+    uint64_t *reserved = &stats_counters.arena_reserved;
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        if (&counters[i] != reserved) __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+    stats_max(&stats_counters.arena_high_water, __atomic_load_n(reserved, __ATOMIC_RELAXED));
+}
+
+void stats_max(uint64_t *counter, uint64_t value) {
+    uint64_t current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > current &&
+           !__atomic_compare_exchange_n(counter, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+uint64_t stats_clock() {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    return __builtin_ia32_rdtsc();
+#else
+    return (uint64_t)clock();
+#endif
+}
+
+static double average(uint64_t total, uint64_t count) {
+    return count ? (double)total / (double)count : 0.0;
+}
+
+void stats_print(FILE *stream, const Stats *stats) {
+    fprintf(stream, "arena: %" PRIu64 " bytes allocated, %" PRIu64 " held, %" PRIu64 " high water, %" PRIu64
+                    " failures\n",
+            stats->arena_bytes, stats->arena_reserved, stats->arena_high_water, stats->arena_failures);
+    fprintf(stream, "parser: %" PRIu64 " tokens, %" PRIu64 " nodes, %" PRIu64 " parses, %.0f cycles per parse\n",
+            stats->tokens, stats->nodes, stats->parses, average(stats->parse_cycles, stats->parses));
+    fprintf(stream, "evaluate: %" PRIu64 " evaluations, %.0f cycles per evaluation, %" PRIu64 " NaN, %" PRIu64
+                    " errors\n",
+            stats->evaluations, average(stats->evaluate_cycles, stats->evaluations), stats->nans, stats->errors);
+
+    fprintf(stream, "visits:");
+    for (int i = 0; i < STATS_NODE_TYPES; i++) fprintf(stream, " %s %" PRIu64, node_names[i], stats->visits[i]);
+    fprintf(stream, "\n");
+
+    fprintf(stream, "lookups: %" PRIu64 ", %.2f probes on average, %" PRIu64 " at most\n", stats->lookups,
+            average(stats->probes, stats->lookups), stats->max_probes);
+
+    fprintf(stream, "calls:");
+    for (uint32_t id = 0; id < BUILTIN_COUNT; id++) {
+        if (stats->calls[id] > 0) fprintf(stream, " %s %" PRIu64, builtins[id].name, stats->calls[id]);
+    }
+    if (stats->calls[BUILTIN_COUNT] > 0) fprintf(stream, " registered %" PRIu64, stats->calls[BUILTIN_COUNT]);
+    fprintf(stream, "\n");
+}
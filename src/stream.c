@@ -0,0 +1,425 @@
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define STREAM_MMAP
+#endif
+
+#include "number.h"
+#include "stream.h"
+
+#define CHUNK_SIZE (1024 * 1024)
+#define OUTPUT_SIZE (1024 * 1024)
+#define LINE_OUTPUT_SIZE NUMBER_FORMAT_SIZE // Result and newline
+#define PARALLEL_CHUNK_SIZE (256 * 1024)
+#define PARALLEL_CHUNK_LINES 4096
+#define PARALLEL_ROUND_CHUNKS 16 // Per worker, between writes of the output
+
+typedef enum {
+    LINE_BLANK,
+    LINE_VALUE,
+    LINE_ERROR,
+} LineResult;
+
+typedef struct {
+    Parser *parser;
+    SymbolTable *symbol_table;
+    FILE *output;
+    char *buffer; // Pending output
+    size_t used;
+    bool failed;
+    StreamStats stats;
+} Stream;
+
+typedef struct {
+    const char *text;
+    size_t length;
+    size_t first_line;
+    size_t line_count;
+    size_t errors;
+    char *output; // Slice of the round output, LINE_OUTPUT_SIZE per line
+    size_t used;
+} ParallelChunk;
+
+typedef struct {
+    Parser parser;
+    SymbolTable locals;
+} ParallelWorker;
+
+typedef struct {
+    const SymbolTable *symbol_table;
+    ParallelChunk *chunks;
+    ParallelWorker *workers;
+    double *results;
+} ParallelStream;
+
+static bool is_blank(const char *line, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r') return false;
+    }
+    return true;
+}
+
+// Parses and evaluates one line, then clears the parser arena
+static LineResult evaluate_span(Parser *parser, const SymbolTable *symbol_table, SymbolTable *locals,
+                                const char *line, size_t length, double *value) {
+    *value = NAN;
+    if (is_blank(line, length)) return LINE_BLANK;
+
+    Node *root = parser_parse_span(parser, line, length);
+    if (root == NULL) return LINE_ERROR;
+
+    *value = env_evaluate_local(root, symbol_table, locals);
+    arena_clear(parser->arena);
+    return LINE_VALUE;
+}
+
+// Writes the result of a line and its newline, at most LINE_OUTPUT_SIZE bytes
+static char *write_result(char *cursor, LineResult result, double value) {
+    if (result == LINE_VALUE) {
+        cursor += number_format(value, cursor);
+    } else if (result == LINE_ERROR) {
+        memcpy(cursor, "nan", 3);
+        cursor += 3;
+    }
+
+    *cursor++ = '\n';
+    return cursor;
+}
+
+static void flush(Stream *stream) {
+    if (stream->used > 0 && fwrite(stream->buffer, 1, stream->used, stream->output) != stream->used) {
+        stream->failed = true;
+    }
+    stream->used = 0;
+}
+
+static void evaluate_line(Stream *stream, const char *line, size_t length) {
+    stream->stats.lines++;
+    if (OUTPUT_SIZE - stream->used < LINE_OUTPUT_SIZE) flush(stream);
+
+    double value;
+    LineResult result = evaluate_span(stream->parser, stream->symbol_table, stream->symbol_table, line, length, &value);
+
+    if (result == LINE_ERROR) {
+        fprintf(stderr, "Error: Invalid expression on line %zu\n", stream->stats.lines);
+        stream->stats.errors++;
+    }
+
+    char *cursor = write_result(stream->buffer + stream->used, result, value);
+    stream->used = (size_t)(cursor - stream->buffer);
+}
+
+// Evaluates the complete lines of [text, text + length) and returns the number
+// of bytes consumed, which excludes a trailing line without a newline
+static size_t evaluate_lines(Stream *stream, const char *text, size_t length) {
+    const char *cursor = text;
+    const char *end = text + length;
+
+    while (cursor < end) {
+        const char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        if (newline == NULL) break;
+
+        evaluate_line(stream, cursor, (size_t)(newline - cursor));
+        cursor = newline + 1;
+    }
+
+    return (size_t)(cursor - text);
+}
+
+#ifdef STREAM_MMAP
+// Maps a regular file as a whole. Returns NULL when it is empty or can't be
+// mapped, in which case it has to be read instead.
+static char *map_file(int descriptor, size_t *length) {
+    struct stat info;
+
+    if (descriptor < 0 || fstat(descriptor, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0) {
+        return NULL;
+    }
+
+    char *text = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    if (text == MAP_FAILED) return NULL;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(text, (size_t)info.st_size, MADV_SEQUENTIAL);
+#endif
+
+    *length = (size_t)info.st_size;
+    return text;
+}
+
+// Parses the lines of a mapped file where they lie. Returns false when the
+// input can't be mapped.
+static bool evaluate_mapped(Stream *stream, FILE *input) {
+    size_t length;
+    char *text = map_file(fileno(input), &length);
+    if (text == NULL) return false;
+
+    size_t consumed = evaluate_lines(stream, text, length);
+    if (consumed < length) evaluate_line(stream, text + consumed, length - consumed);
+
+    munmap(text, length);
+    return true;
+}
+#endif
+
+// Reads in large chunks, carrying an incomplete last line over to the next
+// read. The buffer grows when a single line does not fit.
+static bool evaluate_read(Stream *stream, FILE *input) {
+    size_t capacity = CHUNK_SIZE;
+    size_t carry = 0;
+    char *text = malloc(capacity);
+    if (text == NULL) {
+        fprintf(stderr, "Error: Unable to allocate stream input\n");
+        return false;
+    }
+
+    while (1) {
+        if (carry == capacity) {
+            char *grown = realloc(text, capacity * 2);
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Unable to allocate stream input\n");
+                free(text);
+                return false;
+            }
+            text = grown;
+            capacity *= 2;
+        }
+
+        size_t read = fread(text + carry, 1, capacity - carry, input);
+        if (read == 0) break;
+
+        size_t length = carry + read;
+        size_t consumed = evaluate_lines(stream, text, length);
+
+        carry = length - consumed;
+        memmove(text, text + consumed, carry);
+    }
+
+    if (carry > 0) evaluate_line(stream, text, carry);
+
+    bool ok = !ferror(input);
+    if (!ok) fprintf(stderr, "Error: Unable to read stream input\n");
+
+    free(text);
+    return ok;
+}
+
+// Evaluates every line of 'input' as a separate formula and writes one result
+// per line to 'output', in the shortest form that reads back as the same
+// double. Blank lines stay blank, and lines that fail to parse are written as
+// "nan". Assignments persist across lines. The parser arena is cleared after
+// every line. Returns false on a read or write error.
+bool stream_evaluate(Parser *parser, SymbolTable *symbol_table, FILE *input, FILE *output, StreamStats *stats) {
+    Stream stream = {
+        .parser = parser,
+        .symbol_table = symbol_table,
+        .output = output,
+        .buffer = malloc(OUTPUT_SIZE),
+    };
+
+    if (stream.buffer == NULL) {
+        fprintf(stderr, "Error: Unable to allocate stream output\n");
+        return false;
+    }
+
+    bool mapped = false;
+#ifdef STREAM_MMAP
+    mapped = evaluate_mapped(&stream, input);
+#endif
+    bool ok = mapped || evaluate_read(&stream, input);
+
+    flush(&stream);
+    free(stream.buffer);
+
+    if (stream.failed) {
+        fprintf(stderr, "Error: Unable to write stream output\n");
+        ok = false;
+    }
+
+    if (stats != NULL) *stats = stream.stats;
+    return ok;
+}
+
+// Maps the file, or reads it into memory where it can't be mapped
+bool stream_open(StreamFile *file, const char *path) {
+    *file = (StreamFile){0};
+
+    FILE *input = fopen(path, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "Error: Unable to open '%s'\n", path);
+        return false;
+    }
+
+#ifdef STREAM_MMAP
+    file->text = map_file(fileno(input), &file->length);
+    file->mapped = file->text != NULL;
+#endif
+
+    size_t capacity = CHUNK_SIZE;
+    while (!file->mapped) {
+        char *grown = realloc(file->text, capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Unable to allocate stream input\n");
+            break;
+        }
+
+        file->text = grown;
+        file->length += fread(file->text + file->length, 1, capacity - file->length, input);
+        if (file->length < capacity) break;
+        capacity *= 2;
+    }
+
+    bool ok = !ferror(input) && file->text != NULL;
+    fclose(input);
+
+    if (!ok) {
+        fprintf(stderr, "Error: Unable to read '%s'\n", path);
+        stream_close(file);
+    }
+    return ok;
+}
+
+void stream_close(StreamFile *file) {
+#ifdef STREAM_MMAP
+    if (file->mapped) munmap(file->text, file->length);
+#endif
+    if (!file->mapped) free(file->text);
+    *file = (StreamFile){0};
+}
+
+size_t stream_line_count(const char *text, size_t length) {
+    size_t count = 0;
+    const char *cursor = text;
+    const char *end = text + length;
+
+    while (cursor < end) {
+        const char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        count++;
+        if (newline == NULL) break;
+        cursor = newline + 1;
+    }
+
+    return count;
+}
+
+static void parallel_task(void *context, size_t task, int worker, Arena *scratch) {
+    (void)scratch;
+    ParallelStream *stream = context;
+    ParallelChunk *chunk = &stream->chunks[task];
+    ParallelWorker *state = &stream->workers[worker];
+
+    const char *cursor = chunk->text;
+    const char *end = chunk->text + chunk->length;
+    char *output = chunk->output;
+
+    for (size_t line = chunk->first_line; line < chunk->first_line + chunk->line_count; line++) {
+        const char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        size_t length = (newline != NULL) ? (size_t)(newline - cursor) : (size_t)(end - cursor);
+
+        double value;
+        LineResult result = evaluate_span(&state->parser, stream->symbol_table, &state->locals, cursor, length, &value);
+        symbol_table_clear(&state->locals);
+
+        if (result == LINE_ERROR) {
+            fprintf(stderr, "Error: Invalid expression on line %zu\n", line + 1);
+            chunk->errors++;
+        }
+
+        if (stream->results != NULL) stream->results[line] = value;
+        if (output != NULL) output = write_result(output, result, value);
+
+        cursor += length + 1;
+    }
+
+    if (output != NULL) chunk->used = (size_t)(output - chunk->output);
+}
+
+// Splits the text at line boundaries into chunks of at most PARALLEL_CHUNK_SIZE
+// bytes or PARALLEL_CHUNK_LINES lines, whichever comes first
+static size_t split_chunk(ParallelChunk *chunk, const char *text, const char *end, size_t first_line) {
+    const char *cursor = text;
+    size_t lines = 0;
+
+    while (cursor < end && lines < PARALLEL_CHUNK_LINES && (size_t)(cursor - text) < PARALLEL_CHUNK_SIZE) {
+        const char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        cursor = (newline != NULL) ? newline + 1 : end;
+        lines++;
+    }
+
+    *chunk = (ParallelChunk){.text = text, .length = (size_t)(cursor - text), .first_line = first_line, .line_count = lines};
+    return chunk->length;
+}
+
+// Evaluates every line of 'text' as an independent formula across the pool.
+// The symbol table is a snapshot that is only read while the workers run, and
+// assignments stay local to their line. Each worker has its own parser, and
+// processes line-aligned chunks of the text. Line i goes to results[i], which
+// must hold stream_line_count lines, and to line i of 'output'. Either can be
+// NULL. Blank lines and lines that fail to parse give NaN.
+bool stream_evaluate_parallel(const char *text, size_t length, const SymbolTable *symbol_table, double *results,
+                              FILE *output, StreamStats *stats, Pool *pool) {
+    int worker_count = pool_size(pool);
+    size_t round_chunks = (size_t)worker_count * PARALLEL_ROUND_CHUNKS;
+
+    ParallelWorker *workers = malloc(sizeof(ParallelWorker) * worker_count);
+    ParallelChunk *chunks = malloc(sizeof(ParallelChunk) * round_chunks);
+    char *buffer = (output != NULL) ? malloc(round_chunks * PARALLEL_CHUNK_LINES * LINE_OUTPUT_SIZE) : NULL;
+
+    if (workers == NULL || chunks == NULL || (output != NULL && buffer == NULL)) {
+        fprintf(stderr, "Error: Unable to allocate parallel stream\n");
+        free(workers);
+        free(chunks);
+        free(buffer);
+        return false;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].parser = parser_init();
+        workers[i].locals = symbol_table_init();
+        symbol_table_clear(&workers[i].locals); // Constants must not shadow the snapshot
+    }
+
+    ParallelStream stream = {symbol_table, chunks, workers, results};
+    StreamStats totals = {0};
+    const char *cursor = text;
+    const char *end = text + length;
+    bool ok = true;
+
+    while (cursor < end) {
+        size_t count = 0;
+        for (; count < round_chunks && cursor < end; count++) {
+            cursor += split_chunk(&chunks[count], cursor, end, totals.lines);
+            chunks[count].output = (buffer != NULL) ? buffer + count * PARALLEL_CHUNK_LINES * LINE_OUTPUT_SIZE : NULL;
+            totals.lines += chunks[count].line_count;
+        }
+
+        pool_run(pool, count, parallel_task, &stream);
+
+        for (size_t i = 0; i < count; i++) {
+            totals.errors += chunks[i].errors;
+            if (output != NULL && fwrite(chunks[i].output, 1, chunks[i].used, output) != chunks[i].used) ok = false;
+        }
+    }
+
+    if (!ok) fprintf(stderr, "Error: Unable to write stream output\n");
+
+    for (int i = 0; i < worker_count; i++) {
+        parser_free(&workers[i].parser);
+        symbol_table_free(&workers[i].locals);
+    }
+
+    free(workers);
+    free(chunks);
+    free(buffer);
+
+    if (stats != NULL) *stats = totals;
+    return ok;
+}
@@ -0,0 +1,345 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "vmath.h"
+
+#define VM_STACK_REGISTERS 64
+#define VM_STACK_SLOTS 64
+
+typedef struct {
+    const double **registers; // Current block of every register
+    const double **slots;     // Current block of every slot
+    double *storage;          // One block per register
+    double *constants;        // One broadcast block per constant
+    double *broadcast;        // One broadcast block per scalar input slot
+    double *locals;           // One block per slot, written by stores
+    uint8_t *flags;           // Error flags of the rows in the current block
+} BatchScratch;
+
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+// Labels as values are a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static double execute(const Program *program, double *slots, double *r) {
+    const Instruction *ip = program->code;
+    const double *constants = program->constants;
+
+#ifdef VM_COMPUTED_GOTO
+    static const void *dispatch[] = {
+        [OP_CONST]  = &&op_CONST,
+        [OP_LOAD]   = &&op_LOAD,
+        [OP_STORE]  = &&op_STORE,
+        [OP_MOVE]   = &&op_MOVE,
+        [OP_NEG]    = &&op_NEG,
+        [OP_FACT]   = &&op_FACT,
+        [OP_ADD]    = &&op_ADD,
+        [OP_SUB]    = &&op_SUB,
+        [OP_MUL]    = &&op_MUL,
+        [OP_DIV]    = &&op_DIV,
+        [OP_POW]    = &&op_POW,
+        [OP_CALL]   = &&op_CALL,
+        [OP_RETURN] = &&op_RETURN,
+    };
+
+    #define CASE(op) op_##op:
+    #define NEXT() goto *dispatch[(++ip)->op]
+    goto *dispatch[ip->op];
+#else
+    #define CASE(op) case OP_##op:
+    #define NEXT() ip++; continue
+    for (;;) switch (ip->op) {
+#endif
+
+    CASE(CONST) r[ip->dst] = constants[ip->a]; NEXT();
+    CASE(LOAD) r[ip->dst] = slots[ip->a]; NEXT();
+    CASE(STORE) slots[ip->dst] = r[ip->a]; NEXT();
+    CASE(MOVE) r[ip->dst] = r[ip->a]; NEXT();
+    CASE(NEG) r[ip->dst] = -r[ip->a]; NEXT();
+    CASE(FACT) r[ip->dst] = tgamma(r[ip->a] + 1); NEXT();
+    CASE(ADD) r[ip->dst] = r[ip->a] + r[ip->b]; NEXT();
+    CASE(SUB) r[ip->dst] = r[ip->a] - r[ip->b]; NEXT();
+    CASE(MUL) r[ip->dst] = r[ip->a] * r[ip->b]; NEXT();
+    CASE(DIV)
+        if (r[ip->b] == 0.0) {
+            fprintf(stderr, "Error: Division by zero\n");
+            r[ip->dst] = NAN;
+        } else {
+            r[ip->dst] = r[ip->a] / r[ip->b];
+        }
+        NEXT();
+    CASE(POW) r[ip->dst] = custom_pow(r[ip->a], r[ip->b]); NEXT();
+    CASE(CALL) r[ip->dst] = program->functions[ip->b]->function(&r[ip->a]); NEXT();
+    CASE(RETURN) return r[ip->a];
+
+#ifndef VM_COMPUTED_GOTO
+    }
+#endif
+
+    #undef CASE
+    #undef NEXT
+}
+
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+// Same contract as env_bind: unresolved slots fall back to a lookup
+int vm_bind(Program *program, SymbolTable *symbol_table) {
+    int unresolved = 0;
+
+    for (int i = 0; i < program->slot_count; i++) {
+        ProgramSlot *slot = &program->slots[i];
+        Symbol *symbol = symbol_table_get(symbol_table, slot->name, slot->length);
+
+        slot->symbol = symbol ? (int)(symbol - symbol_table->symbols) : -1;
+        if (symbol == NULL) unresolved++;
+    }
+
+    return unresolved;
+}
+
+double vm_run(const Program *program, double *slots) {
+    if (program->count == 0) return NAN;
+
+    double stack_registers[VM_STACK_REGISTERS];
+    double *registers = stack_registers;
+
+    if (program->register_count > VM_STACK_REGISTERS) {
+        registers = malloc(sizeof(double) * program->register_count);
+        if (registers == NULL) {
+            fprintf(stderr, "Error: Unable to allocate registers\n");
+            return NAN;
+        }
+    }
+
+    double result = execute(program, slots, registers);
+
+    if (registers != stack_registers) free(registers);
+    return result;
+}
+
+double vm_evaluate(const Program *program, SymbolTable *symbol_table) {
+    double stack_slots[VM_STACK_SLOTS];
+    double *slots = stack_slots;
+
+    if (program->slot_count > VM_STACK_SLOTS) {
+        slots = malloc(sizeof(double) * program->slot_count);
+        if (slots == NULL) {
+            fprintf(stderr, "Error: Unable to allocate slots\n");
+            return NAN;
+        }
+    }
+
+    for (int i = 0; i < program->slot_count; i++) {
+        const ProgramSlot *slot = &program->slots[i];
+        slots[i] = NAN;
+        if (!slot->input) continue;
+
+        if (slot->symbol >= 0) {
+            slots[i] = symbol_table->symbols[slot->symbol].value;
+            continue;
+        }
+
+        Symbol *symbol = symbol_table_get(symbol_table, slot->name, slot->length);
+        if (symbol) slots[i] = symbol->value;
+        else fprintf(stderr, "Error: Undefined variable '%.*s'\n", slot->length, slot->name);
+    }
+
+    double result = vm_run(program, slots);
+
+    for (int i = 0; i < program->slot_count; i++) {
+        const ProgramSlot *slot = &program->slots[i];
+        if (!slot->assigned) continue;
+
+        if (slot->symbol >= 0) symbol_table_store(symbol_table, slot->symbol, slots[i]);
+        else symbol_table_set(symbol_table, slot->name, slot->length, slots[i]);
+    }
+
+    if (slots != stack_slots) free(slots);
+    return result;
+}
+
+static size_t batch_blocks(const Program *program) {
+    return (size_t)program->register_count + program->constant_count + 2 * (size_t)program->slot_count;
+}
+
+static BatchScratch batch_layout(const Program *program, void *scratch) {
+    BatchScratch batch;
+    double *cursor = scratch;
+
+    batch.storage = cursor;
+    cursor += (size_t)program->register_count * VM_BLOCK_SIZE;
+    batch.constants = cursor;
+    cursor += (size_t)program->constant_count * VM_BLOCK_SIZE;
+    batch.broadcast = cursor;
+    cursor += (size_t)program->slot_count * VM_BLOCK_SIZE;
+    batch.locals = cursor;
+    cursor += (size_t)program->slot_count * VM_BLOCK_SIZE;
+
+    batch.registers = (const double **)cursor;
+    batch.slots = batch.registers + program->register_count;
+    batch.flags = (uint8_t *)(batch.slots + program->slot_count);
+
+    return batch;
+}
+
+static void broadcast(double *block, double value) {
+    for (size_t i = 0; i < VM_BLOCK_SIZE; i++) block[i] = value;
+}
+
+size_t vm_batch_scratch_size(const Program *program) {
+    return batch_blocks(program) * VM_BLOCK_SIZE * sizeof(double) +
+           ((size_t)program->register_count + program->slot_count) * sizeof(double *) +
+           VM_BLOCK_SIZE;
+}
+
+// Evaluates rows [first_row, first_row + row_count) a block at a time, so every
+// instruction becomes a tight loop over VM_BLOCK_SIZE values. Stores only update
+// the block-local copy of a slot, making assignments per-row locals. Returns the
+// number of rows with errors, whose flags are OR'ed into 'errors' when given.
+size_t vm_run_batch(const Program *program, const VmInput *inputs, size_t first_row, size_t row_count,
+                    double *out, uint8_t *errors, void *scratch) {
+    BatchScratch batch = batch_layout(program, scratch);
+    const double **R = batch.registers;
+    size_t error_rows = 0;
+
+    for (int i = 0; i < program->constant_count; i++)
+        broadcast(batch.constants + (size_t)i * VM_BLOCK_SIZE, program->constants[i]);
+
+    for (int i = 0; i < program->slot_count; i++) {
+        if (program->slots[i].input && inputs[i].column == NULL)
+            broadcast(batch.broadcast + (size_t)i * VM_BLOCK_SIZE, inputs[i].scalar);
+    }
+
+    for (size_t row = first_row; row < first_row + row_count; row += VM_BLOCK_SIZE) {
+        size_t n = first_row + row_count - row;
+        if (n > VM_BLOCK_SIZE) n = VM_BLOCK_SIZE;
+
+        for (int i = 0; i < program->slot_count; i++) {
+            if (program->slots[i].input && inputs[i].column != NULL) batch.slots[i] = inputs[i].column + row;
+            else if (program->slots[i].input) batch.slots[i] = batch.broadcast + (size_t)i * VM_BLOCK_SIZE;
+            else batch.slots[i] = batch.locals + (size_t)i * VM_BLOCK_SIZE;
+        }
+
+        memset(batch.flags, 0, n);
+        bool failed = false;
+
+        for (const Instruction *ip = program->code; ip->op != OP_RETURN; ip++) {
+            double *d = batch.storage + (size_t)ip->dst * VM_BLOCK_SIZE;
+            // Every opcode from OP_STORE on reads r[a], and the arithmetic ones read r[b]
+            const double *a = (ip->op >= OP_STORE) ? R[ip->a] : NULL;
+            const double *b = (ip->op >= OP_ADD && ip->op <= OP_POW) ? R[ip->b] : NULL;
+
+            switch (ip->op) {
+                case OP_CONST:
+                    R[ip->dst] = batch.constants + (size_t)ip->a * VM_BLOCK_SIZE;
+                    continue;
+
+                case OP_LOAD:
+                    // Stores overwrite the local block, so registers must not alias it
+                    if (program->slots[ip->a].assigned) {
+                        memcpy(d, batch.slots[ip->a], n * sizeof(double));
+                        R[ip->dst] = d;
+                    } else {
+                        R[ip->dst] = batch.slots[ip->a];
+                    }
+                    continue;
+
+                case OP_STORE: {
+                    double *local = batch.locals + (size_t)ip->dst * VM_BLOCK_SIZE;
+                    if (a != local) memcpy(local, a, n * sizeof(double));
+                    batch.slots[ip->dst] = local;
+                    continue;
+                }
+
+                case OP_MOVE:
+                    for (size_t i = 0; i < n; i++) d[i] = a[i];
+                    break;
+
+                case OP_NEG:
+                    for (size_t i = 0; i < n; i++) d[i] = -a[i];
+                    break;
+
+                case OP_FACT:
+                    vmath_factorial(a, d, n);
+                    break;
+
+                case OP_ADD:
+                    for (size_t i = 0; i < n; i++) d[i] = a[i] + b[i];
+                    break;
+
+                case OP_SUB:
+                    for (size_t i = 0; i < n; i++) d[i] = a[i] - b[i];
+                    break;
+
+                case OP_MUL:
+                    for (size_t i = 0; i < n; i++) d[i] = a[i] * b[i];
+                    break;
+
+                case OP_DIV: {
+                    uint8_t zero = 0;
+                    for (size_t i = 0; i < n; i++) {
+                        uint8_t flag = (b[i] == 0.0) ? EVAL_DIVISION_BY_ZERO : EVAL_OK;
+                        d[i] = flag ? NAN : a[i] / b[i];
+                        batch.flags[i] |= flag;
+                        zero |= flag;
+                    }
+                    failed |= zero != 0;
+                    break;
+                }
+
+                case OP_POW:
+                    vmath_pow(a, b, d, n);
+                    break;
+
+                case OP_CALL: {
+                    const Builtin *function = program->functions[ip->b];
+                    const double *arguments[BUILTIN_MAX_ARGUMENTS];
+                    for (int k = 0; k < function->arity; k++) arguments[k] = R[ip->a + k];
+
+                    if (function->batch) {
+                        function->batch(arguments, d, n);
+                        break;
+                    }
+
+                    if (function->arity == 1) {
+                        for (size_t i = 0; i < n; i++) d[i] = function->function(&a[i]);
+                        break;
+                    }
+
+                    double values[BUILTIN_MAX_ARGUMENTS];
+                    for (size_t i = 0; i < n; i++) {
+                        for (int k = 0; k < function->arity; k++) values[k] = arguments[k][i];
+                        d[i] = function->function(values);
+                    }
+                    break;
+                }
+            }
+
+            R[ip->dst] = d;
+        }
+
+        memcpy(out + row, R[program->code[program->count - 1].a], n * sizeof(double));
+
+        if (failed) {
+            for (size_t i = 0; i < n; i++) {
+                if (batch.flags[i] == EVAL_OK) continue;
+
+                error_rows++;
+                if (errors) errors[row + i] |= batch.flags[i];
+            }
+        }
+    }
+
+    return error_rows;
+}
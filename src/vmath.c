@@ -0,0 +1,420 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "environment.h"
+#include "vmath.h"
+
+// Values per pass of a fast kernel. Inputs are copied to a local array first,
+// because 'out' may alias them and the fallback pass still needs them.
+#define VMATH_CHUNK 256
+
+#define SHIFTER 0x1.8p52 // Adding it rounds to an integer, kept in the low mantissa bits
+
+#define LOG2E 1.44269504088896338700e+00
+#define LN2_HI 6.93147180369123816490e-01 // Trailing zeros keep k * LN2_HI exact
+#define LN2_LO 1.90821492927058770002e-10
+#define SQRT2 1.41421356237309514547e+00
+#define INV_LN10 4.34294481903251816668e-01
+
+#define PIO2_1 1.57079632673412561417e+00 // pi/2 in three parts of 33 bits
+#define PIO2_2 6.07710050630396597660e-11
+#define PIO2_3 2.02226624871116645580e-21
+#define TWO_OVER_PI 6.36619772367581382433e-01
+
+#define TRIG_LIMIT 0x1p20 // Largest argument the three-part reduction keeps accurate
+#define HYPERBOLIC_LIMIT 709.0
+#define INVERSE_LIMIT 0x1p26 // x * x stays finite and x + sqrt(x * x + 1) rounds to 2x beyond
+#define FACTORIAL_LIMIT 30.0 // The error of the Lanczos series grows with the argument
+
+#ifdef MATHPARSER_FAST_MATH
+static VmathMode mode = VMATH_FAST;
+#else
+static VmathMode mode = VMATH_STRICT;
+#endif
+
+void vmath_set_mode(VmathMode new_mode) {
+    mode = new_mode;
+}
+
+VmathMode vmath_mode() {
+    return mode;
+}
+
+static inline uint64_t bits_of(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+static inline double from_bits(uint64_t bits) {
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// The kernels below are branch free, so the compiler turns their loops into
+// SIMD code for the target (AVX2 or AVX-512 with -march=native). Inputs they
+// don't cover are redone with libm in a second pass.
+
+static inline double exp_kernel(double x) {
+    x = (x > 710.0) ? 710.0 : x; // NaN passes through both
+    x = (x < -746.0) ? -746.0 : x;
+
+    double shifted = x * LOG2E + SHIFTER;
+    double k = shifted - SHIFTER;
+    int64_t n = (int64_t)bits_of(shifted) - (int64_t)bits_of(SHIFTER);
+    double r = (x - k * LN2_HI) - k * LN2_LO;
+
+    // Taylor series, |r| <= ln(2) / 2
+    double p = 1.0 / 6227020800;
+    p = p * r + 1.0 / 479001600;
+    p = p * r + 1.0 / 39916800;
+    p = p * r + 1.0 / 3628800;
+    p = p * r + 1.0 / 362880;
+    p = p * r + 1.0 / 40320;
+    p = p * r + 1.0 / 5040;
+    p = p * r + 1.0 / 720;
+    p = p * r + 1.0 / 120;
+    p = p * r + 1.0 / 24;
+    p = p * r + 1.0 / 6;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+
+    // 2^n in two factors, so overflow and subnormal results come out right
+    int64_t half = n / 2;
+    double scale = from_bits((uint64_t)(half + 1023) << 52);
+    double rest = from_bits((uint64_t)(n - half + 1023) << 52);
+    return p * scale * rest;
+}
+
+static inline double log_kernel(double x) {
+    bool subnormal = x < 0x1p-1022;
+    double y = subnormal ? x * 0x1p54 : x;
+    uint64_t bits = bits_of(y);
+
+    // Exponent and mantissa, with the mantissa in [sqrt(2)/2, sqrt(2))
+    double e = from_bits(0x4330000000000000ull | ((bits >> 52) & 0x7ff)) - (0x1p52 + 1023);
+    e = subnormal ? e - 54 : e;
+    double m = from_bits((bits & 0x000fffffffffffffull) | 0x3ff0000000000000ull);
+    bool high = m > SQRT2;
+    m = high ? m * 0.5 : m;
+    e = high ? e + 1 : e;
+
+    // log(m) = 2 atanh(f) with f = (m - 1) / (m + 1), |f| < 0.172
+    double f = (m - 1.0) / (m + 1.0);
+    double s = f * f;
+    double p = 1.0 / 23;
+    p = p * s + 1.0 / 21;
+    p = p * s + 1.0 / 19;
+    p = p * s + 1.0 / 17;
+    p = p * s + 1.0 / 15;
+    p = p * s + 1.0 / 13;
+    p = p * s + 1.0 / 11;
+    p = p * s + 1.0 / 9;
+    p = p * s + 1.0 / 7;
+    p = p * s + 1.0 / 5;
+    p = p * s + 1.0 / 3;
+    double result = e * LN2_HI + (2.0 * f + (2.0 * f * s * p + e * LN2_LO));
+
+    double special = (x == 0.0) ? -INFINITY : (x == INFINITY) ? INFINITY : NAN;
+    return (x > 0.0 && x < INFINITY) ? result : special;
+}
+
+// log(1 + x), with the rounding error of 1 + x corrected
+static inline double log1p_kernel(double x) {
+    double u = 1.0 + x;
+    double d = u - 1.0;
+    double result = log_kernel(u) * (x / d); // Computed unconditionally, so the loop stays vectorized
+    return (d == 0.0 || x == INFINITY) ? x : result;
+}
+
+// Reduces x to r in [-pi/4, pi/4], with x = r + quadrant * pi/2
+static inline double trig_reduce(double x, int64_t *quadrant) {
+    double shifted = x * TWO_OVER_PI + SHIFTER;
+    double k = shifted - SHIFTER;
+    *quadrant = (int64_t)(bits_of(shifted) & 3);
+    return ((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_3;
+}
+
+static inline double sin_poly(double r) {
+    double s = r * r;
+    double p = 1.0 / 355687428096000;
+    p = -p * s + 1.0 / 1307674368000;
+    p = -p * s + 1.0 / 6227020800;
+    p = -p * s + 1.0 / 39916800;
+    p = -p * s + 1.0 / 362880;
+    p = -p * s + 1.0 / 5040;
+    p = -p * s + 1.0 / 120;
+    p = -p * s + 1.0 / 6;
+    return r - r * s * p;
+}
+
+static inline double cos_poly(double r) {
+    double s = r * r;
+    double p = 1.0 / 6402373705728000;
+    p = -p * s + 1.0 / 20922789888000;
+    p = -p * s + 1.0 / 87178291200;
+    p = -p * s + 1.0 / 479001600;
+    p = -p * s + 1.0 / 3628800;
+    p = -p * s + 1.0 / 40320;
+    p = -p * s + 1.0 / 720;
+    p = -p * s + 1.0 / 24;
+    return 1.0 - s * (0.5 - s * p);
+}
+
+static inline double sin_kernel(double x) {
+    int64_t quadrant;
+    double r = trig_reduce(x, &quadrant);
+    double value = (quadrant & 1) ? cos_poly(r) : sin_poly(r);
+    return (quadrant & 2) ? -value : value;
+}
+
+static inline double cos_kernel(double x) {
+    int64_t quadrant;
+    double r = trig_reduce(x, &quadrant);
+    double value = (quadrant & 1) ? sin_poly(r) : cos_poly(r);
+    return ((quadrant + 1) & 2) ? -value : value;
+}
+
+static inline double tan_kernel(double x) {
+    int64_t quadrant;
+    double r = trig_reduce(x, &quadrant);
+    double s = sin_poly(r), c = cos_poly(r);
+    return (quadrant & 1) ? -c / s : s / c;
+}
+
+// fdlibm's atan: the argument is moved next to 0, 0.5, 1, 1.5 or infinity,
+// whose arctangents are stored in two parts
+static inline double atan_kernel(double x) {
+    double t = fabs(x);
+
+    // u = (a t + b) / (c t + d) next to 0.5, 1 and 1.5
+    double a = 1.0, b = 0.0, c = 0.0, d = 1.0, high = 0.0, low = 0.0;
+    bool half = t >= 0.4375, one = t >= 0.6875, one_half = t >= 1.1875, infinite = t >= 2.4375;
+
+    a = half ? 2.0 : a;
+    b = half ? -1.0 : b;
+    c = half ? 1.0 : c;
+    d = half ? 2.0 : d;
+    high = half ? 4.63647609000806093515e-01 : high;
+    low = half ? 2.26987774529616870924e-17 : low;
+
+    a = one ? 1.0 : a;
+    d = one ? 1.0 : d;
+    high = one ? 7.85398163397448278999e-01 : high;
+    low = one ? 3.06161699786838301793e-17 : low;
+
+    b = one_half ? -1.5 : b;
+    c = one_half ? 1.5 : c;
+    high = one_half ? 9.82793723247329054082e-01 : high;
+    low = one_half ? 1.39033110312309984516e-17 : low;
+
+    high = infinite ? 1.57079632679489655800e+00 : high;
+    low = infinite ? 6.12323399573676603587e-17 : low;
+
+    double u = (a * t + b) / (c * t + d);
+    u = infinite ? -1.0 / t : u;
+
+    double z = u * u, w = z * z;
+    double s1 = z * (3.33333333333329318027e-01 +
+                     w * (1.42857142725034663711e-01 +
+                          w * (9.09088713343650656196e-02 +
+                               w * (6.66107313738753120669e-02 +
+                                    w * (4.97687799461593236017e-02 + w * 1.62858201153657823623e-02)))));
+    double s2 = w * (-1.99999999998764832476e-01 +
+                     w * (-1.11111104054623557880e-01 +
+                          w * (-7.69187620504482999495e-02 +
+                               w * (-5.83357013379057348645e-02 + w * -3.65315727442169155270e-02))));
+
+    double result = high - ((u * (s1 + s2) - low) - u);
+    return copysign(result, x);
+}
+
+static inline double asin_kernel(double x) {
+    return atan_kernel(x / sqrt((1.0 - x) * (1.0 + x)));
+}
+
+static inline double acos_kernel(double x) {
+    return 2.0 * atan_kernel(sqrt((1.0 - x) / (1.0 + x)));
+}
+
+// Taylor series of sinh, for |x| <= 1
+static inline double sinh_series(double x) {
+    double s = x * x;
+    double p = 1.0 / 355687428096000;
+    p = p * s + 1.0 / 1307674368000;
+    p = p * s + 1.0 / 6227020800;
+    p = p * s + 1.0 / 39916800;
+    p = p * s + 1.0 / 362880;
+    p = p * s + 1.0 / 5040;
+    p = p * s + 1.0 / 120;
+    p = p * s + 1.0 / 6;
+    return x + x * s * p;
+}
+
+static inline double sinh_kernel(double x) {
+    double e = exp_kernel(fabs(x));
+    double large = 0.5 * (e - 1.0 / e);
+    large = (x < 0.0) ? -large : large;
+    return (fabs(x) <= 1.0) ? sinh_series(x) : large;
+}
+
+static inline double cosh_kernel(double x) {
+    double e = exp_kernel(fabs(x));
+    return 0.5 * (e + 1.0 / e);
+}
+
+static inline double tanh_kernel(double x) {
+    double t = fabs(x);
+    double e = exp_kernel(t);
+    double small = sinh_series(x) / (0.5 * (e + 1.0 / e));
+    double large = 1.0 - 2.0 / (e * e + 1.0);
+    large = (x < 0.0) ? -large : large;
+    return (t <= 1.0) ? small : large;
+}
+
+static inline double asinh_kernel(double x) {
+    double t = fabs(x);
+    double s = t * t;
+    double result = log1p_kernel(t + s / (1.0 + sqrt(1.0 + s)));
+    return copysign(result, x);
+}
+
+static inline double acosh_kernel(double x) {
+    double t = x - 1.0;
+    return log1p_kernel(t + sqrt(2.0 * t + t * t));
+}
+
+static inline double atanh_kernel(double x) {
+    double t = fabs(x);
+    double result = 0.5 * log1p_kernel(2.0 * t / (1.0 - t));
+    return copysign(result, x);
+}
+
+static inline double log10_kernel(double x) {
+    return log_kernel(x) * INV_LN10;
+}
+
+// Positive finite bases only
+static inline double pow_kernel(double a, double b) {
+    return exp_kernel(b * log_kernel(a));
+}
+
+// Lanczos approximation (g = 7, 9 terms) of gamma(x + 1), for x > -0.5
+static inline double factorial_kernel(double x) {
+    double sum = 0.99999999999980993;
+    sum += 676.5203681218851 / (x + 1.0);
+    sum += -1259.1392167224028 / (x + 2.0);
+    sum += 771.32342877765313 / (x + 3.0);
+    sum += -176.61502916214059 / (x + 4.0);
+    sum += 12.507343278686905 / (x + 5.0);
+    sum += -0.13857109526572012 / (x + 6.0);
+    sum += 9.9843695780195716e-6 / (x + 7.0);
+    sum += 1.5056327351493116e-7 / (x + 8.0);
+
+    double t = x + 7.5;
+    return 2.5066282746310002 * exp_kernel((x + 0.5) * log_kernel(t) - t) * sum;
+}
+
+// The reduction turns -0 into +0, so zeros go to libm as well
+static inline bool trig_outside(double x) {
+    return fabs(x) > TRIG_LIMIT || x == 0.0;
+}
+
+static inline bool hyperbolic_outside(double x) {
+    return fabs(x) > HYPERBOLIC_LIMIT;
+}
+
+static inline bool inverse_outside(double x) {
+    return fabs(x) > INVERSE_LIMIT;
+}
+
+static inline bool never_outside(double x) {
+    (void)x;
+    return false;
+}
+
+static inline bool pow_outside(double a, double b) {
+    return !(a > 0.0 && a < INFINITY && fabs(b) < INFINITY);
+}
+
+// Integers keep their exact factorials from tgamma
+static inline bool factorial_outside(double x) {
+    return !(x > -0.5 && x < FACTORIAL_LIMIT) || x == floor(x);
+}
+
+static double factorial(double x) {
+    return tgamma(x + 1.0);
+}
+
+// Defines vmath_'fn', running libm's 'fn' in strict mode and 'kernel' in
+// fast mode, with libm again for the inputs 'outside' the kernel's range
+#define UNARY_KERNEL(fn, kernel, outside)                                            \
+    void vmath_##fn(const double *x, double *out, size_t count) {                    \
+        if (mode == VMATH_STRICT) {                                                  \
+            for (size_t i = 0; i < count; i++) out[i] = fn(x[i]);                    \
+            return;                                                                  \
+        }                                                                            \
+                                                                                     \
+        double in[VMATH_CHUNK];                                                      \
+        for (size_t start = 0; start < count; start += VMATH_CHUNK) {                \
+            size_t n = (count - start < VMATH_CHUNK) ? count - start : VMATH_CHUNK;  \
+            memcpy(in, x + start, n * sizeof(double));                               \
+                                                                                     \
+            double *o = out + start;                                                 \
+            for (size_t i = 0; i < n; i++) o[i] = kernel(in[i]);                     \
+            for (size_t i = 0; i < n; i++) {                                         \
+                if (outside(in[i])) o[i] = fn(in[i]);                                \
+            }                                                                        \
+        }                                                                            \
+    }
+
+UNARY_KERNEL(sin, sin_kernel, trig_outside)
+UNARY_KERNEL(cos, cos_kernel, trig_outside)
+UNARY_KERNEL(tan, tan_kernel, trig_outside)
+UNARY_KERNEL(asin, asin_kernel, never_outside)
+UNARY_KERNEL(acos, acos_kernel, never_outside)
+UNARY_KERNEL(atan, atan_kernel, never_outside)
+UNARY_KERNEL(sinh, sinh_kernel, hyperbolic_outside)
+UNARY_KERNEL(cosh, cosh_kernel, hyperbolic_outside)
+UNARY_KERNEL(tanh, tanh_kernel, never_outside)
+UNARY_KERNEL(asinh, asinh_kernel, inverse_outside)
+UNARY_KERNEL(acosh, acosh_kernel, inverse_outside)
+UNARY_KERNEL(atanh, atanh_kernel, never_outside)
+UNARY_KERNEL(log, log_kernel, never_outside)
+UNARY_KERNEL(log10, log10_kernel, never_outside)
+UNARY_KERNEL(exp, exp_kernel, never_outside)
+UNARY_KERNEL(factorial, factorial_kernel, factorial_outside)
+
+// Exact in both modes
+void vmath_fabs(const double *x, double *out, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = fabs(x[i]);
+}
+
+void vmath_sqrt(const double *x, double *out, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = sqrt(x[i]);
+}
+
+// Negative and zero bases keep the rules of custom_pow
+void vmath_pow(const double *a, const double *b, double *out, size_t count) {
+    if (mode == VMATH_STRICT) {
+        for (size_t i = 0; i < count; i++) out[i] = custom_pow(a[i], b[i]);
+        return;
+    }
+
+    double base[VMATH_CHUNK], exponent[VMATH_CHUNK];
+    for (size_t start = 0; start < count; start += VMATH_CHUNK) {
+        size_t n = (count - start < VMATH_CHUNK) ? count - start : VMATH_CHUNK;
+        memcpy(base, a + start, n * sizeof(double));
+        memcpy(exponent, b + start, n * sizeof(double));
+
+        double *o = out + start;
+        for (size_t i = 0; i < n; i++) o[i] = pow_kernel(base[i], exponent[i]);
+        for (size_t i = 0; i < n; i++) {
+            if (pow_outside(base[i], exponent[i])) o[i] = custom_pow(base[i], exponent[i]);
+        }
+    }
+}
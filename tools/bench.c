@@ -0,0 +1,332 @@
+// Times the pipeline on synthetic expressions and prints one CSV row per
+// measurement, so runs can be compared across releases.
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "environment.h"
+#include "jit.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "vm.h"
+
+#define BENCH_MIN_SECONDS 0.2
+
+typedef struct {
+    int depth;       // Levels of operators above the leaves
+    int width;       // Operands per level
+    double literals; // Share of leaves that are numbers instead of variables
+    int variables;   // Distinct variable names
+} Shape;
+
+typedef struct {
+    Shape shape;
+    char *text;
+    size_t length;
+    Node *root;
+    long nodes;
+    Parser parser;
+    SymbolTable symbol_table;
+    Program program;
+    Jit jit;
+    double *slots;
+} Case;
+
+typedef void (*BenchFn)(void *context, long iterations);
+
+static const Shape shapes[] = {
+    {3, 2, 0.5, 4},   {6, 2, 0.5, 4},   {10, 2, 0.5, 4}, {4, 4, 0.5, 4},
+    {4, 4, 0.1, 4},   {4, 4, 0.9, 4},   {4, 4, 0.5, 64}, {4, 4, 0.5, 1024},
+};
+
+static const int lookup_sizes[] = {10, 100, 1000, 10000};
+
+static volatile double sink;
+static uint64_t state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next_random() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static double uniform() {
+    return (double)(next_random() >> 11) * 0x1p-53;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+// Runs 'fn' in doubling batches until one takes long enough, and returns the
+// nanoseconds per iteration of that batch
+static double measure(BenchFn fn, void *context) {
+    for (long iterations = 1;; iterations *= 2) {
+        double start = now();
+        fn(context, iterations);
+        double elapsed = now() - start;
+        if (elapsed >= BENCH_MIN_SECONDS) return elapsed * 1e9 / (double)iterations;
+    }
+}
+
+// Shape columns that don't apply to a benchmark are left empty
+static void report(const char *benchmark, const Shape *shape, const char *metric, double value) {
+    if (shape && shape->depth > 0) {
+        printf("%s,%d,%d,%.2f,%d,%s,%.3f\n", benchmark, shape->depth, shape->width, shape->literals,
+               shape->variables, metric, value);
+    } else if (shape) {
+        printf("%s,,,,%d,%s,%.3f\n", benchmark, shape->variables, metric, value);
+    } else {
+        printf("%s,,,,,%s,%.3f\n", benchmark, metric, value);
+    }
+}
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static void append(Buffer *buffer, const char *text) {
+    size_t length = strlen(text);
+    if (buffer->length + length + 1 > buffer->capacity) {
+        buffer->capacity = (buffer->capacity + length + 1) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if (buffer->data == NULL) {
+            fprintf(stderr, "Error: Unable to allocate expression\n");
+            exit(1);
+        }
+    }
+
+    memcpy(buffer->data + buffer->length, text, length + 1);
+    buffer->length += length;
+}
+
+// Operands joined by +, - and *, with some levels wrapped in sin or cos.
+// Divisions are left out so evaluation never reports errors.
+static void generate(Buffer *buffer, const Shape *shape, int depth) {
+    char leaf[32];
+
+    if (depth == 0) {
+        if (uniform() < shape->literals) snprintf(leaf, sizeof(leaf), "%.3g", 0.5 + uniform());
+        else snprintf(leaf, sizeof(leaf), "v%d", (int)(next_random() % (uint64_t)shape->variables));
+        append(buffer, leaf);
+        return;
+    }
+
+    static const char *operators[] = {" + ", " - ", " * "};
+    static const char *functions[] = {"sin(", "cos("};
+    bool call = next_random() % 4 == 0;
+
+    append(buffer, call ? functions[next_random() % 2] : "(");
+    for (int i = 0; i < shape->width; i++) {
+        if (i > 0) append(buffer, operators[next_random() % 3]);
+        generate(buffer, shape, depth - 1);
+    }
+    append(buffer, ")");
+}
+
+static void lex(void *context, long iterations) {
+    Case *c = context;
+    Lexer lexer = {0};
+    long tokens = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        lexer_reset(&lexer, c->text);
+        while (lexer_next(&lexer).type != TOK_EOF) tokens++;
+    }
+
+    sink = (double)tokens;
+}
+
+static long count_tokens(const char *text) {
+    Lexer lexer = {0};
+    long tokens = 0;
+    lexer_reset(&lexer, text);
+    while (lexer_next(&lexer).type != TOK_EOF) tokens++;
+    return tokens;
+}
+
+static void parse(void *context, long iterations) {
+    Case *c = context;
+    Parser parser = parser_init();
+
+    for (long i = 0; i < iterations; i++) {
+        sink = (double)(uintptr_t)parser_parse(&parser, c->text);
+        arena_clear(parser.arena);
+    }
+
+    parser_free(&parser);
+}
+
+static void evaluate(void *context, long iterations) {
+    Case *c = context;
+    double sum = 0.0;
+    for (long i = 0; i < iterations; i++) sum += env_evaluate(c->root, &c->symbol_table);
+    sink = sum;
+}
+
+static void run_vm(void *context, long iterations) {
+    Case *c = context;
+    double sum = 0.0;
+    for (long i = 0; i < iterations; i++) sum += vm_run(&c->program, c->slots);
+    sink = sum;
+}
+
+static void run_jit(void *context, long iterations) {
+    Case *c = context;
+    double sum = 0.0;
+    for (long i = 0; i < iterations; i++) sum += jit_run(&c->jit, c->slots);
+    sink = sum;
+}
+
+static void set_variables(SymbolTable *symbol_table, int count) {
+    char name[16];
+    for (int i = 0; i < count; i++) {
+        int length = snprintf(name, sizeof(name), "v%d", i);
+        symbol_table_set(symbol_table, name, length, 0.5 + 0.001 * i);
+    }
+}
+
+static void bench_shape(const Shape *shape) {
+    Case c = {0};
+    c.shape = *shape;
+
+    Buffer buffer = {0};
+    generate(&buffer, shape, shape->depth);
+    c.text = buffer.data;
+    c.length = buffer.length;
+
+    c.parser = parser_init();
+    c.root = parser_parse(&c.parser, c.text);
+    if (c.root == NULL) {
+        fprintf(stderr, "Error: Generated expression does not parse\n");
+        exit(1);
+    }
+    c.nodes = optimizer_count(c.root).total;
+
+    double lex_ns = measure(lex, &c);
+    report("lex", shape, "ns_per_token", lex_ns / (double)count_tokens(c.text));
+    report("lex", shape, "mb_per_s", (double)c.length / lex_ns * 1e3);
+    report("parse", shape, "ns_per_node", measure(parse, &c) / (double)c.nodes);
+
+    c.symbol_table = symbol_table_init();
+    set_variables(&c.symbol_table, shape->variables);
+    report("evaluate", shape, "ns_per_eval", measure(evaluate, &c));
+
+    env_bind(c.root, &c.symbol_table);
+    report("evaluate_bound", shape, "ns_per_eval", measure(evaluate, &c));
+
+    c.program = program_init();
+    compiler_compile(&c.program, c.root);
+    c.slots = malloc(sizeof(double) * (size_t)(c.program.slot_count + 1));
+    for (int i = 0; i < c.program.slot_count; i++) {
+        const ProgramSlot *slot = &c.program.slots[i];
+        Symbol *symbol = symbol_table_get(&c.symbol_table, slot->name, slot->length);
+        c.slots[i] = symbol ? symbol->value : 0.0;
+    }
+    report("vm", shape, "ns_per_eval", measure(run_vm, &c));
+
+    c.jit = jit_init();
+    jit_compile(&c.jit, c.root);
+    if (c.jit.native != NULL) report("jit", shape, "ns_per_eval", measure(run_jit, &c));
+
+    jit_free(&c.jit);
+    program_free(&c.program);
+    free(c.slots);
+    symbol_table_free(&c.symbol_table);
+    parser_free(&c.parser);
+    free(buffer.data);
+}
+
+typedef struct {
+    SymbolTable symbol_table;
+    char (*names)[16];
+    int *lengths;
+    int count;
+} Lookup;
+
+static void lookup(void *context, long iterations) {
+    Lookup *l = context;
+    long found = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        int k = (int)(i % l->count);
+        found += symbol_table_get(&l->symbol_table, l->names[k], l->lengths[k]) != NULL;
+    }
+
+    sink = (double)found;
+}
+
+static void bench_lookup(int count) {
+    Lookup l = {symbol_table_init(), malloc(sizeof(*l.names) * (size_t)count), malloc(sizeof(int) * (size_t)count),
+                count};
+    if (l.names == NULL || l.lengths == NULL) {
+        fprintf(stderr, "Error: Unable to allocate symbols\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        l.lengths[i] = snprintf(l.names[i], sizeof(l.names[i]), "symbol_%d", i);
+        symbol_table_set(&l.symbol_table, l.names[i], l.lengths[i], (double)i);
+    }
+
+    Shape shape = {0, 0, 0.0, count};
+    report("lookup", &shape, "ns_per_lookup", measure(lookup, &l));
+
+    symbol_table_free(&l.symbol_table);
+    free(l.names);
+    free(l.lengths);
+}
+
+typedef struct {
+    double base;
+    double exponent;
+} Power;
+
+static void power(void *context, long iterations) {
+    Power *p = context;
+    double sum = 0.0;
+    // The base changes slightly so the calls are not hoisted out of the loop
+    for (long i = 0; i < iterations; i++) sum += custom_pow(p->base - (double)(i & 7) * 1e-3, p->exponent);
+    sink = sum;
+}
+
+static void bench_power() {
+    static const struct {
+        const char *name;
+        Power power;
+    } cases[] = {
+        {"pow_square", {1.5, 2.0}},
+        {"pow_sqrt", {1.5, 0.5}},
+        {"pow_positive", {1.5, 0.3}},
+        {"pow_negative_integer", {-1.5, 3.0}},
+        {"pow_negative_rational", {-8.0, 1.0 / 3.0}},
+        {"pow_negative_irrational", {-8.0, 0.3}},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        Power p = cases[i].power;
+        report(cases[i].name, NULL, "ns_per_call", measure(power, &p));
+    }
+}
+
+int main() {
+    printf("benchmark,depth,width,literals,variables,metric,value\n");
+
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) bench_shape(&shapes[i]);
+    for (size_t i = 0; i < sizeof(lookup_sizes) / sizeof(lookup_sizes[0]); i++) bench_lookup(lookup_sizes[i]);
+    bench_power();
+
+    return 0;
+}
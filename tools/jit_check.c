@@ -0,0 +1,200 @@
+// Differential test of the evaluators: random expressions are run by jit_run,
+// vm_run and env_evaluate, and every result and assigned variable must match
+// bit for bit. Exits with a failure status on the first mismatches.
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "compiler.h"
+#include "environment.h"
+#include "jit.h"
+#include "parser.h"
+#include "vm.h"
+
+#define EXPRESSIONS 20000
+#define INPUTS 4          // Sets of variable values per expression
+#define MAX_DEPTH 5
+#define MAX_REPORTS 10
+#define TEXT_SIZE 16384
+
+static const char *variables[] = {"x", "y", "z"};
+static const char *assigned[] = {"u", "w"};
+static const char *literals[] = {"0", "1", "2", "0.5", "3", "1e300", "pi"};
+static const char *functions[] = {"sin", "cos", "tan", "arcsin", "arccos", "arctan", "sinh", "cosh", "tanh",
+                                  "arcsinh", "arccosh", "arctanh", "abs", "sqrt", "ln", "log", "exp", "digamma"};
+static const char *operators[] = {" + ", " - ", " * ", " / ", " ^ "};
+
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+static uint64_t state = 0x2545f4914f6cdd1dull;
+
+static uint64_t next_random() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static const char *pick(const char **choices, size_t count) {
+    return choices[next_random() % count];
+}
+
+static double hypotenuse(const double *arguments) {
+    return sqrt(arguments[0] * arguments[0] + arguments[1] * arguments[1]);
+}
+
+// Not pure, so calls are neither folded nor shared
+static double clamp(const double *arguments) {
+    return fmin(fmax(arguments[0], -arguments[1]), arguments[1]);
+}
+
+static void append(char *text, const char *part) {
+    if (strlen(text) + strlen(part) < TEXT_SIZE) strcat(text, part);
+}
+
+// Covers every operator and node type, including assignments, '!', divisions
+// by zero and registered functions
+static void generate(char *text, int depth) {
+    int choice = (int)(next_random() % 16);
+
+    if (depth == 0 || choice < 3) {
+        int leaf = (int)(next_random() % 3);
+        if (leaf == 0) append(text, pick(variables, COUNT(variables)));
+        else if (leaf == 1) append(text, pick(literals, COUNT(literals)));
+        else append(text, pick(assigned, COUNT(assigned)));
+        return;
+    }
+
+    if (choice < 6) {
+        append(text, pick(functions, COUNT(functions)));
+        append(text, "(");
+        generate(text, depth - 1);
+        append(text, ")");
+    } else if (choice == 6) {
+        append(text, (next_random() % 2) ? "hypotenuse(" : "clamp(");
+        generate(text, depth - 1);
+        append(text, ", ");
+        generate(text, depth - 1);
+        append(text, ")");
+    } else if (choice == 7) {
+        append(text, "(");
+        append(text, pick(assigned, COUNT(assigned)));
+        append(text, " = ");
+        generate(text, depth - 1);
+        append(text, ")");
+    } else if (choice == 8) {
+        append(text, "(");
+        generate(text, depth - 1);
+        append(text, (next_random() % 2) ? " / 0)" : " / (x - x))");
+    } else if (choice == 9) {
+        append(text, "-");
+        generate(text, depth - 1);
+    } else {
+        append(text, "(");
+        generate(text, depth - 1);
+        append(text, pick(operators, COUNT(operators)));
+        generate(text, depth - 1);
+        append(text, ")");
+    }
+
+    if (next_random() % 10 == 0) append(text, "!");
+}
+
+// Any two NaNs match. When both operands of an operation are NaN, the sign of
+// the result depends on which one the hardware propagates, and the C compiler
+// may swap the operands of '+' and '*'.
+static bool same(double a, double b) {
+    if (isnan(a) || isnan(b)) return isnan(a) && isnan(b);
+    return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+static double input(int set) {
+    static const double values[] = {0.0, -0.0, 1.0, -1.0, 0.5, 2.5, -3.0, 7.0, 1e-300, 1e300, INFINITY, NAN};
+    if (set == 0) return values[next_random() % COUNT(values)];
+    return (double)((int64_t)(next_random() % 2001) - 1000) / 100.0;
+}
+
+// Runs one expression on every input set and returns the number of mismatches
+static int check(const char *text, Node *root, Jit *jit, SymbolTable *symbol_table) {
+    int mismatches = 0;
+    int slot_count = jit->program.slot_count;
+    double *jit_slots = malloc(sizeof(double) * (size_t)(slot_count + 1));
+    double *vm_slots = malloc(sizeof(double) * (size_t)(slot_count + 1));
+    if (jit_slots == NULL || vm_slots == NULL) {
+        fprintf(stderr, "Error: Unable to allocate slots\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int set = 0; set < INPUTS; set++) {
+        for (size_t i = 0; i < COUNT(variables); i++) symbol_table_set(symbol_table, variables[i], 1, input(set));
+        for (size_t i = 0; i < COUNT(assigned); i++) symbol_table_set(symbol_table, assigned[i], 1, input(set));
+
+        for (int i = 0; i < slot_count; i++) {
+            const ProgramSlot *slot = &jit->program.slots[i];
+            Symbol *symbol = symbol_table_get(symbol_table, slot->name, slot->length);
+            jit_slots[i] = vm_slots[i] = symbol ? symbol->value : 0.0;
+        }
+
+        double jit_value = jit_run(jit, jit_slots);
+        double vm_value = vm_run(&jit->program, vm_slots);
+        double tree_value = env_evaluate(root, symbol_table);
+
+        bool ok = same(jit_value, vm_value) && same(jit_value, tree_value);
+        for (int i = 0; ok && i < slot_count; i++) {
+            const ProgramSlot *slot = &jit->program.slots[i];
+            Symbol *symbol = symbol_table_get(symbol_table, slot->name, slot->length);
+            ok = same(jit_slots[i], vm_slots[i]) && (!slot->assigned || same(jit_slots[i], symbol->value));
+        }
+
+        if (!ok && mismatches++ == 0) {
+            printf("Mismatch: %s\n  jit %.17g, vm %.17g, env_evaluate %.17g\n", text, jit_value, vm_value,
+                   tree_value);
+        }
+    }
+
+    free(jit_slots);
+    free(vm_slots);
+    return mismatches;
+}
+
+int main() {
+    builtin_register("hypotenuse", 2, hypotenuse, NULL, BUILTIN_PURE);
+    builtin_register("clamp", 2, clamp, NULL, 0);
+
+    // Divisions by zero report errors on every path
+    if (freopen("/dev/null", "w", stderr) == NULL) return EXIT_FAILURE;
+
+    Parser parser = parser_init();
+    SymbolTable symbol_table = symbol_table_init();
+    Jit jit = jit_init();
+    char *text = malloc(TEXT_SIZE);
+    long checked = 0, native = 0, failed = 0;
+
+    for (int i = 0; i < EXPRESSIONS; i++) {
+        text[0] = '\0';
+        generate(text, MAX_DEPTH);
+
+        Node *root = parser_parse(&parser, text);
+        if (root == NULL || !jit_compile(&jit, root)) {
+            printf("Error: Generated expression does not compile: %s\n", text);
+            return EXIT_FAILURE;
+        }
+
+        checked++;
+        native += jit.native != NULL;
+        if (check(text, root, &jit, &symbol_table) > 0 && ++failed >= MAX_REPORTS) break;
+        arena_clear(parser.arena);
+    }
+
+    printf("%ld expressions, %ld as native code, %ld mismatching\n", checked, native, failed);
+
+    jit_free(&jit);
+    symbol_table_free(&symbol_table);
+    parser_free(&parser);
+    free(text);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
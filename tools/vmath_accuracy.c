@@ -0,0 +1,116 @@
+// Measures the fast vmath kernels against libm: the largest and mean error in
+// ulp over random arguments, and the throughput of both modes.
+#define _POSIX_C_SOURCE 199309L
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vmath.h"
+
+#define SAMPLES (1 << 20)
+#define ROUNDS 20
+
+typedef void (*UnaryFn)(const double *x, double *out, size_t count);
+
+typedef struct {
+    const char *name;
+    UnaryFn unary;
+    double low; // Range of the first argument, sampled uniformly
+    double high;
+} Case;
+
+static const Case cases[] = {
+    {"sin", vmath_sin, -100.0, 100.0},
+    {"cos", vmath_cos, -100.0, 100.0},
+    {"tan", vmath_tan, -100.0, 100.0},
+    {"arcsin", vmath_asin, -1.0, 1.0},
+    {"arccos", vmath_acos, -1.0, 1.0},
+    {"arctan", vmath_atan, -20.0, 20.0},
+    {"sinh", vmath_sinh, -20.0, 20.0},
+    {"cosh", vmath_cosh, -20.0, 20.0},
+    {"tanh", vmath_tanh, -5.0, 5.0},
+    {"arcsinh", vmath_asinh, -100.0, 100.0},
+    {"arccosh", vmath_acosh, 1.0, 100.0},
+    {"arctanh", vmath_atanh, -1.0, 1.0},
+    {"abs", vmath_fabs, -100.0, 100.0},
+    {"sqrt", vmath_sqrt, 0.0, 100.0},
+    {"ln", vmath_log, 0.0, 100.0},
+    {"log", vmath_log10, 0.0, 100.0},
+    {"exp", vmath_exp, -700.0, 700.0},
+    {"x!", vmath_factorial, -0.5, 30.0},
+    {"^", NULL, 0.0, 10.0}, // Exponents in [-20, 20]
+};
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+// Distance between two doubles in units in the last place
+static double ulp_distance(double a, double b) {
+    if (isnan(a) || isnan(b)) return (isnan(a) && isnan(b)) ? 0.0 : INFINITY;
+
+    int64_t x, y;
+    memcpy(&x, &a, sizeof(x));
+    memcpy(&y, &b, sizeof(y));
+    if (x < 0) x = INT64_MIN - x;
+    if (y < 0) y = INT64_MIN - y;
+    return (double)((x > y) ? (uint64_t)x - (uint64_t)y : (uint64_t)y - (uint64_t)x);
+}
+
+static double run(const Case *c, const double *x, const double *y, double *out, VmathMode mode) {
+    vmath_set_mode(mode);
+    double start = now();
+
+    for (int round = 0; round < ROUNDS; round++) {
+        if (c->unary) c->unary(x, out, SAMPLES);
+        else vmath_pow(x, y, out, SAMPLES);
+    }
+
+    return (double)SAMPLES * ROUNDS / (now() - start) * 1e-6;
+}
+
+int main() {
+    double *x = malloc(sizeof(double) * SAMPLES);
+    double *y = malloc(sizeof(double) * SAMPLES);
+    double *strict = malloc(sizeof(double) * SAMPLES);
+    double *fast = malloc(sizeof(double) * SAMPLES);
+    if (!x || !y || !strict || !fast) {
+        fprintf(stderr, "Error: Unable to allocate samples\n");
+        return 1;
+    }
+
+    printf("%-8s %12s %12s %14s %14s\n", "function", "max ulp", "mean ulp", "strict Mval/s", "fast Mval/s");
+    srand(1);
+
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        const Case *c = &cases[k];
+        for (int i = 0; i < SAMPLES; i++) {
+            x[i] = c->low + (c->high - c->low) * rand() / (double)RAND_MAX;
+            y[i] = -20.0 + 40.0 * rand() / (double)RAND_MAX;
+        }
+
+        double strict_speed = run(c, x, y, strict, VMATH_STRICT);
+        double fast_speed = run(c, x, y, fast, VMATH_FAST);
+
+        double max = 0.0, sum = 0.0;
+        for (int i = 0; i < SAMPLES; i++) {
+            double distance = ulp_distance(strict[i], fast[i]);
+            if (distance > max) max = distance;
+            sum += distance;
+        }
+
+        printf("%-8s %12.0f %12.3f %14.1f %14.1f\n", c->name, max, sum / SAMPLES, strict_speed, fast_speed);
+    }
+
+    free(x);
+    free(y);
+    free(strict);
+    free(fast);
+    return 0;
+}